@@ -0,0 +1,238 @@
+#define _GNU_SOURCE // pipe2()
+
+#include "admit.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#define ADMIT_POLL_MS 1000 // the load and the memory change without any child ending
+#define MAX_RUNNING 1024 // running jobs tracked
+#define MIN_ADMIT_FD 10 // descriptors 0 to 9 are left to the redirections of the user
+
+static struct admit_limits limits;
+static pid_t (*launch_job)(const struct line *line);
+static bool enabled = false;
+
+// Jobs waiting to be launched, in order
+static struct line queue[MAX_QUEUED];
+static size_t head = 0;
+static size_t count = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t not_full = PTHREAD_COND_INITIALIZER;
+
+/**
+ * A job launched by the admission thread
+ */
+struct running_job {
+    pid_t pid; // last process of the job
+    int pidfd; // readable once the process ended, -1 if pidfd_open() isn't available
+};
+
+// Only used by the admission thread
+static struct running_job running[MAX_RUNNING];
+static size_t n_running = 0;
+
+static int wake[2] = { -1, -1 };
+
+/**
+ * Count the jobs still running, forgetting the ones which ended
+ * @return The number of jobs running
+ */
+static size_t count_running(void) {
+    for (size_t i = 0; i < n_running;) {
+        // Ended, reaped or not : the SIGCHLD handler is blocked while the shell waits for a command
+        siginfo_t info;
+        info.si_pid = 0;
+        int err = waitid(P_PID, running[i].pid, &info, WEXITED | WNOHANG | WNOWAIT);
+        if (err == -1 || info.si_pid != 0) {
+            if (running[i].pidfd != -1) close(running[i].pidfd);
+            running[i] = running[--n_running];
+        }
+        else ++i;
+    }
+    return n_running;
+}
+
+/**
+ * Start tracking a job
+ * @param pid The PID of the last process of the job
+ */
+static void track(pid_t pid) {
+    if (n_running == MAX_RUNNING) return;
+    int pidfd = -1;
+#ifdef SYS_pidfd_open
+    pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd != -1) {
+        int fd = fcntl(pidfd, F_DUPFD_CLOEXEC, MIN_ADMIT_FD);
+        if (fd != -1) {
+            close(pidfd);
+            pidfd = fd;
+        }
+    }
+#endif
+    running[n_running++] = (struct running_job) { .pid = pid, .pidfd = pidfd };
+}
+
+/**
+ * Read the memory available for new processes
+ * @return MemAvailable in kB, 0 if it couldn't be read
+ */
+static size_t available_mem_kb(void) {
+    FILE *f = fopen("/proc/meminfo", "re");
+    if (f == NULL) return 0;
+    char buf[128];
+    size_t kb = 0;
+    while (fgets(buf, sizeof(buf), f) != NULL) {
+        if (sscanf(buf, "MemAvailable: %zu kB", &kb) == 1) break;
+    }
+    fclose(f);
+    return kb;
+}
+
+/**
+ * Check the thresholds
+ * @return true if a new job can be launched
+ */
+static bool has_capacity(void) {
+    if (limits.max_running > 0 && count_running() >= limits.max_running) return false;
+    if (limits.max_load > 0) {
+        double load;
+        if (getloadavg(&load, 1) == 1 && load > limits.max_load) return false;
+    }
+    if (limits.min_mem_kb > 0) {
+        size_t kb = available_mem_kb();
+        if (kb > 0 && kb < limits.min_mem_kb) return false;
+    }
+    return true;
+}
+
+/**
+ * Wait for a child to end, or for the poll interval
+ *
+ * The pidfds of the jobs tell when they end even while the shell blocks SIGCHLD
+ */
+static void wait_wake(void) {
+    static struct pollfd pfds[MAX_RUNNING + 1];
+    pfds[0] = (struct pollfd) { .fd = wake[0], .events = POLLIN };
+    for (size_t i = 0; i < n_running; ++i) {
+        pfds[i + 1] = (struct pollfd) { .fd = running[i].pidfd, .events = POLLIN };
+    }
+    if (poll(pfds, n_running + 1, ADMIT_POLL_MS) > 0 && (pfds[0].revents & POLLIN)) {
+        char buf[64];
+        while (read(wake[0], buf, sizeof(buf)) > 0);
+    }
+}
+
+/**
+ * Main loop of the admission thread : launch the queued jobs when there is capacity
+ */
+static void *admit_main(void *arg) {
+    (void) arg;
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (count == 0) pthread_cond_wait(&not_empty, &lock);
+        pthread_mutex_unlock(&lock);
+
+        if (!has_capacity()) {
+            wait_wake();
+            continue;
+        }
+
+        // The head stays counted while it is launched, the queue only grows at its tail meanwhile
+        pthread_mutex_lock(&lock);
+        struct line *li = &queue[head];
+        pthread_mutex_unlock(&lock);
+
+        pid_t pid = launch_job(li);
+        line_reset(li);
+        if (pid != -1) track(pid);
+
+        pthread_mutex_lock(&lock);
+        head = (head + 1) % MAX_QUEUED;
+        --count;
+        pthread_cond_broadcast(&not_full);
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+int admit_init(const struct admit_limits *l, pid_t (*launch)(const struct line *line)) {
+    limits = *l;
+    launch_job = launch;
+    for (size_t i = 0; i < MAX_QUEUED; ++i) line_init(&queue[i]);
+
+    if (pipe2(wake, O_CLOEXEC | O_NONBLOCK) == -1) {
+        perror("pipe failed");
+        return -1;
+    }
+    for (int i = 0; i < 2; ++i) {
+        int fd = fcntl(wake[i], F_DUPFD_CLOEXEC, MIN_ADMIT_FD);
+        if (fd == -1) continue;
+        close(wake[i]);
+        wake[i] = fd;
+    }
+
+    // The signals are handled by the main thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, admit_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err) {
+        fprintf(stderr, "Failed to start the admission control\n");
+        return -1;
+    }
+    pthread_detach(thread);
+    enabled = true;
+    return 0;
+}
+
+bool admit_enabled(void) {
+    return enabled;
+}
+
+int admit_submit(const struct line *line) {
+    pthread_mutex_lock(&lock);
+    while (count == MAX_QUEUED) pthread_cond_wait(&not_full, &lock);
+    struct line *li = &queue[(head + count) % MAX_QUEUED];
+    pthread_mutex_unlock(&lock);
+
+    // The slot is free until it is counted
+    if (line_dup(li, line) == -1) {
+        fprintf(stderr, "Memory allocation failure\n");
+        return -1;
+    }
+
+    pthread_mutex_lock(&lock);
+    ++count;
+    pthread_cond_signal(&not_empty);
+    pthread_mutex_unlock(&lock);
+    admit_notify();
+    return 0;
+}
+
+void admit_notify(void) {
+    if (wake[1] == -1) return;
+    int saved = errno;
+    ssize_t n = write(wake[1], "", 1);
+    (void) n;
+    errno = saved;
+}
+
+void admit_drain(void) {
+    if (!enabled) return;
+    pthread_mutex_lock(&lock);
+    while (count > 0) pthread_cond_wait(&not_full, &lock);
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,64 @@
+#ifndef ADMIT_H
+#define ADMIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "cmdline.h"
+
+#define MAX_QUEUED 256
+
+/**
+ * Thresholds above which no background job is launched, 0 for no threshold
+ */
+struct admit_limits {
+    double max_load; // 1-minute load average
+    size_t min_mem_kb; // MemAvailable of /proc/meminfo
+    size_t max_running; // background jobs launched and still running
+};
+
+/**
+ * Start the admission control of the background jobs
+ *
+ * A thread launches the queued jobs in order, as long as no threshold is exceeded. It is woken
+ * by admit_notify() when a child ends, and checks the load and the memory again every second
+ *
+ * @param limits the thresholds
+ * @param launch function launching a job in the background, returning the PID of its last
+ * process, -1 if it couldn't be launched. It is called by the thread
+ *
+ * @return 0 on success, -1 on failure
+ */
+int admit_init(const struct admit_limits *limits, pid_t (*launch)(const struct line *line));
+
+/**
+ * Tells if the background jobs go through the admission control
+ * @return true once admit_init() succeeded
+ */
+bool admit_enabled(void);
+
+/**
+ * Queue a background job, it is launched as soon as the thresholds allow it
+ *
+ * The line is copied. If MAX_QUEUED jobs are already waiting, waits for one to be launched
+ *
+ * @param line The line of the job
+ *
+ * @return 0 on success, -1 if the line couldn't be copied
+ */
+int admit_submit(const struct line *line);
+
+/**
+ * Wake the admission thread up, as a child ended
+ *
+ * It is async-signal-safe, to be called from the SIGCHLD handler
+ */
+void admit_notify(void);
+
+/**
+ * Wait until every queued job was launched
+ */
+void admit_drain(void);
+
+#endif
@@ -2,10 +2,12 @@
 
 #include <assert.h>
 #include <string.h>
-#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <unistd.h>
 
 void line_init(struct line *li) {
     assert(li);
@@ -13,22 +15,133 @@ void line_init(struct line *li) {
 }
 
 
+#define BYTE_SPACE 1 // the spaces of isspace() in the "C" locale
+#define BYTE_QUOTE 2
+#define BYTE_FORBIDDEN 4 // forbidden characters in commands arguments and filenames
+#define BYTE_MULTI 8 // byte of a UTF-8 multibyte sequence
+
+#define MULTI_4 BYTE_MULTI, BYTE_MULTI, BYTE_MULTI, BYTE_MULTI
+#define MULTI_16 MULTI_4, MULTI_4, MULTI_4, MULTI_4
+
+/*
+ * Classes of the bytes, so that the lexer doesn't depend on the locale and doesn't call
+ * a ctype function for each byte
+ */
+static const unsigned char byte_class[256] = {
+    ['\t'] = BYTE_SPACE, ['\n'] = BYTE_SPACE, ['\v'] = BYTE_SPACE,
+    ['\f'] = BYTE_SPACE, ['\r'] = BYTE_SPACE, [' '] = BYTE_SPACE,
+    ['"'] = BYTE_QUOTE,
+    ['<'] = BYTE_FORBIDDEN, ['>'] = BYTE_FORBIDDEN, ['&'] = BYTE_FORBIDDEN, ['|'] = BYTE_FORBIDDEN,
+    [0x80] = MULTI_16, MULTI_16, MULTI_16, MULTI_16, MULTI_16, MULTI_16, MULTI_16, MULTI_16
+};
+
+/**
+ * Decode the UTF-8 sequence beginning at str[i]
+ *
+ * This function is static : it means that it is a local function, accessible only in this source file.
+ * A byte which doesn't begin a valid sequence is taken alone, as U+FFFD
+ *
+ * @param str pointer on the first char of the line
+ * @param end position of the end of the line in "str"
+ * @param i position of the first byte of the sequence
+ * @param code retrieves the code point
+ *
+ * @return the length of the sequence
+ */
+static size_t utf8_decode(const char *str, size_t end, size_t i, unsigned long *code) {
+    const unsigned char *s = (const unsigned char *) str + i;
+    size_t n = end - i;
+    unsigned long c;
+    size_t len;
+
+    if (s[0] < 0x80) {
+        *code = s[0];
+        return 1;
+    }
+    else if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+        c = s[0] & 0x1f;
+        len = 2;
+    }
+    else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+        c = s[0] & 0x0f;
+        len = 3;
+    }
+    else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+        c = s[0] & 0x07;
+        len = 4;
+    }
+    else {
+        *code = 0xfffd;
+        return 1;
+    }
+
+    if (len > n) {
+        *code = 0xfffd;
+        return 1;
+    }
+    for (size_t k = 1; k < len; ++k) {
+        if ((s[k] & 0xc0) != 0x80) {
+            *code = 0xfffd;
+            return 1;
+        }
+        c = (c << 6) | (s[k] & 0x3f);
+    }
+
+    // overlong sequences, surrogates and code points after U+10FFFF
+    if ((len == 3 && c < 0x800) || (len == 4 && (c < 0x10000 || c > 0x10ffff))
+            || (c >= 0xd800 && c <= 0xdfff)) {
+        *code = 0xfffd;
+        return 1;
+    }
+    *code = c;
+    return len;
+}
+
+/**
+ * Get the length of the space beginning at str[i]
+ *
+ * This function is static : it means that it is a local function, accessible only in this source file
+ *
+ * @param str pointer on the first char of the line
+ * @param end position of the end of the line in "str"
+ * @param i position of the first byte to test
+ * @param unicode true if the spaces of Unicode are spaces too, not only the ASCII ones
+ *
+ * @return the number of bytes of the space, 0 if str[i] doesn't begin a space
+ */
+static size_t space_len(const char *str, size_t end, size_t i, bool unicode) {
+    unsigned char c = str[i];
+    if (byte_class[c] & BYTE_SPACE) {
+        return 1;
+    }
+    if (!unicode || !(byte_class[c] & BYTE_MULTI)) {
+        return 0;
+    }
+
+    unsigned long code;
+    size_t len = utf8_decode(str, end, i, &code);
+    switch (code) {
+        case 0x85: case 0xa0: case 0x1680: case 0x2028: case 0x2029:
+        case 0x202f: case 0x205f: case 0x3000:
+            return len;
+        default:
+            return code >= 0x2000 && code <= 0x200a ? len : 0;
+    }
+}
+
 /**
  * Test the validity of command arguments or file names used in redirections
  * 
  * This function is static : it means that it is a local function, accessible only in this source file
  * 
- * @param word pointer on the first char of string to test
+ * @param word pointer on the first char of the word to test
+ * @param len length of the word
  *
  * @return true if the word is valid, false otherwise
  */
-static bool valid_cmdarg_filename(const char *word){
-    const char *forbidden = "<>&|";// forbidden characters in commands arguments and filenames
-
-    size_t lenf = strlen(forbidden);
-    for (size_t i = 0; i < lenf ; ++i){
-        char *ptr = strchr(word, forbidden[i]);
-        if (ptr) {
+static bool valid_cmdarg_filename(const char *word, size_t len){
+    for (size_t i = 0; i < len; ++i){
+        if (byte_class[(unsigned char) word[i]] & BYTE_FORBIDDEN) {
             return false;
         }
     }
@@ -36,21 +149,25 @@ static bool valid_cmdarg_filename(const char *word){
 }
 
 /**
- * Print the string "Error while parsing: ", followed by the string "format" to stderr
+ * Record an error in a parsing context
  * 
  * This function is static : it means that it is a local function, accessible only in this source file.
  * The string "format" may contain format specifications that specify how subsequent arguments are
  * converted for output. So, this function can be called with a variable number of parameters.
- * NB : vfprintf() uses the variable-length argument facilities of stdarg(3)
+ * NB : vsnprintf() uses the variable-length argument facilities of stdarg(3)
  * 
+ * @param ctx pointer on the context retrieving the error
+ * @param error LINE_ERR_* code of the error
+ * @param offset position in the line of the char where the error is detected
  * @param format string
  */
-static void parse_error(const char *format, ...) {
+static void parse_error(struct line_ctx *ctx, int error, size_t offset, const char *format, ...) {
     va_list ap;
 
-    fprintf(stderr, "Error while parsing: ");
+    ctx->error = error;
+    ctx->offset = offset;
     va_start(ap, format);
-    vfprintf(stderr, format, ap);
+    vsnprintf(ctx->message, sizeof(ctx->message), format, ap);
     va_end(ap);
 }
 
@@ -59,277 +176,422 @@ static void parse_error(const char *format, ...) {
  * 
  * This function is static : it means that it is a local function, accessible only in this source file.
  * After the call, "index" contains the position of the last character used plus one.
- * If a word is found, it is copied to a dynamically allocated memory space. "pword" is a pointer
- * on a pointer which retrieves the address of this dynamically allocated memory space.
+ * If a word is found, "start" and "len" retrieve its position and its length in "str",
+ * without the quotes around it. The word isn't copied.
  * 
  * @param str pointer on the first char of the line entered by the user
+ * @param end position of the end of the line in "str"
  * @param index pointer on the index
- * @param pword pointer on a pointer which retrieves the address of this dynamically allocated memory space
+ * @param start pointer on the position of the word
+ * @param len pointer on the length of the word
+ * @param ctx pointer on the context retrieving the error
  *
- * @return   0 if a word is found or if the end of the line is reached
+ * @return   1 if a word is found
+ *           0 if the end of the line is reached
  *           -1 if a malformed line is detected
- *           -2 if a memory allocation failure occurs
  */
-static int line_next_word(const char *str, size_t *index, char **pword) {
+static int line_next_word(const char *str, size_t end, size_t *index, size_t *start, size_t *len, struct line_ctx *ctx) {
     assert(str);
     assert(index);
-    assert(pword);
+    assert(start);
+    assert(len);
 
     size_t i = *index;
-    *pword = NULL;
+    bool unicode = ctx->flags & LINE_CTX_UNICODE_SPACE;
 
     /* eat space */
-    while (str[i] != '\0' && isspace(str[i])) {
-        ++i;
+    size_t n;
+    while (i < end && (n = space_len(str, end, i, unicode)) > 0) {
+        i += n;
     }
 
     /* check if it is the end of the line */
-    if (str[i] == '\0') {
+    if (i == end) {
         *index = i;
         return 0;
     }
 
-    size_t start = i;
-    size_t end = i;
+    *start = i;
     if (str[i] == '"') {
-        ++start;
-        do {
-            ++i;
-        } while (str[i] != '\0' && str[i] != '"');
+        ++*start;
+        const char *quote = memchr(str + *start, '"', end - *start);
+        i = quote ? (size_t) (quote - str) : end;
 
-        if (str[i] == '\0') {
-            parse_error("Malformed line\n");
+        if (i == end) {
+            parse_error(ctx, LINE_ERR_QUOTE, *start - 1, "Malformed line");
             return -1;
         }
 
         assert(str[i] == '"');
-        end = i;
+        *len = i - *start;
         ++i;
     }
     else {
-        while (str[i] != '\0' && !isspace(str[i])) {
-            ++i;
+        // fast path : the bytes which aren't spaces, nor multibyte sequences if they may be spaces
+        unsigned char stop = BYTE_SPACE | (unicode ? BYTE_MULTI : 0);
+        for (;;) {
+            while (i < end && !(byte_class[(unsigned char) str[i]] & stop)) {
+                ++i;
+            }
+            if (i == end || space_len(str, end, i, unicode) > 0) {
+                break;
+            }
+            unsigned long code;
+            i += utf8_decode(str, end, i, &code);
         }
-        end = i;
+        *len = i - *start;
     }
 
     *index = i;
-
-    /* copy this word */
-    assert(end >= start);
-    *pword = calloc(end - start + 1, sizeof(char));
-    if (*pword == NULL){
-        fprintf(stderr, "Memory allocation failure\n");
-        return -2;
-    }
-    memcpy(*pword, str + start, end - start);
-    return 0;
+    return 1;
 }
 
+/**
+ * Test if a word is equal to a string
+ *
+ * This function is static : it means that it is a local function, accessible only in this source file
+ *
+ * @return true if the "len" chars of "word" are the chars of "str"
+ */
+static bool word_is(const char *word, size_t len, const char *str) {
+    return strlen(str) == len && memcmp(word, str, len) == 0;
+}
 
+/**
+ * Callbacks receiving the elements of a command line recognized by line_parse_words()
+ *
+ * Each word is given as a pointer on its first char and a length, it isn't ended by a '\0'.
+ * Each callback returns 0 on success, -1 if a memory allocation failure occurs
+ */
+struct line_sink {
+    int (*arg)(void *data, size_t cmd, const char *word, size_t len);
+    int (*input)(void *data, const char *word, size_t len);
+    int (*output)(void *data, size_t cmd, const char *word, size_t len, bool append);
+    // "word" is the filename, NULL for REDIR_DUP and REDIR_CLOSE
+    int (*redir)(void *data, size_t cmd, int fd, int kind, int target, const char *word, size_t len);
+};
 
+/**
+ * Recognize a redirection of a numbered descriptor, or a copy of a descriptor
+ *
+ * This function is static : it means that it is a local function, accessible only in this source file.
+ * The words recognized are "N>", "N>>" and "N<", followed by a filename, and "[N]>&M", "[N]<&M",
+ * "[N]>&-" and "[N]<&-" where N and M are digits. N is 1 by default for ">&", 0 for "<&"
+ *
+ * @param fd retrieves the descriptor which is redirected
+ * @param kind retrieves the REDIR_* kind of the redirection
+ * @param target retrieves the descriptor copied by REDIR_DUP
+ *
+ * @return true if the word is such a redirection
+ */
+static bool redir_word(const char *word, size_t len, int *fd, int *kind, int *target) {
+    size_t i = 0;
+    *fd = -1;
+    *target = -1;
+    if (len > 0 && word[0] >= '0' && word[0] <= '9') {
+        *fd = word[0] - '0';
+        i = 1;
+    }
+    if (i == len || (word[i] != '>' && word[i] != '<')) {
+        return false;
+    }
+    bool out = word[i] == '>';
+    ++i;
 
-int line_parse(struct line *li, const char *str) {
-    assert(li);
-    assert(str);
-
-    size_t len = strlen(str);
-    assert(len >= 1);
-    if (str[len -1] != '\n'){
-        fprintf(stderr, "The command line is too long\n");
-        char c = 0;
-        while (c != '\n'){
-            c = fgetc(stdin);
+    if (i == len || (out && i + 1 == len && word[i] == '>')) {
+        // "N>", "N<" or "N>>" : the plain operators have no descriptor
+        if (*fd == -1) {
+            return false;
         }
-        return -1;
+        *kind = i == len ? (out ? REDIR_OUTPUT : REDIR_INPUT) : REDIR_APPEND;
+        return true;
+    }
+
+    if (i + 2 != len || word[i] != '&') {
+        return false;
+    }
+    if (*fd == -1) {
+        *fd = out ? 1 : 0;
+    }
+    char c = word[i + 1];
+    if (c == '-') {
+        *kind = REDIR_CLOSE;
+        return true;
     }
+    if (c >= '0' && c <= '9') {
+        *kind = REDIR_DUP;
+        *target = c - '0';
+        return true;
+    }
+    return false;
+}
 
+/**
+ * Parse the chars [0, end) of the string "str" and give its elements to a sink
+ *
+ * This function is static : it means that it is a local function, accessible only in this source file.
+ * It checks the grammar of command lines for line_parse() and lines_parse_many()
+ *
+ * @param str pointer on the first char of the line
+ * @param end position of the end of the line in "str"
+ * @param sink callbacks receiving the elements of the line
+ * @param data pointer given to the callbacks
+ * @param n_cmds retrieves the number of commands given to the sink
+ * @param background retrieves true if the line ends with a '&'
+ * @param ctx pointer on the context retrieving the error
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int line_parse_words(
+        const char *str,
+        size_t end,
+        const struct line_sink *sink,
+        void *data,
+        size_t *n_cmds,
+        bool *background,
+        struct line_ctx *ctx
+) {
     size_t index = 0;
     size_t curr_n_cmd = 0;
     size_t curr_n_arg = 0;
+    size_t n_redirs = 0;
+    bool file_input = false;
+    bool file_output = false;
     int valret = 0;
 
+    *background = false;
+
     for (;;) {
         /* get the next word */
-        char *word;
-        int err = line_next_word(str, &index, &word);
-        if (err) {
+        size_t start, len;
+        int found = line_next_word(str, end, &index, &start, &len, ctx);
+        if (found < 0) {
             valret = -1;
             break;
         }
 
-        if (!word) {
+        if (!found) {
             break;
         }
+        const char *word = str + start;
+        int fd, kind, target;
 
 #ifdef DEBUG
-    fprintf(stderr, "\tnew word: \"%s\"\n", word);
+    fprintf(stderr, "\tnew word: \"%.*s\"\n", (int) len, word);
 #endif
 
-        if (strcmp(word, "|") == 0) {
-            free(word);
-
-            if (li->background) {
-                parse_error("No pipe allowed after a '&'\n");
-                valret = -1;
-                break;
-            }
-
-            if (li->file_output) {
-                parse_error("No pipe allowed after an output redirection\n");
+        if (word_is(word, len, "|")) {
+            if (*background) {
+                parse_error(ctx, LINE_ERR_SYNTAX, start, "No pipe allowed after a '&'");
                 valret = -1;
                 break;
             }
 
             if (curr_n_arg == 0){
-                parse_error("An empty command before a pipe detected\n");
+                parse_error(ctx, LINE_ERR_SYNTAX, start, "An empty command before a pipe detected");
                 valret = -1;
                 break;
             }
 
-            li->cmds[curr_n_cmd].n_args = curr_n_arg;
             curr_n_arg = 0;
             ++curr_n_cmd;
 
         }
-        else if (strcmp(word, ">") == 0 || strcmp(word, ">>") == 0) {
-            bool append = strcmp(word, ">>") == 0;
-            free(word);
+        else if (word_is(word, len, ">") || word_is(word, len, ">>")) {
+            bool append = word_is(word, len, ">>");
 
-            if (li->file_output) {
-                parse_error("Output redirection already defined\n");
+            if (*background) {
+                parse_error(ctx, LINE_ERR_SYNTAX, start, "No output redirection allowed after a '&'");
                 valret = -1;
                 break;
             }
-
-            if (li->background) {
-                parse_error("No output redirection allowed after a '&'\n");
+            if (curr_n_cmd == MAX_CMDS) {
+                parse_error(ctx, LINE_ERR_LIMIT, start, "Too much commands. Max: %i", MAX_CMDS);
+                valret = -1;
+                break;
+            }
+            // the output redirections are stored with the numbered ones until the line is built
+            if (n_redirs == MAX_REDIRS) {
+                parse_error(ctx, LINE_ERR_LIMIT, start, "Too much redirections. Max: %i", MAX_REDIRS);
                 valret = -1;
                 break;
             }
 
-            err = line_next_word(str, &index, &word);
-            if (err) {
+            found = line_next_word(str, end, &index, &start, &len, ctx);
+            if (found < 0) {
                 valret = -1;
                 break;
             }
 
-            if (!word) {
-                parse_error("Waiting for a filename after an output redirection\n");
+            if (!found) {
+                parse_error(ctx, LINE_ERR_SYNTAX, index, "Waiting for a filename after an output redirection");
                 valret = -1;
                 break;
             }
+            word = str + start;
 
-            if (!valid_cmdarg_filename(word)){
-                parse_error("Filename \"%s\" is not valid\n", word);
-                free(word);
+            if (!valid_cmdarg_filename(word, len)){
+                parse_error(ctx, LINE_ERR_WORD, start, "Filename \"%.*s\" is not valid", (int) len, word);
+                valret = -1;
+                break;
+            }
+            if (sink->output(data, curr_n_cmd, word, len, append)) {
+                parse_error(ctx, LINE_ERR_NOMEM, start, "Memory allocation failure");
                 valret = -1;
                 break;
             }
-            li->file_output = word;
-            li->file_output_append = append;
+            file_output = true;
+            ++n_redirs;
 
         }
-        else if (strcmp(word, "<") == 0) {
-            free(word);
-
-            if (li->file_input) {
-                parse_error("Input redirection already defined\n");
+        else if (word_is(word, len, "<")) {
+            if (file_input) {
+                parse_error(ctx, LINE_ERR_SYNTAX, start, "Input redirection already defined");
                 valret = -1;
                 break;
             }
 
-            if (li->background) {
-                parse_error("No input redirection allowed after a '&'\n");
+            if (*background) {
+                parse_error(ctx, LINE_ERR_SYNTAX, start, "No input redirection allowed after a '&'");
                 valret = -1;
                 break;
             }
 
             if (curr_n_cmd > 0){
-                parse_error("Input redirection is only allowed for the first command\n");
+                parse_error(ctx, LINE_ERR_SYNTAX, start, "Input redirection is only allowed for the first command");
                 valret = -1;
                 break;
             }
 
-            err = line_next_word(str, &index, &word);
-            if (err) {
+            found = line_next_word(str, end, &index, &start, &len, ctx);
+            if (found < 0) {
                 valret = -1;
                 break;
             }
 
-            if (!word) {
-                parse_error("Waiting for a filename after an input redirection\n");
+            if (!found) {
+                parse_error(ctx, LINE_ERR_SYNTAX, index, "Waiting for a filename after an input redirection");
                 valret = -1;
                 break;
             }
+            word = str + start;
 
-            if (!valid_cmdarg_filename(word)){
-                parse_error("Filename \"%s\" is not valid\n", word);
-                free(word);
+            if (!valid_cmdarg_filename(word, len)){
+                parse_error(ctx, LINE_ERR_WORD, start, "Filename \"%.*s\" is not valid", (int) len, word);
                 valret = -1;
                 break;
             }
 
-            li->file_input = word;
+            if (sink->input(data, word, len)) {
+                parse_error(ctx, LINE_ERR_NOMEM, start, "Memory allocation failure");
+                valret = -1;
+                break;
+            }
+            file_input = true;
 
         }
-        else if (strcmp(word, "&") == 0) {
-            free(word);
-
-            if (li->background) {
-                parse_error("More than one '&' detected\n");
+        else if (word_is(word, len, "&")) {
+            if (*background) {
+                parse_error(ctx, LINE_ERR_SYNTAX, start, "More than one '&' detected");
                 valret = -1;
                 break;
             }
 
             if (curr_n_arg == 0){
-                parse_error("An empty command before '&' detected\n");
+                parse_error(ctx, LINE_ERR_SYNTAX, start, "An empty command before '&' detected");
+                valret = -1;
+                break;
+            }
+
+            *background = true;
+        }
+        else if (redir_word(word, len, &fd, &kind, &target)) {
+            if (*background) {
+                parse_error(ctx, LINE_ERR_SYNTAX, start, "No redirection allowed after a '&'");
+                valret = -1;
+                break;
+            }
+            if (curr_n_cmd == MAX_CMDS) {
+                parse_error(ctx, LINE_ERR_LIMIT, start, "Too much commands. Max: %i", MAX_CMDS);
+                valret = -1;
+                break;
+            }
+            if (n_redirs == MAX_REDIRS) {
+                parse_error(ctx, LINE_ERR_LIMIT, start, "Too much redirections. Max: %i", MAX_REDIRS);
                 valret = -1;
                 break;
             }
 
-            li->background = true;
+            const char *file = NULL;
+            size_t file_len = 0;
+            if (kind == REDIR_INPUT || kind == REDIR_OUTPUT || kind == REDIR_APPEND) {
+                found = line_next_word(str, end, &index, &start, &file_len, ctx);
+                if (found < 0) {
+                    valret = -1;
+                    break;
+                }
+
+                if (!found) {
+                    parse_error(ctx, LINE_ERR_SYNTAX, index, "Waiting for a filename after a redirection");
+                    valret = -1;
+                    break;
+                }
+                file = str + start;
+
+                if (!valid_cmdarg_filename(file, file_len)){
+                    parse_error(ctx, LINE_ERR_WORD, start, "Filename \"%.*s\" is not valid", (int) file_len, file);
+                    valret = -1;
+                    break;
+                }
+            }
+
+            if (sink->redir(data, curr_n_cmd, fd, kind, target, file, file_len)) {
+                parse_error(ctx, LINE_ERR_NOMEM, start, "Memory allocation failure");
+                valret = -1;
+                break;
+            }
+            ++n_redirs;
         }
         else {
-            if (li->background) {
-                free(word);
-                parse_error("No more commands allowed after a '&'\n");
+            if (*background) {
+                parse_error(ctx, LINE_ERR_SYNTAX, start, "No more commands allowed after a '&'");
                 valret = -1;
                 break;
             }
             if (curr_n_cmd == MAX_CMDS) {
-                free(word);
-                parse_error("Too much commands. Max: %i\n", MAX_CMDS);
+                parse_error(ctx, LINE_ERR_LIMIT, start, "Too much commands. Max: %i", MAX_CMDS);
                 valret = -1;
                 break;
             }
             if (curr_n_arg == MAX_ARGS) {
-                free(word);
-                parse_error("Too much arguments. Max: %i\n", MAX_ARGS);
+                parse_error(ctx, LINE_ERR_LIMIT, start, "Too much arguments. Max: %i", MAX_ARGS);
                 valret = -1;
                 break;
             }
 
-            if (!valid_cmdarg_filename(word)){
-                parse_error("Argument \"%s\" is not valid\n", word);
-                free(word);
+            if (!valid_cmdarg_filename(word, len)){
+                parse_error(ctx, LINE_ERR_WORD, start, "Argument \"%.*s\" is not valid", (int) len, word);
                 valret = -1;
                 break;
             }
 
-            li->cmds[curr_n_cmd].args[curr_n_arg] = word;
+            if (sink->arg(data, curr_n_cmd, word, len)) {
+                parse_error(ctx, LINE_ERR_NOMEM, start, "Memory allocation failure");
+                valret = -1;
+                break;
+            }
             ++curr_n_arg;
         }
     } //end of the loop for
 
     if (!valret && curr_n_arg == 0) {
         if (curr_n_cmd > 0){
-            parse_error("An empty command detected\n");
+            parse_error(ctx, LINE_ERR_SYNTAX, index, "An empty command detected");
             valret = -1;
         }
         // in a real shell, "< fic" is equivalent to "test -r fic"
-        else if (li->file_input){
-            parse_error("Missing first command\n");
+        else if (file_input){
+            parse_error(ctx, LINE_ERR_SYNTAX, index, "Missing first command");
             valret = -1;
         }
         // in a real shell, "> fic" :
@@ -338,39 +600,896 @@ int line_parse(struct line *li, const char *str) {
         // in a real shell, ">> fic" :
         // - creates the regular file "fic" if it does not exist,
         // - and doesn't truncate it if it already exists
-        else if (li->file_output){
-            parse_error("Missing last command\n");
+        else if (file_output){
+            parse_error(ctx, LINE_ERR_SYNTAX, index, "Missing last command");
+            valret = -1;
+        }
+        else if (n_redirs > 0){
+            parse_error(ctx, LINE_ERR_SYNTAX, index, "Missing command");
             valret = -1;
         }
     }
 
     if (curr_n_arg != 0) {
-        li->cmds[curr_n_cmd].n_args = curr_n_arg;
         ++curr_n_cmd;
     }
-    li->n_cmds = curr_n_cmd;
+    *n_cmds = curr_n_cmd;
     return valret;
 }
 
+/**
+ * The words of a line, collected by the sink of line_parse_words() before the struct line is built
+ */
+struct line_words {
+    const char *args[MAX_CMDS][MAX_ARGS];
+    size_t args_len[MAX_CMDS][MAX_ARGS];
+    size_t n_args[MAX_CMDS]; // only the first n_cmds entries are set
+    size_t n_cmds;
+    const char *input; // NULL without input redirection
+    size_t input_len;
+    struct redir redirs[MAX_REDIRS]; // "file" isn't ended by a '\0' yet, outputs are REDIR_TEE*
+    size_t redirs_len[MAX_REDIRS];
+    size_t n_redirs;
+};
+
+static int line_words_arg(void *data, size_t cmd, const char *word, size_t len) {
+    struct line_words *w = data;
+    if (cmd == w->n_cmds) {
+        w->n_args[w->n_cmds++] = 0;
+    }
+    w->args[cmd][w->n_args[cmd]] = word;
+    w->args_len[cmd][w->n_args[cmd]] = len;
+    ++w->n_args[cmd];
+    return 0;
+}
+
+static int line_words_input(void *data, const char *word, size_t len) {
+    struct line_words *w = data;
+    w->input = word;
+    w->input_len = len;
+    return 0;
+}
+
+
+static int line_words_redir(void *data, size_t cmd, int fd, int kind, int target, const char *word, size_t len) {
+    struct line_words *w = data;
+    struct redir *r = &w->redirs[w->n_redirs];
+    r->cmd = cmd;
+    r->fd = fd;
+    r->kind = kind;
+    r->target = target;
+    r->file = (char *) word;
+    w->redirs_len[w->n_redirs++] = len;
+    return 0;
+}
+
+static int line_words_output(void *data, size_t cmd, const char *word, size_t len, bool append) {
+    return line_words_redir(data, cmd, STDOUT_FILENO, append ? REDIR_TEE_APPEND : REDIR_TEE, -1, word, len);
+}
+
+static const struct line_sink line_words_sink = {
+        .arg = line_words_arg,
+        .input = line_words_input,
+        .output = line_words_output,
+        .redir = line_words_redir
+};
+
+/**
+ * Copy a word at the end of the strings of a line, ended by a '\0'
+ *
+ * This function is static : it means that it is a local function, accessible only in this source file
+ *
+ * @param pos pointer on the first free char, moved after the copy
+ *
+ * @return pointer on the copy
+ */
+static char *line_copy_word(char **pos, const char *word, size_t len) {
+    char *copy = *pos;
+    memcpy(copy, word, len);
+    copy[len] = '\0';
+    *pos += len + 1;
+    return copy;
+}
+
+/**
+ * Construct the struct line of the words of a line
+ *
+ * This function is static : it means that it is a local function, accessible only in this source file.
+ * The commands, their redirections, their argv and all the strings of the line are stored in
+ * a single memory space, so that the size of a line and the cost of line_reset() only depend
+ * on what was parsed
+ *
+ * @param li pointer on the struct line to fill
+ * @param w pointer on the words of the line
+ *
+ * @return 0 on success, -1 if a memory allocation failure occurs
+ */
+static int line_build(struct line *li, const struct line_words *w) {
+    if (w->n_cmds == 0) {
+        return 0;
+    }
+
+    size_t n_ptrs = 0;
+    size_t n_chars = 0;
+    for (size_t i = 0; i < w->n_cmds; ++i) {
+        n_ptrs += w->n_args[i] + 1;
+        for (size_t j = 0; j < w->n_args[i]; ++j) {
+            n_chars += w->args_len[i][j] + 1;
+        }
+    }
+    if (w->input) {
+        n_chars += w->input_len + 1;
+    }
+    // the first output redirection of the last command is the file_output of the line
+    size_t output = w->n_redirs;
+    for (size_t i = 0; i < w->n_redirs; ++i) {
+        if (w->redirs[i].file) {
+            n_chars += w->redirs_len[i] + 1;
+        }
+        if (output == w->n_redirs && w->redirs[i].cmd == w->n_cmds - 1
+                && (w->redirs[i].kind == REDIR_TEE || w->redirs[i].kind == REDIR_TEE_APPEND)) {
+            output = i;
+        }
+    }
+    size_t n_redirs = w->n_redirs - (output < w->n_redirs);
+
+    // struct cmd, then struct redir, then char *, then char : each part is aligned for the next one
+    size_t size = w->n_cmds * sizeof(struct cmd) + n_redirs * sizeof(struct redir)
+                  + n_ptrs * sizeof(char *) + n_chars;
+    char *block = malloc(size);
+    if (block == NULL){
+        return -1;
+    }
+
+    struct cmd *cmds = (struct cmd *) block;
+    struct redir *redirs = (struct redir *) (cmds + w->n_cmds);
+    char **ptrs = (char **) (redirs + n_redirs);
+    char *chars = (char *) (ptrs + n_ptrs);
+
+    for (size_t i = 0; i < w->n_cmds; ++i) {
+        cmds[i].args = ptrs;
+        cmds[i].n_args = w->n_args[i];
+        for (size_t j = 0; j < w->n_args[i]; ++j) {
+            *ptrs++ = line_copy_word(&chars, w->args[i][j], w->args_len[i][j]);
+        }
+        *ptrs++ = NULL;
+    }
+    li->cmds = cmds;
+    li->n_cmds = w->n_cmds;
+
+    if (w->input) {
+        li->file_input = line_copy_word(&chars, w->input, w->input_len);
+    }
+    struct redir *r = redirs;
+    for (size_t i = 0; i < w->n_redirs; ++i) {
+        char *file = w->redirs[i].file ? line_copy_word(&chars, w->redirs[i].file, w->redirs_len[i]) : NULL;
+        if (i == output) {
+            li->file_output = file;
+            li->file_output_append = w->redirs[i].kind == REDIR_TEE_APPEND;
+            continue;
+        }
+        *r = w->redirs[i];
+        r->file = file;
+        ++r;
+    }
+    li->redirs = n_redirs > 0 ? redirs : NULL;
+    li->n_redirs = n_redirs;
+    return 0;
+}
+
+void line_ctx_init(struct line_ctx *ctx) {
+    assert(ctx);
+    memset(ctx, 0, sizeof(struct line_ctx));
+}
+
+int line_parse_r(struct line *li, const char *str, struct line_ctx *ctx) {
+    assert(li);
+    assert(str);
+    assert(ctx);
+
+    ctx->error = LINE_ERR_NONE;
+    ctx->offset = 0;
+    ctx->message[0] = '\0';
+
+    struct line_words w;
+    w.n_cmds = 0;
+    w.input = NULL;
+    w.n_redirs = 0;
+
+    size_t len = strlen(str);
+    size_t n_cmds;
+    if (line_parse_words(str, len, &line_words_sink, &w, &n_cmds, &li->background, ctx)) {
+        return -1;
+    }
+    if (line_build(li, &w)) {
+        parse_error(ctx, LINE_ERR_NOMEM, 0, "Memory allocation failure");
+        return -1;
+    }
+    return 0;
+}
+
+int line_parse(struct line *li, const char *str) {
+    assert(li);
+    assert(str);
+
+    size_t len = strlen(str);
+    assert(len >= 1);
+    if (str[len -1] != '\n'){
+        fprintf(stderr, "The command line is too long\n");
+        char c = 0;
+        while (c != '\n'){
+            c = fgetc(stdin);
+        }
+        return -1;
+    }
+
+    struct line_ctx ctx;
+    line_ctx_init(&ctx);
+    if (line_parse_r(li, str, &ctx)) {
+        fprintf(stderr, "Error while parsing: %s\n", ctx.message);
+        return -1;
+    }
+    return 0;
+}
+
 void line_reset(struct line *li) {
     assert(li);
 
-    for (size_t i = 0; i < li->n_cmds; ++i) {
-        for (size_t j = 0; j < li->cmds[i].n_args; ++j) {
-            free(li->cmds[i].args[j]);
-            li->cmds[i].args[j] = NULL; // useless here because of the call of memset()
+    // the commands, their arguments and the filenames are in the memory space of the commands
+    free(li->cmds);
+    memset(li, 0, sizeof(struct line));
+}
+
+int line_dup(struct line *dst, const struct line *src) {
+    assert(dst);
+    assert(src);
+
+    *dst = *src;
+    dst->cmds = NULL;
+    dst->file_input = NULL;
+    dst->file_output = NULL;
+    dst->redirs = NULL;
+    if (src->n_cmds == 0) {
+        dst->n_redirs = 0;
+        return 0;
+    }
+
+    // same layout as line_build()
+    size_t n_ptrs = 0;
+    size_t n_chars = 0;
+    for (size_t i = 0; i < src->n_cmds; ++i) {
+        n_ptrs += src->cmds[i].n_args + 1;
+        for (size_t j = 0; j < src->cmds[i].n_args; ++j) {
+            n_chars += strlen(src->cmds[i].args[j]) + 1;
+        }
+    }
+    if (src->file_input) {
+        n_chars += strlen(src->file_input) + 1;
+    }
+    if (src->file_output) {
+        n_chars += strlen(src->file_output) + 1;
+    }
+    for (size_t i = 0; i < src->n_redirs; ++i) {
+        if (src->redirs[i].file) {
+            n_chars += strlen(src->redirs[i].file) + 1;
         }
     }
 
-    if (li->file_input) {
-        free(li->file_input);
-        li->file_input = NULL; // useless here because of the call of memset()
+    size_t size = src->n_cmds * sizeof(struct cmd) + src->n_redirs * sizeof(struct redir)
+                  + n_ptrs * sizeof(char *) + n_chars;
+    char *block = malloc(size);
+    if (block == NULL) {
+        memset(dst, 0, sizeof(struct line));
+        return -1;
     }
 
-    if (li->file_output) {
-        free(li->file_output);
-        li->file_output = NULL; // useless here because of the call of memset()
+    struct cmd *cmds = (struct cmd *) block;
+    struct redir *redirs = (struct redir *) (cmds + src->n_cmds);
+    char **ptrs = (char **) (redirs + src->n_redirs);
+    char *chars = (char *) (ptrs + n_ptrs);
+
+    for (size_t i = 0; i < src->n_cmds; ++i) {
+        cmds[i].args = ptrs;
+        cmds[i].n_args = src->cmds[i].n_args;
+        for (size_t j = 0; j < src->cmds[i].n_args; ++j) {
+            const char *arg = src->cmds[i].args[j];
+            *ptrs++ = line_copy_word(&chars, arg, strlen(arg));
+        }
+        *ptrs++ = NULL;
     }
+    dst->cmds = cmds;
 
-    memset(li, 0, sizeof(struct line));
+    if (src->file_input) {
+        dst->file_input = line_copy_word(&chars, src->file_input, strlen(src->file_input));
+    }
+    if (src->file_output) {
+        dst->file_output = line_copy_word(&chars, src->file_output, strlen(src->file_output));
+    }
+    for (size_t i = 0; i < src->n_redirs; ++i) {
+        redirs[i] = src->redirs[i];
+        if (src->redirs[i].file) {
+            redirs[i].file = line_copy_word(&chars, src->redirs[i].file, strlen(src->redirs[i].file));
+        }
+    }
+    dst->redirs = src->n_redirs > 0 ? redirs : NULL;
+    return 0;
+}
+
+uint64_t line_hash(const char *str, size_t len) {
+    const uint64_t m = 0x9e3779b97f4a7c15ULL;
+    uint64_t h = len * m;
+
+    while (len >= 8) {
+        uint64_t k;
+        memcpy(&k, str, 8);
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 32;
+        h = (h ^ k) * m;
+        str += 8;
+        len -= 8;
+    }
+
+    uint64_t k = 0;
+    memcpy(&k, str, len);
+    h = (h ^ k) * m;
+
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 29;
+    return h;
+}
+
+void line_table_init(struct line_table *t) {
+    assert(t);
+
+    memset(t, 0, sizeof(struct line_table));
+}
+
+/**
+ * Resize a dynamically allocated array
+ *
+ * This function is static : it means that it is a local function, accessible only in this source file
+ *
+ * @param array pointer on the array, it may be moved
+ * @param cap new capacity of the array, in elements
+ * @param size size of an element
+ *
+ * @return 0 on success, -1 if a memory allocation failure occurs
+ */
+static int line_table_grow(void **array, size_t cap, size_t size) {
+    void *grown = realloc(*array, cap * size);
+    if (grown == NULL) {
+        return -1;
+    }
+    *array = grown;
+    return 0;
+}
+
+/**
+ * Make room for "need" lines, commands or arguments in a table
+ *
+ * This function is static : it means that it is a local function, accessible only in this source file
+ *
+ * @return 0 on success, -1 if a memory allocation failure occurs
+ */
+static int line_table_reserve_lines(struct line_table *t, size_t need) {
+    if (t->line_cmds && need <= t->cap_lines) {
+        return 0;
+    }
+    size_t cap = t->cap_lines ? 2 * t->cap_lines : 64;
+    while (cap < need) {
+        cap *= 2;
+    }
+    // line_cmds and line_redirs need one more entry for the end of the last line
+    if (line_table_grow((void **) &t->line_cmds, cap + 1, sizeof(size_t))
+            || line_table_grow((void **) &t->line_redirs, cap + 1, sizeof(size_t))
+            || line_table_grow((void **) &t->line_input, cap, sizeof(struct line_span))
+            || line_table_grow((void **) &t->line_output, cap, sizeof(struct line_span))
+            || line_table_grow((void **) &t->line_flags, cap, sizeof(unsigned char))) {
+        return -1;
+    }
+    t->cap_lines = cap;
+    return 0;
+}
+
+static int line_table_reserve_cmds(struct line_table *t, size_t need) {
+    if (t->cmd_args && need <= t->cap_cmds) {
+        return 0;
+    }
+    size_t cap = t->cap_cmds ? 2 * t->cap_cmds : 64;
+    while (cap < need) {
+        cap *= 2;
+    }
+    if (line_table_grow((void **) &t->cmd_args, cap + 1, sizeof(size_t))) {
+        return -1;
+    }
+    t->cap_cmds = cap;
+    return 0;
+}
+
+static int line_table_reserve_args(struct line_table *t, size_t need) {
+    if (need <= t->cap_args) {
+        return 0;
+    }
+    size_t cap = t->cap_args ? 2 * t->cap_args : 256;
+    while (cap < need) {
+        cap *= 2;
+    }
+    if (line_table_grow((void **) &t->args, cap, sizeof(struct line_span))) {
+        return -1;
+    }
+    t->cap_args = cap;
+    return 0;
+}
+
+static int line_table_reserve_redirs(struct line_table *t, size_t need) {
+    if (need <= t->cap_redirs) {
+        return 0;
+    }
+    size_t cap = t->cap_redirs ? 2 * t->cap_redirs : 16;
+    while (cap < need) {
+        cap *= 2;
+    }
+    if (line_table_grow((void **) &t->redirs, cap, sizeof(struct line_table_redir))) {
+        return -1;
+    }
+    t->cap_redirs = cap;
+    return 0;
+}
+
+/**
+ * State of the sink of line_parse_words() appending a line to a table
+ */
+struct line_table_sink {
+    struct line_table *t;
+    const char *buf;
+    size_t first_cmd; // index in the table of the first command of the line
+};
+
+static int line_table_add_arg(void *data, size_t cmd, const char *word, size_t len) {
+    struct line_table_sink *s = data;
+    struct line_table *t = s->t;
+
+    if (s->first_cmd + cmd == t->n_cmds) {
+        // first argument of a new command, cmd_args[n_cmds] is already its first argument
+        if (line_table_reserve_cmds(t, t->n_cmds + 1)) {
+            return -1;
+        }
+        ++t->n_cmds;
+    }
+    if (line_table_reserve_args(t, t->n_args + 1)) {
+        return -1;
+    }
+    t->args[t->n_args].offset = word - s->buf;
+    t->args[t->n_args].len = len;
+    ++t->n_args;
+    t->cmd_args[t->n_cmds] = t->n_args;
+    return 0;
+}
+
+static int line_table_set_input(void *data, const char *word, size_t len) {
+    struct line_table_sink *s = data;
+    struct line_table *t = s->t;
+    t->line_input[t->n_lines].offset = word - s->buf;
+    t->line_input[t->n_lines].len = len;
+    return 0;
+}
+
+
+static int line_table_add_redir(void *data, size_t cmd, int fd, int kind, int target, const char *word, size_t len) {
+    struct line_table_sink *s = data;
+    struct line_table *t = s->t;
+    if (line_table_reserve_redirs(t, t->n_redirs + 1)) {
+        return -1;
+    }
+    struct line_table_redir *r = &t->redirs[t->n_redirs++];
+    r->cmd = cmd;
+    r->fd = fd;
+    r->kind = kind;
+    r->target = target;
+    r->file.offset = word ? (size_t) (word - s->buf) : LINE_TABLE_NONE;
+    r->file.len = len;
+    return 0;
+}
+
+static int line_table_add_output(void *data, size_t cmd, const char *word, size_t len, bool append) {
+    return line_table_add_redir(data, cmd, STDOUT_FILENO, append ? REDIR_TEE_APPEND : REDIR_TEE, -1, word, len);
+}
+
+/**
+ * Move the first output redirection of the last command of the last line to line_output
+ *
+ * This function is static : it means that it is a local function, accessible only in this source file
+ *
+ * @param t pointer on the table
+ * @param n_cmds number of commands of the line
+ */
+static void line_table_set_output(struct line_table *t, size_t n_cmds) {
+    size_t i = t->n_lines;
+    for (size_t r = t->line_redirs[i]; r < t->n_redirs; ++r) {
+        const struct line_table_redir *tr = &t->redirs[r];
+        if (tr->cmd == n_cmds - 1 && (tr->kind == REDIR_TEE || tr->kind == REDIR_TEE_APPEND)) {
+            t->line_output[i] = tr->file;
+            if (tr->kind == REDIR_TEE_APPEND) {
+                t->line_flags[i] |= LINE_TABLE_APPEND;
+            }
+            memmove(&t->redirs[r], &t->redirs[r + 1], (t->n_redirs - r - 1) * sizeof(struct line_table_redir));
+            --t->n_redirs;
+            return;
+        }
+    }
+}
+
+static const struct line_sink line_table_sink = {
+        .arg = line_table_add_arg,
+        .input = line_table_set_input,
+        .output = line_table_add_output,
+        .redir = line_table_add_redir
+};
+
+int lines_parse_many(struct line_table *t, const char *buf, size_t start, size_t end) {
+    assert(t);
+    assert(buf);
+    assert(start <= end);
+
+    if (line_table_reserve_cmds(t, t->n_cmds) || line_table_reserve_lines(t, t->n_lines)) {
+        return -1;
+    }
+    t->line_cmds[t->n_lines] = t->n_cmds;
+    t->line_redirs[t->n_lines] = t->n_redirs;
+    t->cmd_args[t->n_cmds] = t->n_args;
+
+    int n_invalid = 0;
+    size_t pos = start;
+    while (pos < end) {
+        const char *nl = memchr(buf + pos, '\n', end - pos);
+        size_t line_end = nl ? (size_t) (nl - buf) : end;
+
+        if (line_table_reserve_lines(t, t->n_lines + 1)) {
+            return -1;
+        }
+        size_t i = t->n_lines;
+        t->line_input[i].offset = LINE_TABLE_NONE;
+        t->line_input[i].len = 0;
+        t->line_output[i].offset = LINE_TABLE_NONE;
+        t->line_output[i].len = 0;
+        t->line_flags[i] = 0;
+
+        struct line_table_sink s = {t, buf, t->n_cmds};
+        struct line_ctx ctx;
+        line_ctx_init(&ctx);
+        size_t n_args = t->n_args;
+        size_t n_redirs = t->n_redirs;
+        size_t n_cmds;
+        bool background;
+        int err = line_parse_words(buf + pos, line_end - pos, &line_table_sink, &s, &n_cmds, &background, &ctx);
+        if (err) {
+            // drop what was appended for the line
+            t->n_cmds = s.first_cmd;
+            t->n_args = n_args;
+            t->n_redirs = n_redirs;
+            t->cmd_args[t->n_cmds] = t->n_args;
+            if (ctx.error == LINE_ERR_NOMEM) {
+                return -1;
+            }
+            t->line_input[i].offset = LINE_TABLE_NONE;
+            t->line_output[i].offset = LINE_TABLE_NONE;
+            t->line_flags[i] = LINE_TABLE_INVALID;
+            ++n_invalid;
+        }
+        else {
+            line_table_set_output(t, n_cmds);
+            if (background) {
+                t->line_flags[i] |= LINE_TABLE_BACKGROUND;
+            }
+        }
+        ++t->n_lines;
+        t->line_cmds[t->n_lines] = t->n_cmds;
+        t->line_redirs[t->n_lines] = t->n_redirs;
+
+        pos = nl ? line_end + 1 : end;
+    }
+    return n_invalid;
+}
+
+size_t lines_chunk_end(const char *buf, size_t len, size_t pos) {
+    assert(buf);
+
+    if (pos >= len) {
+        return len;
+    }
+    const char *nl = memchr(buf + pos, '\n', len - pos);
+    return nl ? (size_t) (nl - buf) + 1 : len;
+}
+
+int line_table_line(const struct line_table *t, const char *buf, size_t i, struct line *li) {
+    assert(t);
+    assert(buf);
+    assert(li);
+    assert(i < t->n_lines);
+
+    if (t->line_flags[i] & LINE_TABLE_INVALID) {
+        return -1;
+    }
+
+    struct line_words w;
+    w.n_cmds = 0;
+    for (size_t c = t->line_cmds[i]; c < t->line_cmds[i + 1]; ++c) {
+        for (size_t a = t->cmd_args[c]; a < t->cmd_args[c + 1]; ++a) {
+            line_words_arg(&w, c - t->line_cmds[i], buf + t->args[a].offset, t->args[a].len);
+        }
+    }
+
+    const struct line_span *in = &t->line_input[i];
+    w.input = in->offset != LINE_TABLE_NONE ? buf + in->offset : NULL;
+    w.input_len = in->len;
+    w.n_redirs = 0;
+    const struct line_span *out = &t->line_output[i];
+    if (out->offset != LINE_TABLE_NONE) {
+        line_words_output(&w, w.n_cmds - 1, buf + out->offset, out->len, t->line_flags[i] & LINE_TABLE_APPEND);
+    }
+    for (size_t r = t->line_redirs[i]; r < t->line_redirs[i + 1]; ++r) {
+        const struct line_table_redir *tr = &t->redirs[r];
+        const char *file = tr->file.offset != LINE_TABLE_NONE ? buf + tr->file.offset : NULL;
+        line_words_redir(&w, tr->cmd, tr->fd, tr->kind, tr->target, file, tr->file.len);
+    }
+
+    li->background = t->line_flags[i] & LINE_TABLE_BACKGROUND;
+    return line_build(li, &w);
+}
+
+void line_table_reset(struct line_table *t) {
+    assert(t);
+
+    free(t->line_cmds);
+    free(t->line_input);
+    free(t->line_output);
+    free(t->line_flags);
+    free(t->cmd_args);
+    free(t->args);
+    free(t->line_redirs);
+    free(t->redirs);
+    memset(t, 0, sizeof(struct line_table));
+}
+
+struct line_cache_entry {
+    struct line li;
+    uint64_t hash;
+    char *str;
+    size_t refs; // number of users of the line
+    bool evicted; // freed when its last user releases it
+
+    struct line_cache_entry *next_in_bucket;
+    struct line_cache_entry *newer; // LRU list
+    struct line_cache_entry *older;
+};
+
+struct line_cache {
+    pthread_mutex_t lock;
+    struct line_cache_entry **buckets;
+    size_t n_buckets; // power of 2
+    size_t size;
+    size_t capacity;
+    struct line_cache_entry *newest;
+    struct line_cache_entry *oldest;
+    size_t hits;
+    size_t misses;
+};
+
+struct line_cache *line_cache_new(size_t capacity) {
+    struct line_cache *cache = calloc(1, sizeof(struct line_cache));
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->capacity = capacity > 0 ? capacity : 1;
+    cache->n_buckets = 1;
+    while (cache->n_buckets < 2 * cache->capacity) {
+        cache->n_buckets *= 2;
+    }
+    cache->buckets = calloc(cache->n_buckets, sizeof(struct line_cache_entry *));
+    if (cache->buckets == NULL) {
+        free(cache);
+        return NULL;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+/**
+ * Free an entry of the cache and its line
+ *
+ * This function is static : it means that it is a local function, accessible only in this source file
+ *
+ * @param entry pointer on the entry to free
+ */
+static void line_cache_entry_free(struct line_cache_entry *entry) {
+    line_reset(&entry->li);
+    free(entry->str);
+    free(entry);
+}
+
+/**
+ * Remove an entry from the LRU list of the cache
+ *
+ * This function is static : it means that it is a local function, accessible only in this source file
+ */
+static void line_cache_unlink(struct line_cache *cache, struct line_cache_entry *entry) {
+    if (entry->newer) entry->newer->older = entry->older;
+    else cache->newest = entry->older;
+    if (entry->older) entry->older->newer = entry->newer;
+    else cache->oldest = entry->newer;
+    entry->newer = NULL;
+    entry->older = NULL;
+}
+
+/**
+ * Insert an entry at the head of the LRU list of the cache
+ *
+ * This function is static : it means that it is a local function, accessible only in this source file
+ */
+static void line_cache_push(struct line_cache *cache, struct line_cache_entry *entry) {
+    entry->older = cache->newest;
+    entry->newer = NULL;
+    if (cache->newest) cache->newest->newer = entry;
+    else cache->oldest = entry;
+    cache->newest = entry;
+}
+
+/**
+ * Search the entry of a string in the cache, the lock of the cache must be held
+ *
+ * This function is static : it means that it is a local function, accessible only in this source file
+ *
+ * @return pointer on the entry, NULL if the string isn't in the cache
+ */
+static struct line_cache_entry *line_cache_find(struct line_cache *cache, uint64_t hash, const char *str) {
+    struct line_cache_entry *entry = cache->buckets[hash & (cache->n_buckets - 1)];
+    while (entry && (entry->hash != hash || strcmp(entry->str, str) != 0)) {
+        entry = entry->next_in_bucket;
+    }
+    return entry;
+}
+
+/**
+ * Evict the least recently used entry of the cache, the lock of the cache must be held
+ *
+ * This function is static : it means that it is a local function, accessible only in this source file
+ */
+static void line_cache_evict(struct line_cache *cache) {
+    struct line_cache_entry *entry = cache->oldest;
+    line_cache_unlink(cache, entry);
+
+    struct line_cache_entry **pentry = &cache->buckets[entry->hash & (cache->n_buckets - 1)];
+    while (*pentry != entry) {
+        pentry = &(*pentry)->next_in_bucket;
+    }
+    *pentry = entry->next_in_bucket;
+    --cache->size;
+
+    // a line still in use is freed by its last user
+    if (entry->refs == 0) {
+        line_cache_entry_free(entry);
+    }
+    else {
+        entry->evicted = true;
+    }
+}
+
+int line_cache_parse(struct line_cache *cache, const char *str, const struct line **parsed) {
+    struct line_ctx ctx;
+    line_ctx_init(&ctx);
+    if (line_cache_parse_r(cache, str, parsed, &ctx)) {
+        fprintf(stderr, "Error while parsing: %s\n", ctx.message);
+        return -1;
+    }
+    return 0;
+}
+
+int line_cache_parse_r(struct line_cache *cache, const char *str, const struct line **parsed, struct line_ctx *ctx) {
+    assert(cache);
+    assert(str);
+    assert(parsed);
+    assert(ctx);
+
+    size_t len = strlen(str);
+    uint64_t hash = line_hash(str, len);
+
+    pthread_mutex_lock(&cache->lock);
+    struct line_cache_entry *entry = line_cache_find(cache, hash, str);
+    if (entry) {
+        ++cache->hits;
+        ++entry->refs;
+        line_cache_unlink(cache, entry);
+        line_cache_push(cache, entry);
+        pthread_mutex_unlock(&cache->lock);
+        *parsed = &entry->li;
+        return 0;
+    }
+    ++cache->misses;
+    pthread_mutex_unlock(&cache->lock);
+
+    // parse without holding the lock, so that other threads can use the cache meanwhile
+    entry = calloc(1, sizeof(struct line_cache_entry));
+    if (entry == NULL) {
+        parse_error(ctx, LINE_ERR_NOMEM, 0, "Memory allocation failure");
+        return -1;
+    }
+    line_init(&entry->li);
+    if (line_parse_r(&entry->li, str, ctx)) {
+        line_cache_entry_free(entry);
+        return -1;
+    }
+    entry->str = malloc(len + 1);
+    if (entry->str == NULL) {
+        parse_error(ctx, LINE_ERR_NOMEM, 0, "Memory allocation failure");
+        line_cache_entry_free(entry);
+        return -1;
+    }
+    memcpy(entry->str, str, len + 1);
+    entry->hash = hash;
+    entry->refs = 1;
+
+    pthread_mutex_lock(&cache->lock);
+    // another thread may have parsed the same string meanwhile
+    struct line_cache_entry *other = line_cache_find(cache, hash, str);
+    if (other) {
+        ++other->refs;
+        pthread_mutex_unlock(&cache->lock);
+        line_cache_entry_free(entry);
+        *parsed = &other->li;
+        return 0;
+    }
+
+    if (cache->size == cache->capacity) {
+        line_cache_evict(cache);
+    }
+    struct line_cache_entry **bucket = &cache->buckets[hash & (cache->n_buckets - 1)];
+    entry->next_in_bucket = *bucket;
+    *bucket = entry;
+    line_cache_push(cache, entry);
+    ++cache->size;
+    pthread_mutex_unlock(&cache->lock);
+
+    *parsed = &entry->li;
+    return 0;
+}
+
+void line_cache_release(struct line_cache *cache, const struct line *parsed) {
+    assert(cache);
+    assert(parsed);
+
+    struct line_cache_entry *entry = (struct line_cache_entry *) ((char *) parsed - offsetof(struct line_cache_entry, li));
+
+    pthread_mutex_lock(&cache->lock);
+    assert(entry->refs > 0);
+    --entry->refs;
+    bool free_it = entry->refs == 0 && entry->evicted;
+    pthread_mutex_unlock(&cache->lock);
+
+    if (free_it) {
+        line_cache_entry_free(entry);
+    }
+}
+
+void line_cache_stats(struct line_cache *cache, size_t *hits, size_t *misses) {
+    assert(cache);
+
+    pthread_mutex_lock(&cache->lock);
+    *hits = cache->hits;
+    *misses = cache->misses;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void line_cache_free(struct line_cache *cache) {
+    if (cache == NULL) {
+        return;
+    }
+
+    while (cache->oldest) {
+        line_cache_evict(cache);
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache);
 }
@@ -3,22 +3,58 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 #define MAX_ARGS 16
 #define MAX_CMDS 16
+#define MAX_REDIRS 16 // numbered redirections and copies of descriptors
 
 struct cmd {
-    char *args[MAX_ARGS + 1]; //+1 to have a NULL at the end if nargs = MAX_ARGS
+    char **args; // n_args + 1 entries, to have a NULL at the end
     size_t n_args;
 };
 
+#define REDIR_INPUT 0 // N< file
+#define REDIR_OUTPUT 1 // N> file
+#define REDIR_APPEND 2 // N>> file
+#define REDIR_DUP 3 // N>&M or N<&M, descriptor N becomes a copy of descriptor M
+#define REDIR_CLOSE 4 // N>&- or N<&-
+#define REDIR_TEE 5 // > file, one more destination of the standard output, "fd" is 1
+#define REDIR_TEE_APPEND 6 // >> file
+
+/*
+ * A redirection of a descriptor of a command, N and M are digits
+ *
+ * The first output redirection of the last command is the file_output of its line. The other
+ * ones, and those of the commands followed by a pipe, are REDIR_TEE* : the standard output of
+ * the command is copied to each of them, and to the pipe
+ */
+struct redir {
+    size_t cmd; // index of the command
+    int fd; // descriptor N
+    int kind; // REDIR_* kind
+    int target; // descriptor M, only used by REDIR_DUP
+    char *file; // only used by REDIR_INPUT, REDIR_OUTPUT, REDIR_APPEND and REDIR_TEE*
+};
+
+/*
+ * The commands, their arguments, their redirections and the filenames of a line are stored
+ * in a single memory space allocated by line_parse() : only the words of the line are stored,
+ * and the struct line itself is small
+ */
 struct line {
-    struct cmd cmds[MAX_CMDS];
+    struct cmd *cmds; // n_cmds entries, NULL if n_cmds = 0
     size_t n_cmds;
     char *file_input;
     char *file_output;
     bool file_output_append; // only used if file_output isn't NULL
     bool background;
+    struct redir *redirs; // applied in order, after the redirections of the pipes and the files
+    size_t n_redirs;
 };
 
 /**
@@ -34,6 +70,9 @@ void line_init(struct line *li);
 /**
  * Parse the string "str" and construct the struct line pointed by "li"
  * 
+ * Errors are printed on stderr. If the string doesn't end with '\n', the line was too long
+ * for the buffer of the caller : the rest of the line is read from stdin and dropped
+ *
  * You must call line_init() or line_reset() before calling this function
  * 
  * @param li pointer on the struct line to fill
@@ -43,6 +82,51 @@ void line_init(struct line *li);
  */
 int line_parse(struct line *li, const char *str);
 
+#define LINE_ERR_NONE 0
+#define LINE_ERR_QUOTE 1 // a quote isn't closed
+#define LINE_ERR_SYNTAX 2 // an operator or a command is missing or misplaced
+#define LINE_ERR_WORD 3 // an argument or a filename contains a forbidden char
+#define LINE_ERR_LIMIT 4 // more than MAX_CMDS commands or MAX_ARGS arguments
+#define LINE_ERR_NOMEM 5 // a memory allocation failure occured
+
+#define LINE_CTX_UNICODE_SPACE 1 // the spaces of Unicode separate the words too, not only the ASCII ones
+
+/**
+ * The context of a call to line_parse_r(), giving its options and retrieving its error
+ */
+struct line_ctx {
+    unsigned flags; // LINE_CTX_* options, set by the caller
+    int error; // LINE_ERR_* code
+    size_t offset; // position in the string of the char where the error is detected
+    char message[128]; // description of the error, without '\n'
+};
+
+/**
+ * Init a struct line_ctx
+ *
+ * All bytes occupied by the structure are set to 0
+ *
+ * @param ctx pointer on the struct line_ctx to be initialized
+ */
+void line_ctx_init(struct line_ctx *ctx);
+
+/**
+ * Parse the string "str" and construct the struct line pointed by "li"
+ *
+ * Unlike line_parse(), this function does no I/O and uses no global state : the error is
+ * returned in "ctx", and several threads can call it at the same time. The string doesn't
+ * have to end with '\n'
+ *
+ * You must call line_init() or line_reset() before calling this function
+ *
+ * @param li pointer on the struct line to fill
+ * @param str pointer on the first char of string line to parse
+ * @param ctx pointer on the context retrieving the error
+ *
+ * @return 0 on success, -1 on failure
+ */
+int line_parse_r(struct line *li, const char *str, struct line_ctx *ctx);
+
 /**
  * Reset a struct line
  * 
@@ -53,4 +137,220 @@ int line_parse(struct line *li, const char *str);
  */
 void line_reset(struct line *li);
 
+/**
+ * Copy a struct line
+ *
+ * The copy has its own memory space, it stays valid after the original is reset
+ *
+ * You must call line_init() or line_reset() before calling this function
+ *
+ * @param dst pointer on the struct line to fill
+ * @param src pointer on the struct line to copy
+ *
+ * @return 0 on success, -1 if a memory allocation failure occurs
+ */
+int line_dup(struct line *dst, const struct line *src);
+
+/**
+ * Compute a 64 bits hash of "len" bytes
+ *
+ * The bytes are processed 8 at a time, it is much faster than parsing the line
+ *
+ * @param str pointer on the first byte to hash
+ * @param len number of bytes to hash
+ *
+ * @return the hash
+ */
+uint64_t line_hash(const char *str, size_t len);
+
+/**
+ * A span of bytes of the buffer given to lines_parse_many()
+ */
+struct line_span {
+    size_t offset; // position of the first byte in the buffer
+    size_t len;
+};
+
+#define LINE_TABLE_NONE ((size_t) -1) // offset of the span of a missing redirection
+
+#define LINE_TABLE_BACKGROUND 1
+#define LINE_TABLE_APPEND 2 // only used if the line has an output redirection
+#define LINE_TABLE_INVALID 4 // the line isn't valid, it has no command
+
+/**
+ * A redirection of a line of a struct line_table, like a struct redir
+ */
+struct line_table_redir {
+    size_t cmd; // index of the command in its line
+    int fd;
+    int kind;
+    int target;
+    struct line_span file; // offset is LINE_TABLE_NONE without file
+};
+
+/**
+ * The command lines of a buffer, stored as a structure of arrays
+ *
+ * The commands of the line i are [line_cmds[i], line_cmds[i + 1]) and the arguments of the
+ * command c are [cmd_args[c], cmd_args[c + 1]), so a whole buffer uses only a few arrays. The
+ * numbered redirections of the line i are [line_redirs[i], line_redirs[i + 1]).
+ * The words aren't copied : the spans point into the buffer, without the quotes
+ */
+struct line_table {
+    size_t n_lines;
+    size_t *line_cmds; // n_lines + 1 entries
+    struct line_span *line_input; // offset is LINE_TABLE_NONE without input redirection
+    struct line_span *line_output; // offset is LINE_TABLE_NONE without output redirection
+    unsigned char *line_flags; // LINE_TABLE_* flags
+    size_t *line_redirs; // n_lines + 1 entries
+
+    size_t n_cmds;
+    size_t *cmd_args; // n_cmds + 1 entries
+
+    size_t n_args;
+    struct line_span *args;
+
+    size_t n_redirs;
+    struct line_table_redir *redirs;
+
+    size_t cap_lines;
+    size_t cap_cmds;
+    size_t cap_args;
+    size_t cap_redirs;
+};
+
+/**
+ * Init a struct line_table
+ *
+ * All bytes occupied by the structure are set to 0
+ *
+ * @param t pointer on the struct line_table to be initialized
+ */
+void line_table_init(struct line_table *t);
+
+/**
+ * Parse the newline-separated command lines of buf[start, end) and append them to a table
+ *
+ * Each line of the buffer, including the empty ones, gets an entry in the table, the last
+ * line may have no '\n'. Lines that aren't valid are flagged LINE_TABLE_INVALID, nothing is
+ * printed. Several tables can be filled at the same time by different threads, from chunks
+ * of the same buffer cut by lines_chunk_end()
+ *
+ * @param t pointer on the table to fill
+ * @param buf pointer on the first char of the buffer, the spans are relative to it
+ * @param start position of the first line to parse
+ * @param end position of the end of the last line to parse
+ *
+ * @return the number of lines which aren't valid, -1 if a memory allocation failure occurs
+ */
+int lines_parse_many(struct line_table *t, const char *buf, size_t start, size_t end);
+
+/**
+ * Find the end of a chunk of whole lines
+ *
+ * @param buf pointer on the first char of the buffer
+ * @param len length of the buffer
+ * @param pos position from which the chunk should end
+ *
+ * @return the position following the first '\n' found from "pos", "len" if there is none
+ */
+size_t lines_chunk_end(const char *buf, size_t len, size_t pos);
+
+/**
+ * Construct the struct line of a line of a table
+ *
+ * You must call line_init() or line_reset() before calling this function
+ *
+ * @param t pointer on the table
+ * @param buf pointer on the buffer given to lines_parse_many()
+ * @param i index of the line in the table
+ * @param li pointer on the struct line to fill
+ *
+ * @return 0 on success, -1 if the line isn't valid or if a memory allocation failure occurs
+ */
+int line_table_line(const struct line_table *t, const char *buf, size_t i, struct line *li);
+
+/**
+ * Reset a struct line_table
+ *
+ * Free dynamically allocated memory
+ * All bytes occupied by the structure are set to 0
+ *
+ * @param t pointer on the struct line_table to be reset
+ */
+void line_table_reset(struct line_table *t);
+
+/**
+ * A LRU cache of parsed lines, keyed by the string entered by the user
+ *
+ * The cache can be used by several threads at the same time
+ */
+struct line_cache;
+
+/**
+ * Create a cache of parsed lines
+ *
+ * @param capacity maximal number of lines kept in the cache
+ *
+ * @return the cache, NULL if a memory allocation failure occurs
+ */
+struct line_cache *line_cache_new(size_t capacity);
+
+/**
+ * Parse the string "str", or get the line parsed for the same string earlier
+ *
+ * The line is shared with the cache and with the other users of the same string : it must not
+ * be modified, and must be released with line_cache_release() once it isn't used anymore.
+ * Lines that aren't valid are not cached, errors are reported like line_parse() does
+ *
+ * @param cache pointer on the cache
+ * @param str pointer on the first char of string line entered by the user
+ * @param parsed retrieves a pointer on the parsed line
+ *
+ * @return 0 on success, -1 on failure
+ */
+int line_cache_parse(struct line_cache *cache, const char *str, const struct line **parsed);
+
+/**
+ * Same as line_cache_parse(), but the error is returned in "ctx" like line_parse_r() does
+ *
+ * @param cache pointer on the cache
+ * @param str pointer on the first char of string line entered by the user
+ * @param parsed retrieves a pointer on the parsed line
+ * @param ctx pointer on the context retrieving the error
+ *
+ * @return 0 on success, -1 on failure
+ */
+int line_cache_parse_r(struct line_cache *cache, const char *str, const struct line **parsed, struct line_ctx *ctx);
+
+/**
+ * Release a line obtained with line_cache_parse()
+ *
+ * @param cache pointer on the cache
+ * @param parsed pointer on the line to release
+ */
+void line_cache_release(struct line_cache *cache, const struct line *parsed);
+
+/**
+ * Get the number of lookups found in the cache and the number of lines parsed
+ *
+ * @param cache pointer on the cache
+ * @param hits retrieves the number of lines found in the cache
+ * @param misses retrieves the number of lines which had to be parsed
+ */
+void line_cache_stats(struct line_cache *cache, size_t *hits, size_t *misses);
+
+/**
+ * Free a cache and all its lines
+ *
+ * No line of the cache may be in use
+ *
+ * @param cache pointer on the cache
+ */
+void line_cache_free(struct line_cache *cache);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
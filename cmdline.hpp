@@ -0,0 +1,188 @@
+#ifndef CMDLINE_HPP
+#define CMDLINE_HPP
+
+/*
+ * C++17 interface of libcmdline, header-only
+ *
+ * The arguments and filenames are std::string_view on the memory space of the parsed line :
+ * nothing is copied, and they are valid as long as the Line they come from
+ */
+
+#include <cstddef>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <variant>
+
+#include "cmdline.h"
+
+namespace cmdline {
+
+/**
+ * The error of a parse which failed
+ */
+struct Error {
+    int code; // LINE_ERR_* code
+    std::size_t offset; // position in the string of the char where the error is detected
+    std::string message;
+};
+
+/**
+ * A value, or the error which prevented to get it, like std::expected
+ */
+template <typename T>
+class Result {
+public:
+    Result(T value) : v_(std::in_place_index<0>, std::move(value)) {}
+    Result(Error error) : v_(std::in_place_index<1>, std::move(error)) {}
+
+    bool has_value() const noexcept { return v_.index() == 0; }
+    explicit operator bool() const noexcept { return has_value(); }
+
+    // throw std::bad_variant_access if there is no value
+    T &value() & { return std::get<0>(v_); }
+    const T &value() const & { return std::get<0>(v_); }
+    T &&value() && { return std::get<0>(std::move(v_)); }
+
+    T &operator*() & { return *std::get_if<0>(&v_); }
+    const T &operator*() const & { return *std::get_if<0>(&v_); }
+    T *operator->() { return std::get_if<0>(&v_); }
+    const T *operator->() const { return std::get_if<0>(&v_); }
+
+    // only valid if there is no value
+    const Error &error() const { return *std::get_if<1>(&v_); }
+
+private:
+    std::variant<T, Error> v_;
+};
+
+/**
+ * The arguments of a command, a range of std::string_view
+ */
+class Args {
+public:
+    class iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::string_view;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const std::string_view *;
+        using reference = std::string_view;
+
+        explicit iterator(char *const *p) noexcept : p_(p) {}
+        std::string_view operator*() const { return std::string_view(*p_); }
+        iterator &operator++() noexcept { ++p_; return *this; }
+        iterator operator++(int) noexcept { iterator it = *this; ++p_; return it; }
+        bool operator==(const iterator &o) const noexcept { return p_ == o.p_; }
+        bool operator!=(const iterator &o) const noexcept { return p_ != o.p_; }
+
+    private:
+        char *const *p_;
+    };
+
+    explicit Args(const struct cmd *cmd) noexcept : cmd_(cmd) {}
+
+    std::size_t size() const noexcept { return cmd_->n_args; }
+    std::string_view operator[](std::size_t i) const { return std::string_view(cmd_->args[i]); }
+    iterator begin() const noexcept { return iterator(cmd_->args); }
+    iterator end() const noexcept { return iterator(cmd_->args + cmd_->n_args); }
+
+    // argv ended by NULL, for execvp()
+    char *const *argv() const noexcept { return cmd_->args; }
+
+private:
+    const struct cmd *cmd_;
+};
+
+/**
+ * A parsed command line, owning the memory space of its words
+ */
+class Line {
+public:
+    class iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Args;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const Args *;
+        using reference = Args;
+
+        explicit iterator(const struct cmd *p) noexcept : p_(p) {}
+        Args operator*() const noexcept { return Args(p_); }
+        iterator &operator++() noexcept { ++p_; return *this; }
+        iterator operator++(int) noexcept { iterator it = *this; ++p_; return it; }
+        bool operator==(const iterator &o) const noexcept { return p_ == o.p_; }
+        bool operator!=(const iterator &o) const noexcept { return p_ != o.p_; }
+
+    private:
+        const struct cmd *p_;
+    };
+
+    Line() noexcept { line_init(&li_); }
+    ~Line() { line_reset(&li_); }
+
+    Line(const Line &) = delete;
+    Line &operator=(const Line &) = delete;
+
+    // the struct line only holds a pointer on its memory space, moving it is a copy of the struct
+    Line(Line &&o) noexcept : li_(o.li_) { line_init(&o.li_); }
+    Line &operator=(Line &&o) noexcept {
+        if (this != &o) {
+            line_reset(&li_);
+            li_ = o.li_;
+            line_init(&o.li_);
+        }
+        return *this;
+    }
+
+    /**
+     * Parse a command line with line_parse_r()
+     *
+     * @param str the command line, a '\n' at the end is allowed
+     * @param flags LINE_CTX_* options
+     * @return the line, or the error of the parser
+     */
+    static Result<Line> parse(const char *str, unsigned flags = 0) {
+        Line parsed;
+        struct line_ctx ctx;
+        line_ctx_init(&ctx);
+        ctx.flags = flags;
+        if (line_parse_r(&parsed.li_, str, &ctx)) {
+            return Error{ctx.error, ctx.offset, ctx.message};
+        }
+        return Result<Line>(std::move(parsed));
+    }
+
+    static Result<Line> parse(const std::string &str, unsigned flags = 0) { return parse(str.c_str(), flags); }
+
+    std::size_t size() const noexcept { return li_.n_cmds; }
+    bool empty() const noexcept { return li_.n_cmds == 0; }
+    Args operator[](std::size_t i) const noexcept { return Args(&li_.cmds[i]); }
+    iterator begin() const noexcept { return iterator(li_.cmds); }
+    iterator end() const noexcept { return iterator(li_.cmds + li_.n_cmds); }
+
+    std::optional<std::string_view> input() const {
+        if (li_.file_input == nullptr) return std::nullopt;
+        return std::string_view(li_.file_input);
+    }
+
+    std::optional<std::string_view> output() const {
+        if (li_.file_output == nullptr) return std::nullopt;
+        return std::string_view(li_.file_output);
+    }
+
+    bool append() const noexcept { return li_.file_output_append; }
+    bool background() const noexcept { return li_.background; }
+
+    // the struct line, for the C functions using it
+    const struct line *get() const noexcept { return &li_; }
+
+private:
+    struct line li_;
+};
+
+} // namespace cmdline
+
+#endif
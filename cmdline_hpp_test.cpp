@@ -0,0 +1,175 @@
+#include "cmdline.hpp"
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+#define OK 0
+#define KO 1
+
+#define RED     "\x1b[31m"
+#define GREEN   "\x1b[32m"
+#define NC   "\x1b[0m"
+
+// A Line owns the memory space of its words : it can be moved, never copied
+static_assert(!std::is_copy_constructible_v<cmdline::Line>);
+static_assert(!std::is_copy_assignable_v<cmdline::Line>);
+static_assert(std::is_nothrow_move_constructible_v<cmdline::Line>);
+static_assert(std::is_nothrow_move_assignable_v<cmdline::Line>);
+
+/**
+ * Print the result of a test
+ * @param ok true if the test succeeded
+ * @param what description of the test, printed if it failed
+ */
+static void report(bool ok, const char *what) {
+    if (!ok) {
+        std::printf("%sUNEXPECTED RESULT OF %s%s\n", RED, what, NC);
+    }
+    else {
+        std::printf("%sTEST OK!%s\n", GREEN, NC);
+    }
+}
+
+/**
+ * Test a command line "str"
+ *
+ * This function prints "TEST OK!" if Line::parse() returns a value consistent with the one
+ * transmitted via the parameter "expected", and another significant message otherwise
+ *
+ * @param str command line to test
+ * @param expected OK if the command line is expected to be valid, KO otherwise
+ */
+static void try_parse(const char *str, int expected) {
+    static int n = 0;
+    std::printf("TEST #%i\n", ++n);
+
+    cmdline::Result<cmdline::Line> parsed = cmdline::Line::parse(str);
+    if (parsed.has_value() != (expected == OK)) {
+        std::printf("%sUNEXPECTED RETURN WITH: %s%s\n", RED, str, NC);
+        return;
+    }
+    if (!parsed) std::printf("Error while parsing: %s\n", parsed.error().message.c_str());
+    std::printf("%sTEST OK!%s\n", GREEN, NC);
+}
+
+/**
+ * Test the moves of a Line
+ *
+ * This function prints "TEST OK!" if a moved line keeps its words, and if the line it was
+ * moved from is left empty
+ */
+static void try_move() {
+    std::printf("TEST MOVE\n");
+
+    cmdline::Result<cmdline::Line> parsed = cmdline::Line::parse("bar baz | qux > quux\n");
+    bool ok = parsed.has_value();
+    if (ok) {
+        cmdline::Line a = std::move(*parsed);
+        ok = parsed->empty() && a.size() == 2 && a[0][1] == "baz";
+
+        cmdline::Line b;
+        b = std::move(a);
+        ok = ok && a.empty() && a.begin() == a.end()
+             && b.size() == 2 && b[1][0] == "qux" && b.output() == std::string_view("quux");
+
+        // Moving a line onto itself keeps it
+        cmdline::Line &same = b;
+        b = std::move(same);
+        ok = ok && b.size() == 2 && b[0][0] == "bar";
+
+        // The line taken out of the result owns the words
+        cmdline::Line c = std::move(cmdline::Line::parse("echo abc")).value();
+        ok = ok && c.size() == 1 && c[0][1] == "abc";
+    }
+    report(ok, "THE MOVES OF A LINE");
+}
+
+/**
+ * Test the ranges of commands and arguments
+ *
+ * This function prints "TEST OK!" if the commands and their arguments are seen as ranges of
+ * std::string_view, and if the redirections and the background flag are the parsed ones
+ */
+static void try_args() {
+    std::printf("TEST ARGS\n");
+
+    cmdline::Result<cmdline::Line> parsed = cmdline::Line::parse("< in bar -x \"a b\" | baz >> out &\n");
+    bool ok = parsed.has_value();
+    if (ok) {
+        const cmdline::Line &line = *parsed;
+        std::vector<std::vector<std::string_view>> cmds;
+        for (cmdline::Args args : line) cmds.emplace_back(args.begin(), args.end());
+        const std::vector<std::vector<std::string_view>> expected = { { "bar", "-x", "a b" }, { "baz" } };
+        ok = cmds == expected;
+
+        cmdline::Args first = line[0];
+        ok = ok && first.size() == 3 && first[2] == "a b"
+             && first.argv()[0] == first[0].data() && first.argv()[3] == nullptr;
+
+        // The views point to the memory space of the line, nothing is copied
+        ok = ok && first[1].data() == line.get()->cmds[0].args[1];
+
+        ok = ok && line.input() == std::string_view("in") && line.output() == std::string_view("out")
+             && line.append() && line.background();
+    }
+
+    cmdline::Result<cmdline::Line> plain = cmdline::Line::parse(std::string("bar"));
+    ok = ok && plain.has_value() && !plain->input() && !plain->output()
+         && !plain->append() && !plain->background();
+    report(ok, "THE RANGES OF ARGUMENTS");
+}
+
+/**
+ * Test the errors of the parser
+ *
+ * This function prints "TEST OK!" if a failed parse gives the code, the offset and the message
+ * of the error, and holds no line
+ */
+static void try_result() {
+    std::printf("TEST RESULT\n");
+
+    cmdline::Result<cmdline::Line> parsed = cmdline::Line::parse("ls | | wc");
+    bool ok = !parsed && !parsed.has_value()
+              && parsed.error().code == LINE_ERR_SYNTAX && parsed.error().offset == 5
+              && parsed.error().message == "An empty command before a pipe detected";
+
+    bool thrown = false;
+    try {
+        parsed.value();
+    }
+    catch (const std::bad_variant_access &) {
+        thrown = true;
+    }
+    ok = ok && thrown;
+
+    cmdline::Result<cmdline::Line> quote = cmdline::Line::parse("echo \"abc");
+    ok = ok && !quote && quote.error().code == LINE_ERR_QUOTE && quote.error().offset == 5;
+
+    // The options are given to the parser
+    cmdline::Result<cmdline::Line> spaced = cmdline::Line::parse("cat a\xc2\xa0" "b", LINE_CTX_UNICODE_SPACE);
+    ok = ok && spaced && (*spaced)[0].size() == 3 && (*spaced)[0][2] == "b";
+
+    cmdline::Result<int> value(42);
+    ok = ok && value && *value == 42;
+    report(ok, "THE ERRORS OF THE PARSER");
+}
+
+int main() {
+    try_parse("bar\n", OK);
+    try_parse("bar baz | qux\n", OK);
+    try_parse("bar > qux &", OK);
+    try_parse("\n", OK);
+    try_parse("bar |\n", KO);
+    try_parse("bar \"baz\n", KO);
+    try_parse("bar & baz\n", KO);
+
+    try_move();
+    try_args();
+    try_result();
+
+    return 0;
+}
@@ -45,6 +45,181 @@ static void try(const char *str, int expected) {
     line_reset(&li);
 }
 
+/**
+ * Test the cache of parsed lines
+ *
+ * This function is static : it means that it is a local function, accessible only in this source file.
+ * This function prints "TEST OK!" if a line parsed twice is shared through the cache, if an
+ * invalid line isn't cached, and if the least recently used line is evicted
+ */
+static void try_cache(void) {
+    printf("TEST CACHE\n");
+
+    struct line_cache *cache = line_cache_new(2);
+    const struct line *a1, *a2, *b, *c, *a3;
+    size_t hits, misses;
+
+    int ok = cache != NULL
+             && line_cache_parse(cache, "bar baz\n", &a1) == 0
+             && line_cache_parse(cache, "bar baz\n", &a2) == 0
+             && a1 == a2
+             && a1->n_cmds == 1
+             && a1->cmds[0].n_args == 2
+             && line_cache_parse(cache, "bar |\n", &b) != 0
+             && line_cache_parse(cache, "qux\n", &b) == 0
+             && line_cache_parse(cache, "quux\n", &c) == 0;
+    if (ok) {
+        // "bar baz" was evicted by "quux" while still in use
+        line_cache_release(cache, a1);
+        line_cache_release(cache, a2);
+        line_cache_release(cache, b);
+        line_cache_release(cache, c);
+        line_cache_stats(cache, &hits, &misses);
+        ok = hits == 1 && misses == 4
+             && line_cache_parse(cache, "bar baz\n", &a3) == 0
+             && a3->n_cmds == 1;
+        if (ok) line_cache_release(cache, a3);
+    }
+    line_cache_free(cache);
+
+    if (!ok) {
+        printf("%sUNEXPECTED RESULT OF THE CACHE%s\n", RED, NC);
+    }
+    else {
+        printf("%sTEST OK!%s\n", GREEN, NC);
+    }
+}
+
+/**
+ * Test the batch parse of a buffer into a table
+ *
+ * This function is static : it means that it is a local function, accessible only in this source file.
+ * This function prints "TEST OK!" if the lines of a buffer parsed in two chunks are found in the
+ * table, and if a line of the table can be turned into a struct line
+ */
+static void try_many(void) {
+    printf("TEST MANY\n");
+
+    const char *buf = "cat < in | wc -l >> out\n\nls |\necho \"a b\" &";
+    size_t len = strlen(buf);
+    struct line_table t;
+    struct line li;
+    line_table_init(&t);
+    line_init(&li);
+
+    // two chunks parsed one after the other, as two threads would do
+    size_t cut = lines_chunk_end(buf, len, 3);
+    int ok = cut == 24
+             && lines_parse_many(&t, buf, 0, cut) == 0
+             && lines_parse_many(&t, buf, cut, len) == 1
+             && t.n_lines == 4 && t.n_cmds == 3 && t.n_args == 5
+             && t.line_cmds[1] == 2 && t.line_cmds[2] == 2 && t.line_cmds[3] == 2
+             && t.line_flags[0] == LINE_TABLE_APPEND
+             && t.line_flags[2] == LINE_TABLE_INVALID
+             && t.line_flags[3] == LINE_TABLE_BACKGROUND
+             && t.line_input[0].offset == 6 && t.line_input[0].len == 2
+             && t.line_output[3].offset == LINE_TABLE_NONE
+             && t.args[4].len == 3 && strncmp(buf + t.args[4].offset, "a b", 3) == 0
+             && line_table_line(&t, buf, 2, &li) != 0
+             && line_table_line(&t, buf, 0, &li) == 0
+             && li.n_cmds == 2 && strcmp(li.cmds[1].args[1], "-l") == 0
+             && strcmp(li.file_output, "out") == 0 && li.file_output_append;
+    line_reset(&li);
+    line_table_reset(&t);
+
+    if (!ok) {
+        printf("%sUNEXPECTED RESULT OF THE BATCH PARSE%s\n", RED, NC);
+    }
+    else {
+        printf("%sTEST OK!%s\n", GREEN, NC);
+    }
+}
+
+/**
+ * Test the errors returned by line_parse_r()
+ *
+ * This function is static : it means that it is a local function, accessible only in this source file.
+ * This function prints "TEST OK!" if the code and the offset of the errors are the expected ones,
+ * and if the Unicode spaces only separate words when the option is set
+ */
+static void try_reentrant(void) {
+    printf("TEST REENTRANT\n");
+
+    struct line li;
+    struct line_ctx ctx;
+    line_init(&li);
+    line_ctx_init(&ctx);
+
+    int ok = line_parse_r(&li, "ls | | wc", &ctx) != 0
+             && ctx.error == LINE_ERR_SYNTAX && ctx.offset == 5
+             && strcmp(ctx.message, "An empty command before a pipe detected") == 0;
+    line_reset(&li);
+    ok = ok && line_parse_r(&li, "echo \"abc", &ctx) != 0
+             && ctx.error == LINE_ERR_QUOTE && ctx.offset == 5;
+    line_reset(&li);
+    // no '\n' needed, and a success clears the error
+    ok = ok && line_parse_r(&li, "echo abc", &ctx) == 0
+             && ctx.error == LINE_ERR_NONE && li.n_cmds == 1;
+    line_reset(&li);
+
+    // non-ASCII bytes are chars of the words, U+00A0 and U+3000 are spaces only if configured
+    ok = ok && line_parse_r(&li, "cat caf\xc3\xa9\xc2\xa0\xe6\x97\xa5\xe3\x80\x80x\xff", &ctx) == 0
+             && li.cmds[0].n_args == 2
+             && strcmp(li.cmds[0].args[1], "caf\xc3\xa9\xc2\xa0\xe6\x97\xa5\xe3\x80\x80x\xff") == 0;
+    line_reset(&li);
+    ctx.flags = LINE_CTX_UNICODE_SPACE;
+    ok = ok && line_parse_r(&li, "cat caf\xc3\xa9\xc2\xa0\xe6\x97\xa5\xe3\x80\x80x\xff", &ctx) == 0
+             && li.cmds[0].n_args == 4
+             && strcmp(li.cmds[0].args[1], "caf\xc3\xa9") == 0
+             && strcmp(li.cmds[0].args[2], "\xe6\x97\xa5") == 0
+             && strcmp(li.cmds[0].args[3], "x\xff") == 0;
+    line_reset(&li);
+
+    if (!ok) {
+        printf("%sUNEXPECTED RESULT OF THE REENTRANT PARSE%s\n", RED, NC);
+    }
+    else {
+        printf("%sTEST OK!%s\n", GREEN, NC);
+    }
+}
+
+/**
+ * Test the copy of a struct line
+ *
+ * This function is static : it means that it is a local function, accessible only in this source file.
+ * This function prints "TEST OK!" if the copy of a line still holds its words and redirections
+ * once the original is reset
+ */
+static void try_dup(void) {
+    printf("TEST DUP\n");
+
+    struct line li, copy;
+    line_init(&li);
+    line_init(&copy);
+
+    int ok = line_parse(&li, "bar qux < baz 2>&1 | quux > a > b 3>> c &\n") == 0
+             && line_dup(&copy, &li) == 0;
+    line_reset(&li);
+    ok = ok && copy.n_cmds == 2
+             && copy.cmds[0].n_args == 2 && strcmp(copy.cmds[0].args[1], "qux") == 0
+             && copy.cmds[0].args[2] == NULL
+             && strcmp(copy.cmds[1].args[0], "quux") == 0
+             && strcmp(copy.file_input, "baz") == 0
+             && strcmp(copy.file_output, "a") == 0
+             && copy.background
+             && copy.n_redirs == 3
+             && copy.redirs[0].kind == REDIR_DUP && copy.redirs[0].file == NULL
+             && strcmp(copy.redirs[1].file, "b") == 0
+             && copy.redirs[2].fd == 3 && strcmp(copy.redirs[2].file, "c") == 0;
+    line_reset(&copy);
+
+    if (!ok) {
+        printf("%sUNEXPECTED RESULT OF THE COPY%s\n", RED, NC);
+    }
+    else {
+        printf("%sTEST OK!%s\n", GREEN, NC);
+    }
+}
 
 int main() {
     // things working
@@ -86,15 +261,15 @@ int main() {
     try("bar \"bar\n", KO);
 
     try("bar & | baz\n", KO);
-    try("bar > qux | baz\n", KO);
-    try("bar >> qux | baz\n", KO);
+    try("bar > qux | baz\n", OK);
+    try("bar >> qux | baz\n", OK);
     try("bar > qux |\n", KO);
     try("bar >> qux |\n", KO);
     try("bar | | barz\n", KO);
     try("|\n", KO);
 
-    try("bar > qux > baz\n", KO);
-    try("bar >> qux > baz\n", KO);
+    try("bar > qux > baz\n", OK);
+    try("bar >> qux > baz\n", OK);
     try("bar & > qux\n", KO);
     try("bar & >> qux\n", KO);
     try("bar >\n", KO);
@@ -132,5 +307,24 @@ int main() {
     try("> qux \n", KO);
     try(">> qux \n", KO);
 
+    try("exec 3> qux\n", OK);
+    try("exec 3>> qux 4< baz 5>&-\n", OK);
+    try("bar >&3 | baz <&4 2>&1\n", OK);
+    try("bar 2>&1 > qux\n", OK);
+    try("bar 3>\n", KO);
+    try("bar 3> >\n", KO);
+    try("bar >&x\n", KO);
+    try("bar 12> qux\n", KO);
+    try("bar & 2>&1\n", KO);
+    try("3> qux\n", KO);
+
+    try("bar > qux > baz >> quux | bar > baz | baz\n", OK);
+    try("bar 2>&1 > qux | baz > quux\n", OK);
+
+    try_cache();
+    try_many();
+    try_reentrant();
+    try_dup();
+
     return 0;
 }
@@ -0,0 +1,166 @@
+#define _GNU_SOURCE // pipe2()
+
+#include "coproc.h"
+#include "exec.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_COPROCS 3 // each one takes two of the descriptors 3 to 9
+#define MAX_NAME_LEN 32
+#define MIN_COPROC_FD 3
+#define MAX_COPROC_FD 9 // the descriptors of the redirections are digits
+
+struct coproc {
+    char name[MAX_NAME_LEN];
+    pid_t pid; // -1 if this slot is empty
+    int in; // the shell writes to the coprocess through it, -1 once closed
+    int out; // the shell reads from the coprocess through it, -1 once closed
+};
+
+static struct coproc coprocs[MAX_COPROCS] = {
+        { .pid = -1, .in = -1, .out = -1 },
+        { .pid = -1, .in = -1, .out = -1 },
+        { .pid = -1, .in = -1, .out = -1 }
+};
+
+/**
+ * Forget the descriptors of a coprocess which were closed by the user, with "exec N>&-"
+ * @param c The coprocess
+ */
+static void coproc_refresh(struct coproc *c) {
+    if (c->in != -1 && fcntl(c->in, F_GETFD) == -1) c->in = -1;
+    if (c->out != -1 && fcntl(c->out, F_GETFD) == -1) c->out = -1;
+    if (c->in == -1 && c->out == -1) c->pid = -1;
+}
+
+/**
+ * Close the descriptors of a coprocess and empty its slot
+ * @param c The coprocess
+ */
+static void coproc_release(struct coproc *c) {
+    if (c->in != -1) close(c->in);
+    if (c->out != -1) close(c->out);
+    c->pid = -1;
+    c->in = -1;
+    c->out = -1;
+}
+
+/**
+ * Move a descriptor to the lowest free one from a minimum
+ * @param fd The descriptor, closed only if it was moved
+ * @param min The minimum descriptor
+ * @param max The maximum descriptor, -1 for no maximum
+ * @return The new descriptor, close-on-exec, -1 if no descriptor is free
+ */
+static int move_fd(int fd, int min, int max) {
+    int moved = fcntl(fd, F_DUPFD_CLOEXEC, min);
+    if (moved == -1) return -1;
+    if (max != -1 && moved > max) {
+        close(moved);
+        return -1;
+    }
+    close(fd);
+    return moved;
+}
+
+/**
+ * Print the coprocesses still reachable
+ */
+static void coproc_list(void) {
+    for (size_t i = 0; i < MAX_COPROCS; ++i) {
+        struct coproc *c = &coprocs[i];
+        coproc_refresh(c);
+        if (c->pid == -1) continue;
+        printf("%s\tPID %d", c->name, c->pid);
+        if (c->in != -1) printf("\twrite to >&%d", c->in);
+        if (c->out != -1) printf("\tread from <&%d", c->out);
+        printf("\n");
+    }
+    // The forked commands would print it again
+    fflush(stdout);
+}
+
+int coproc(const struct line *line) {
+    const struct cmd *cmd = &line->cmds[0];
+    if (cmd->n_args == 1) {
+        coproc_list();
+        return 0;
+    }
+    if (cmd->n_args < 3 || line->n_cmds != 1) {
+        fprintf(stderr, "Usage: coproc NAME COMMAND [ARGS...], alone on its line\n");
+        return 1;
+    }
+    const char *name = cmd->args[1];
+    if (strlen(name) >= MAX_NAME_LEN) {
+        fprintf(stderr, "coproc: name too long\n");
+        return 1;
+    }
+
+    // The name is given to the new coprocess
+    struct coproc *c = NULL;
+    for (size_t i = 0; i < MAX_COPROCS; ++i) {
+        coproc_refresh(&coprocs[i]);
+        if (coprocs[i].pid != -1 && strcmp(coprocs[i].name, name) == 0) coproc_release(&coprocs[i]);
+    }
+    for (size_t i = 0; i < MAX_COPROCS && c == NULL; ++i) {
+        if (coprocs[i].pid == -1) c = &coprocs[i];
+    }
+    if (c == NULL) {
+        fprintf(stderr, "coproc: too many coprocesses\n");
+        return 1;
+    }
+
+    // All the descriptors are close-on-exec : only the coprocess gets its ends of the pipes
+    int toCoproc[2], fromCoproc[2];
+    if (pipe2(toCoproc, O_CLOEXEC) == -1) {
+        perror("pipe failed");
+        return 1;
+    }
+    if (pipe2(fromCoproc, O_CLOEXEC) == -1) {
+        perror("pipe failed");
+        close(toCoproc[0]);
+        close(toCoproc[1]);
+        return 1;
+    }
+
+    // The ends of the coprocess leave the descriptors of the user free for the ends of the shell
+    int fd = move_fd(toCoproc[0], MAX_COPROC_FD + 1, -1);
+    if (fd != -1) toCoproc[0] = fd;
+    fd = move_fd(fromCoproc[1], MAX_COPROC_FD + 1, -1);
+    if (fd != -1) fromCoproc[1] = fd;
+    c->in = move_fd(toCoproc[1], MIN_COPROC_FD, MAX_COPROC_FD);
+    c->out = move_fd(fromCoproc[0], MIN_COPROC_FD, MAX_COPROC_FD);
+    if (c->in == -1 || c->out == -1) {
+        fprintf(stderr, "coproc: no free descriptor between %d and %d\n", MIN_COPROC_FD, MAX_COPROC_FD);
+        if (c->in == -1) close(toCoproc[1]);
+        if (c->out == -1) close(fromCoproc[0]);
+        coproc_release(c);
+        close(toCoproc[0]);
+        close(fromCoproc[1]);
+        return 1;
+    }
+
+    // The command without "coproc NAME", keeping the redirections of the line
+    struct cmd command = { .args = cmd->args + 2, .n_args = cmd->n_args - 2 };
+    struct line coprocLine = *line;
+    coprocLine.cmds = &command;
+    coprocLine.background = false;
+
+    const struct exec_io io = { .in = toCoproc[0], .out = fromCoproc[1], .err = -1 };
+    pid_t pids[MAX_PIDS];
+    int n_pids = launch_line(&coprocLine, &io, pids);
+    close(toCoproc[0]);
+    close(fromCoproc[1]);
+    if (n_pids <= 0) {
+        coproc_release(c);
+        return 1;
+    }
+
+    snprintf(c->name, sizeof(c->name), "%s", name);
+    c->pid = pids[n_pids - 1];
+    fprintf(stderr, "coproc %s: PID %d, write to >&%d, read from <&%d\n", c->name, c->pid, c->in, c->out);
+    return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef COPROC_H
+#define COPROC_H
+
+#include "cmdline.h"
+
+/**
+ * The coproc builtin : coproc [NAME COMMAND [ARGS...]]
+ *
+ * Launches COMMAND in the background with its standard input and output connected to the shell
+ * by two pipes, and prints the descriptors of the shell's ends : the next commands talk to the
+ * coprocess with the redirections >&W and <&R, and "exec W>&-" sends it the end of its input.
+ * The descriptors are between 3 and 9 so that the redirections can address them, and are not
+ * inherited by the other commands. Starting a coprocess under a NAME already used closes the
+ * descriptors of the previous one. Without arguments, lists the coprocesses
+ *
+ * @param line The command line of the builtin, a single command
+ *
+ * @return 0 on success, 1 if the coprocess couldn't be launched
+ */
+int coproc(const struct line *line);
+
+#endif
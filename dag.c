@@ -0,0 +1,500 @@
+#include "dag.h"
+#include "cmdline.h"
+#include "exec.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+enum node_state {
+    NODE_WAITING, // some dependencies aren't done
+    NODE_READY,
+    NODE_RUNNING,
+    NODE_DONE,
+    NODE_FAILED,
+    NODE_SKIPPED // a dependency failed
+};
+
+struct node {
+    char *name;
+    char **deps; // names of the dependencies
+    size_t n_deps;
+    size_t *dependents; // indexes of the nodes depending on this one
+    size_t n_dependents;
+    size_t line_number;
+    struct line li;
+
+    size_t waiting; // dependencies not done yet
+    size_t priority; // number of nodes of the longest chain starting here
+    enum node_state state;
+    pid_t pids[MAX_PIDS];
+    size_t n_pids; // PIDs not reaped yet
+    pid_t last_pid;
+    int status;
+};
+
+static const struct node *sorted_nodes; // nodes the sorted indexes refer to, for qsort()
+
+/**
+ * Compare the names of two nodes given by their indexes, for qsort()
+ */
+static int compare_names(const void *a, const void *b) {
+    return strcmp(sorted_nodes[*(const size_t *) a].name, sorted_nodes[*(const size_t *) b].name);
+}
+
+/**
+ * Compare a name to the name of a node given by its index, for bsearch()
+ */
+static int compare_name(const void *name, const void *b) {
+    return strcmp(name, sorted_nodes[*(const size_t *) b].name);
+}
+
+/**
+ * Free the nodes of a graph
+ * @param nodes The nodes
+ * @param n_nodes The number of nodes
+ */
+static void free_nodes(struct node *nodes, size_t n_nodes) {
+    for (size_t i = 0; i < n_nodes; ++i) {
+        for (size_t j = 0; j < nodes[i].n_deps; ++j) free(nodes[i].deps[j]);
+        free(nodes[i].deps);
+        free(nodes[i].dependents);
+        free(nodes[i].name);
+        line_reset(&nodes[i].li);
+    }
+    free(nodes);
+}
+
+/**
+ * Fill a node from a line of a DAG file "NAME [DEPENDENCY...]: COMMAND LINE"
+ * @param node The node to fill, zeroed
+ * @param buf The line, modified
+ * @param path The path of the file, for the errors
+ * @param line_number The number of the line, for the errors
+ * @return 0 on success, -1 if the line isn't valid
+ */
+static int parse_node(struct node *node, char *buf, const char *path, size_t line_number) {
+    node->line_number = line_number;
+    line_init(&node->li);
+
+    char *colon = strchr(buf, ':');
+    if (colon == NULL) {
+        fprintf(stderr, "%s:%zu: Expected \"NAME [DEPENDENCY...]: COMMAND\"\n", path, line_number);
+        return -1;
+    }
+    *colon = '\0';
+
+    size_t cap = 0;
+    for (char *save, *word = strtok_r(buf, " \t", &save); word != NULL; word = strtok_r(NULL, " \t", &save)) {
+        if (node->name == NULL) {
+            if ((node->name = strdup(word)) == NULL) goto nomem;
+            continue;
+        }
+        if (node->n_deps == cap) {
+            cap = cap ? cap * 2 : 4;
+            char **more = realloc(node->deps, cap * sizeof(char *));
+            if (more == NULL) goto nomem;
+            node->deps = more;
+        }
+        if ((node->deps[node->n_deps] = strdup(word)) == NULL) goto nomem;
+        ++node->n_deps;
+    }
+    if (node->name == NULL) {
+        fprintf(stderr, "%s:%zu: The node has no name\n", path, line_number);
+        return -1;
+    }
+
+    struct line_ctx ctx;
+    line_ctx_init(&ctx);
+    if (line_parse_r(&node->li, colon + 1, &ctx)) {
+        fprintf(stderr, "%s:%zu:%zu: %s\n", path, line_number, colon + 1 - buf + ctx.offset + 1, ctx.message);
+        return -1;
+    }
+    if (node->li.n_cmds == 0 || node->li.background) {
+        fprintf(stderr, "%s:%zu: A node needs a command in the foreground\n", path, line_number);
+        return -1;
+    }
+    return 0;
+
+nomem:
+    fprintf(stderr, "Memory allocation failure\n");
+    return -1;
+}
+
+/**
+ * Read the nodes of a DAG file
+ * @param path The path of the file
+ * @param nodes_out Retrieves the nodes, NULL if the file has none
+ * @param n_nodes Retrieves the number of nodes
+ * @return 0 on success, -1 if an error occured
+ */
+static int read_nodes(const char *path, struct node **nodes_out, size_t *n_nodes) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("Failed to open the DAG file");
+        return -1;
+    }
+
+    struct node *nodes = NULL;
+    size_t cap = 0;
+    *n_nodes = 0;
+
+    char *buf = NULL;
+    size_t buf_cap = 0;
+    ssize_t len;
+    size_t line_number = 0;
+    bool error = false;
+    while (!error && (len = getline(&buf, &buf_cap, file)) != -1) {
+        ++line_number;
+        if (len > 0 && buf[len - 1] == '\n') buf[--len] = '\0';
+
+        // Skip empty lines and comments
+        size_t i = 0;
+        while (buf[i] == ' ' || buf[i] == '\t') ++i;
+        if (buf[i] == '\0' || buf[i] == '#') continue;
+
+        if (*n_nodes == cap) {
+            cap = cap ? cap * 2 : 64;
+            struct node *more = realloc(nodes, cap * sizeof(struct node));
+            if (more == NULL) {
+                fprintf(stderr, "Memory allocation failure\n");
+                error = true;
+                break;
+            }
+            nodes = more;
+        }
+        memset(&nodes[*n_nodes], 0, sizeof(struct node));
+        error = parse_node(&nodes[*n_nodes], buf, path, line_number) == -1;
+        ++*n_nodes;
+    }
+
+    free(buf);
+    fclose(file);
+
+    if (error) {
+        free_nodes(nodes, *n_nodes);
+        return -1;
+    }
+    *nodes_out = nodes;
+    return 0;
+}
+
+/**
+ * Link the nodes to their dependencies, and compute their priorities
+ * @param nodes The nodes
+ * @param n_nodes The number of nodes
+ * @param path The path of the file, for the errors
+ * @return 0 on success, -1 if a dependency is unknown or if there is a cycle
+ */
+static int link_nodes(struct node *nodes, size_t n_nodes, const char *path) {
+    size_t *order = malloc(n_nodes * sizeof(size_t) + 1);
+    if (order == NULL) {
+        fprintf(stderr, "Memory allocation failure\n");
+        return -1;
+    }
+
+    // Names are looked up in a sorted index
+    for (size_t i = 0; i < n_nodes; ++i) order[i] = i;
+    sorted_nodes = nodes;
+    qsort(order, n_nodes, sizeof(size_t), compare_names);
+    int err = 0;
+    for (size_t i = 1; i < n_nodes && !err; ++i) {
+        if (strcmp(nodes[order[i - 1]].name, nodes[order[i]].name) != 0) continue;
+        fprintf(stderr, "%s:%zu: Node \"%s\" already defined\n", path, nodes[order[i]].line_number, nodes[order[i]].name);
+        err = -1;
+    }
+
+    for (size_t i = 0; i < n_nodes && !err; ++i) {
+        struct node *node = &nodes[i];
+        node->waiting = node->n_deps;
+        for (size_t j = 0; j < node->n_deps && !err; ++j) {
+            const size_t *dep = bsearch(node->deps[j], order, n_nodes, sizeof(size_t), compare_name);
+            if (dep == NULL) {
+                fprintf(stderr, "%s:%zu: Unknown dependency \"%s\"\n", path, node->line_number, node->deps[j]);
+                err = -1;
+                break;
+            }
+            struct node *d = &nodes[*dep];
+            size_t *more = realloc(d->dependents, (d->n_dependents + 1) * sizeof(size_t));
+            if (more == NULL) {
+                fprintf(stderr, "Memory allocation failure\n");
+                err = -1;
+                break;
+            }
+            d->dependents = more;
+            d->dependents[d->n_dependents++] = i;
+        }
+    }
+
+    // Topological order : a node comes after all its dependencies
+    size_t n_ordered = 0;
+    if (!err) {
+        size_t *missing = malloc(n_nodes * sizeof(size_t) + 1);
+        if (missing == NULL) {
+            fprintf(stderr, "Memory allocation failure\n");
+            err = -1;
+        }
+        for (size_t i = 0; i < n_nodes && !err; ++i) {
+            missing[i] = nodes[i].n_deps;
+            if (missing[i] == 0) order[n_ordered++] = i;
+        }
+        for (size_t k = 0; k < n_ordered && !err; ++k) {
+            const struct node *node = &nodes[order[k]];
+            for (size_t j = 0; j < node->n_dependents; ++j) {
+                if (--missing[node->dependents[j]] == 0) order[n_ordered++] = node->dependents[j];
+            }
+        }
+        for (size_t i = 0; i < n_nodes && !err && n_ordered < n_nodes; ++i) {
+            if (missing[i] == 0) continue;
+            fprintf(stderr, "%s:%zu: Node \"%s\" is part of a dependency cycle\n", path, nodes[i].line_number, nodes[i].name);
+            err = -1;
+        }
+        free(missing);
+    }
+
+    // Longest chain of nodes starting at each node, from the last ones
+    for (size_t k = n_ordered; k > 0 && !err; --k) {
+        struct node *node = &nodes[order[k - 1]];
+        node->priority = 1;
+        for (size_t j = 0; j < node->n_dependents; ++j) {
+            size_t p = nodes[node->dependents[j]].priority + 1;
+            if (p > node->priority) node->priority = p;
+        }
+    }
+
+    free(order);
+    return err;
+}
+
+/**
+ * Tells if a ready node has to be launched before another one
+ */
+static bool goes_first(const struct node *nodes, size_t a, size_t b) {
+    if (nodes[a].priority != nodes[b].priority) return nodes[a].priority > nodes[b].priority;
+    return a < b;
+}
+
+/**
+ * Add a node to the heap of the ready nodes
+ * @param nodes The nodes
+ * @param heap The heap
+ * @param n_heap The number of nodes in the heap
+ * @param node The index of the node to add
+ */
+static void heap_push(struct node *nodes, size_t *heap, size_t *n_heap, size_t node) {
+    nodes[node].state = NODE_READY;
+    size_t i = (*n_heap)++;
+    while (i > 0 && goes_first(nodes, node, heap[(i - 1) / 2])) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = node;
+}
+
+/**
+ * Remove the first node of the heap of the ready nodes
+ * @param nodes The nodes
+ * @param heap The heap, not empty
+ * @param n_heap The number of nodes in the heap
+ * @return The index of the node with the longest chain
+ */
+static size_t heap_pop(const struct node *nodes, size_t *heap, size_t *n_heap) {
+    size_t first = heap[0];
+    size_t last = heap[--*n_heap];
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= *n_heap) break;
+        if (child + 1 < *n_heap && goes_first(nodes, heap[child + 1], heap[child])) ++child;
+        if (!goes_first(nodes, heap[child], last)) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return first;
+}
+
+/**
+ * Mark the nodes depending on a failed node as skipped
+ * @param nodes The nodes
+ * @param node The index of the failed node
+ * @return The number of nodes skipped
+ */
+static size_t skip_dependents(struct node *nodes, size_t node) {
+    size_t skipped = 0;
+    for (size_t j = 0; j < nodes[node].n_dependents; ++j) {
+        struct node *d = &nodes[nodes[node].dependents[j]];
+        if (d->state != NODE_WAITING) continue;
+        d->state = NODE_SKIPPED;
+        fprintf(stderr, "dag: %s skipped, %s failed\n", d->name, nodes[node].name);
+        skipped += 1 + skip_dependents(nodes, nodes[node].dependents[j]);
+    }
+    return skipped;
+}
+
+/**
+ * Record the end of a node, and make its dependents ready
+ * @param nodes The nodes
+ * @param heap The heap of the ready nodes
+ * @param n_heap The number of nodes in the heap
+ * @param node The index of the node
+ * @param ok true if the node succeeded
+ * @return The number of nodes skipped because of it
+ */
+static size_t finish_node(struct node *nodes, size_t *heap, size_t *n_heap, size_t node, bool ok) {
+    struct node *n = &nodes[node];
+    n->state = ok ? NODE_DONE : NODE_FAILED;
+    if (!ok) {
+        if (WIFSIGNALED(n->status)) fprintf(stderr, "dag: %s failed with signal %i\n", n->name, WTERMSIG(n->status));
+        else fprintf(stderr, "dag: %s failed with exit status %i\n", n->name, WEXITSTATUS(n->status));
+        return skip_dependents(nodes, node);
+    }
+    for (size_t j = 0; j < n->n_dependents; ++j) {
+        size_t d = n->dependents[j];
+        if (--nodes[d].waiting == 0 && nodes[d].state == NODE_WAITING) heap_push(nodes, heap, n_heap, d);
+    }
+    return 0;
+}
+
+/**
+ * Wait for a process of a running node to end, SIGCHLD must be blocked
+ *
+ * Only the processes of the nodes are reaped : the other children of the shell are left to
+ * the SIGCHLD handler
+ *
+ * @param nodes The nodes
+ * @param n_nodes The number of nodes
+ * @param stat Retrieves how the process ended
+ * @return The PID of the process, -1 if an error occured
+ */
+static pid_t wait_node(const struct node *nodes, size_t n_nodes, int *stat) {
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    for (;;) {
+        for (size_t i = 0; i < n_nodes; ++i) {
+            if (nodes[i].state != NODE_RUNNING) continue;
+            for (size_t j = 0; j < nodes[i].n_pids; ++j) {
+                pid_t pid = waitpid(nodes[i].pids[j], stat, WNOHANG);
+                if (pid != 0) return pid;
+            }
+        }
+
+        // A child ending meanwhile leaves SIGCHLD pending, so it isn't missed
+        if (sigwaitinfo(&chld, NULL) == -1 && errno != EINTR) return -1;
+    }
+}
+
+int dag(size_t argc, char *const *argv) {
+    size_t max_running = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *path = NULL;
+    bool bad_usage = false;
+    for (size_t i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) max_running = strtoul(argv[++i], NULL, 10);
+        else if (path == NULL) path = argv[i];
+        else bad_usage = true;
+    }
+    if (bad_usage || path == NULL || max_running == 0) {
+        fprintf(stderr, "Usage: dag [-j N] FILE\n");
+        return 1;
+    }
+
+    // A file without nodes is an empty graph, which is done at once
+    size_t n_nodes;
+    struct node *nodes;
+    if (read_nodes(path, &nodes, &n_nodes) == -1) return 1;
+    size_t *heap = malloc(n_nodes * sizeof(size_t) + 1);
+    if (heap == NULL || link_nodes(nodes, n_nodes, path) == -1) {
+        if (heap == NULL) fprintf(stderr, "Memory allocation failure\n");
+        free(heap);
+        free_nodes(nodes, n_nodes);
+        return 1;
+    }
+
+    size_t n_heap = 0;
+    for (size_t i = 0; i < n_nodes; ++i) {
+        if (nodes[i].waiting == 0) heap_push(nodes, heap, &n_heap, i);
+    }
+
+    // The nodes are reaped here, not by the SIGCHLD handler
+    sigset_t chld, old;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &old);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t running = 0, done = 0, failed = 0, skipped = 0;
+    while (running > 0 || n_heap > 0) {
+        // Launch the ready nodes with the longest chains first
+        while (running < max_running && n_heap > 0) {
+            size_t i = heap_pop(nodes, heap, &n_heap);
+            struct node *node = &nodes[i];
+            node->state = NODE_RUNNING;
+            int n_pids = launch_line(&node->li, NULL, node->pids);
+            if (n_pids <= 0) {
+                // Only cd, or the launch failed
+                node->status = n_pids == 0 ? 0 : 1 << 8;
+                done += n_pids == 0;
+                failed += n_pids != 0;
+                skipped += finish_node(nodes, heap, &n_heap, i, n_pids == 0);
+                continue;
+            }
+            node->n_pids = n_pids;
+            node->last_pid = node->pids[n_pids - 1];
+            ++running;
+        }
+        if (running == 0) continue;
+
+        int stat;
+        pid_t pid = wait_node(nodes, n_nodes, &stat);
+        if (pid == -1) {
+            if (errno == EINTR) continue;
+            perror("waitpid failed");
+            break;
+        }
+        for (size_t i = 0; i < n_nodes; ++i) {
+            struct node *node = &nodes[i];
+            if (node->state != NODE_RUNNING) continue;
+            size_t j = 0;
+            while (j < node->n_pids && node->pids[j] != pid) ++j;
+            if (j == node->n_pids) continue;
+
+            node->pids[j] = node->pids[--node->n_pids];
+            if (pid == node->last_pid) node->status = stat;
+            if (node->n_pids == 0) {
+                bool ok = WIFEXITED(node->status) && WEXITSTATUS(node->status) == 0;
+                done += ok;
+                failed += !ok;
+                --running;
+                skipped += finish_node(nodes, heap, &n_heap, i, ok);
+            }
+            break;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // Waiting took the SIGCHLD of the other children which ended meanwhile : the handler reaps them
+    raise(SIGCHLD);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+
+    size_t critical = 0;
+    for (size_t i = 0; i < n_nodes; ++i) {
+        if (nodes[i].priority > critical) critical = nodes[i].priority;
+    }
+    double total_ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    fprintf(
+            stderr, "dag: %zu/%zu nodes done, %zu failed, %zu skipped, critical path of %zu nodes, in %.2f s\n",
+            done, n_nodes, failed, skipped, critical, total_ms / 1e3
+    );
+
+    free(heap);
+    free_nodes(nodes, n_nodes);
+    return done == n_nodes ? 0 : 1;
+}
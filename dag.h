@@ -0,0 +1,22 @@
+#ifndef DAG_H
+#define DAG_H
+
+#include <stddef.h>
+
+/**
+ * The dag builtin : dag [-j N] FILE
+ *
+ * Each line of FILE is a node "NAME [DEPENDENCY...]: COMMAND LINE", empty lines and lines
+ * starting with '#' are ignored. A node is launched once all its dependencies succeeded, up to
+ * N command lines at the same time. Among the ready nodes, the one with the longest chain of
+ * nodes depending on it goes first, so that the critical path is never delayed. The nodes
+ * depending on a failed node are skipped
+ *
+ * @param argc number of arguments, including the name of the builtin
+ * @param argv arguments of the builtin
+ *
+ * @return 0 if every node succeeded, 1 otherwise
+ */
+int dag(size_t argc, char *const *argv);
+
+#endif
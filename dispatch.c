@@ -0,0 +1,425 @@
+#include "dispatch.h"
+#include "cmdline.h"
+#include "server.h"
+#include "zygote.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define MAX_WORKERS 64
+#define BUFLEN 512 // same limit as the command lines read by the shell
+
+struct worker {
+    pid_t pid;
+    int sock; // -1 once the worker is gone
+
+    bool busy;
+    size_t job; // index of the running job
+    struct timespec start; // when the running job was sent
+
+    size_t done;
+    size_t requeued; // jobs given back to the queue when the worker was lost
+    size_t failed;
+    double *latencies; // in milliseconds, one per job done
+};
+
+/**
+ * Compare two latencies, for qsort()
+ */
+static int compare_latencies(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Elapsed time between two instants, in milliseconds
+ */
+static double elapsed_ms(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1e3 + (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+/**
+ * Read all the command lines of a job file, and check that they are valid
+ * @param path The path of the job file
+ * @param n_jobs Retrieves the number of command lines
+ * @return The command lines, each one ended by '\n', NULL if an error occured
+ */
+static char **read_jobs(const char *path, size_t *n_jobs) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("Failed to open the job file");
+        return NULL;
+    }
+
+    char **jobs = NULL;
+    size_t cap = 0;
+    *n_jobs = 0;
+
+    struct line li;
+    struct line_ctx ctx;
+    line_init(&li);
+    line_ctx_init(&ctx);
+
+    char *buf = NULL;
+    size_t buf_cap = 0;
+    ssize_t len;
+    size_t line_number = 0;
+    bool error = false;
+    while (!error && (len = getline(&buf, &buf_cap, file)) != -1) {
+        ++line_number;
+        if (len > 0 && buf[len - 1] == '\n') buf[--len] = '\0';
+
+        // Skip empty lines
+        size_t i = 0;
+        while (buf[i] == ' ' || buf[i] == '\t') ++i;
+        if (buf[i] == '\0') continue;
+
+        if (len >= BUFLEN - 1) {
+            fprintf(stderr, "%s:%zu: The command line is too long\n", path, line_number);
+            error = true;
+            break;
+        }
+
+        char *job = malloc(len + 2);
+        if (job == NULL) {
+            fprintf(stderr, "Memory allocation failure\n");
+            error = true;
+            break;
+        }
+        memcpy(job, buf, len);
+        job[len] = '\n';
+        job[len + 1] = '\0';
+
+        if (line_parse_r(&li, job, &ctx)) {
+            fprintf(stderr, "%s:%zu:%zu: %s\n", path, line_number, ctx.offset + 1, ctx.message);
+            error = true;
+        }
+        line_reset(&li);
+
+        if (*n_jobs == cap) {
+            cap = cap ? cap * 2 : 64;
+            char **more = realloc(jobs, cap * sizeof(char *));
+            if (more == NULL) {
+                fprintf(stderr, "Memory allocation failure\n");
+                error = true;
+                free(job);
+                break;
+            }
+            jobs = more;
+        }
+        jobs[(*n_jobs)++] = job;
+    }
+
+    free(buf);
+    fclose(file);
+
+    if (error) {
+        for (size_t i = 0; i < *n_jobs; ++i) free(jobs[i]);
+        free(jobs);
+        return NULL;
+    }
+    return jobs;
+}
+
+/**
+ * Start a worker shell serving a Unix socket in a temporary directory, and connect to it
+ * @param workers All the workers, the ones before "self" are already started
+ * @param self The index of the worker to start
+ * @param dir The temporary directory for the socket
+ * @return 0 on success, -1 on failure
+ */
+static int start_worker(struct worker *workers, size_t self, const char *dir) {
+    struct worker *w = &workers[self];
+
+    char path[BUFLEN];
+    snprintf(path, sizeof(path), "%s/worker-%zu.sock", dir, self);
+    int listen_fd = server_listen(path);
+    if (listen_fd == -1) return -1;
+
+    w->pid = fork();
+    if (w->pid == -1) {
+        perror("fork failed");
+        close(listen_fd);
+        unlink(path);
+        return -1;
+    }
+
+    if (w->pid == 0) {
+        zygote_shutdown();
+        for (size_t i = 0; i < self; ++i) close(workers[i].sock);
+        _exit(serve_socket(listen_fd, 1) ? 1 : 0);
+    }
+    close(listen_fd);
+
+    // The socket is already listening, connecting does not wait for the worker
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strcpy(addr.sun_path, path);
+    w->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (w->sock == -1 || connect(w->sock, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror("Failed to connect to a worker");
+        if (w->sock != -1) close(w->sock);
+        w->sock = -1;
+        kill(w->pid, SIGTERM);
+        waitpid(w->pid, NULL, 0);
+        unlink(path);
+        return -1;
+    }
+    unlink(path);
+    return 0;
+}
+
+/**
+ * The queue of the jobs not sent yet, shared by all the workers
+ */
+struct job_queue {
+    size_t next; // next job of the file
+    size_t n_jobs;
+    size_t *retry; // jobs of the lost workers, taken before the next ones of the file
+    size_t n_retry;
+};
+
+/**
+ * Take the next job of the queue
+ * @return true if a job was found
+ */
+static bool next_job(struct job_queue *queue, size_t *job) {
+    if (queue->n_retry > 0) {
+        *job = queue->retry[--queue->n_retry];
+        return true;
+    }
+    if (queue->next == queue->n_jobs) return false;
+    *job = queue->next++;
+    return true;
+}
+
+/**
+ * Forget a worker which is gone, and give its running job back to the queue
+ */
+static void lose_worker(struct worker *w, size_t index, struct job_queue *queue) {
+    fprintf(stderr, "Worker %zu is gone\n", index);
+    close(w->sock);
+    w->sock = -1;
+    if (w->busy) {
+        queue->retry[queue->n_retry++] = w->job;
+        ++w->requeued;
+        w->busy = false;
+    }
+}
+
+/**
+ * Send a job to a worker
+ * @return 0 on success, -1 on failure
+ */
+static int send_job(struct worker *w, size_t index, const char *job) {
+    struct fish_request req = { .len = strlen(job) - 1, .flags = 0 }; // without the '\n'
+    char buf[sizeof(req) + BUFLEN];
+    memcpy(buf, &req, sizeof(req));
+    memcpy(buf + sizeof(req), job, req.len);
+
+    size_t size = sizeof(req) + req.len;
+    size_t sent = 0;
+    // The job is given back to the queue if it can't be sent
+    clock_gettime(CLOCK_MONOTONIC, &w->start);
+    w->job = index;
+    w->busy = true;
+    while (sent < size) {
+        ssize_t n = send(w->sock, buf + sent, size - sent, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) return -1;
+        sent += n;
+    }
+    return 0;
+}
+
+/**
+ * Read exactly "len" bytes from a socket
+ * @return 0 on success, -1 on failure or if the socket was closed
+ */
+static int recv_all(int sock, void *buf, size_t len) {
+    size_t received = 0;
+    while (received < len) {
+        ssize_t n = recv(sock, (char *) buf + received, len - received, 0);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        received += n;
+    }
+    return 0;
+}
+
+/**
+ * Read a frame sent by a worker, and account the job once its status is received
+ * @return 0 on success, -1 if the worker is gone
+ */
+static int handle_frame(struct worker *w) {
+    struct fish_frame frame;
+    if (recv_all(w->sock, &frame, sizeof(frame))) return -1;
+
+    char buf[BUFLEN];
+    struct fish_status status = { .parse_error = 1 };
+    while (frame.len > 0) {
+        size_t len = frame.len < sizeof(buf) ? frame.len : sizeof(buf);
+        if (recv_all(w->sock, buf, len)) return -1;
+        if (frame.type == FISH_FRAME_STATUS && len == sizeof(status)) memcpy(&status, buf, len);
+        frame.len -= len;
+    }
+    if (frame.type != FISH_FRAME_STATUS) return 0;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    w->latencies[w->done++] = elapsed_ms(&w->start, &now);
+    if (status.parse_error || !WIFEXITED(status.status) || WEXITSTATUS(status.status) != 0) {
+        ++w->failed;
+    }
+    w->busy = false;
+    return 0;
+}
+
+/**
+ * Print the statistics of every worker
+ */
+static void report(struct worker *workers, size_t n_workers, size_t n_jobs, double total_ms) {
+    size_t done = 0;
+    size_t failed = 0;
+    for (size_t i = 0; i < n_workers; ++i) {
+        struct worker *w = &workers[i];
+        done += w->done;
+        failed += w->failed;
+
+        fprintf(stderr, "Worker %zu: %zu jobs, %zu failed", i, w->done, w->failed);
+        if (w->requeued > 0) fprintf(stderr, ", %zu requeued", w->requeued);
+        if (w->done == 0) {
+            fprintf(stderr, "\n");
+            continue;
+        }
+
+        qsort(w->latencies, w->done, sizeof(double), compare_latencies);
+        fprintf(
+                stderr, ", %.1f jobs/s, latency p50 %.2f ms p99 %.2f ms max %.2f ms\n",
+                w->done * 1e3 / total_ms,
+                w->latencies[(w->done - 1) / 2],
+                w->latencies[(w->done - 1) * 99 / 100],
+                w->latencies[w->done - 1]
+        );
+    }
+    fprintf(
+            stderr, "Total: %zu/%zu jobs, %zu failed, in %.2f s, %.1f jobs/s\n",
+            done, n_jobs, failed, total_ms / 1e3, done * 1e3 / total_ms
+    );
+}
+
+int dispatch(size_t argc, char *const *argv) {
+    size_t n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *path = NULL;
+    bool bad_usage = false;
+    for (size_t i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) n_workers = strtoul(argv[++i], NULL, 10);
+        else if (path == NULL) path = argv[i];
+        else bad_usage = true;
+    }
+    if (bad_usage || path == NULL || n_workers == 0) {
+        fprintf(stderr, "Usage: dispatch [-w K] FILE\n");
+        return 1;
+    }
+    if (n_workers > MAX_WORKERS) {
+        fprintf(stderr, "Too much workers. Max: %i\n", MAX_WORKERS);
+        return 1;
+    }
+
+    size_t n_jobs;
+    char **jobs = read_jobs(path, &n_jobs);
+    if (jobs == NULL) return 1;
+    if (n_workers > n_jobs) n_workers = n_jobs > 0 ? n_jobs : 1;
+
+    // The workers are reaped here, not by the SIGCHLD handler
+    sigset_t chld, old;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &old);
+
+    // Each worker gives back at most one job
+    struct job_queue queue = { .next = 0, .n_jobs = n_jobs, .n_retry = 0 };
+    queue.retry = malloc((n_workers + 1) * sizeof(size_t));
+
+    char dir[] = "/tmp/fish-dispatch-XXXXXX";
+    struct worker workers[MAX_WORKERS];
+    memset(workers, 0, sizeof(workers));
+    size_t n_started = 0;
+    if (queue.retry == NULL) fprintf(stderr, "Memory allocation failure\n");
+    else if (mkdtemp(dir) == NULL) perror("Failed to create a temporary directory");
+    else {
+        for (; n_started < n_workers; ++n_started) {
+            struct worker *w = &workers[n_started];
+            w->latencies = malloc((n_jobs + 1) * sizeof(double));
+            if (w->latencies == NULL || start_worker(workers, n_started, dir)) break;
+        }
+        rmdir(dir);
+    }
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    for (;;) {
+        // Feed the idle workers from the queue
+        size_t job;
+        for (size_t i = 0; i < n_started; ++i) {
+            struct worker *w = &workers[i];
+            if (w->sock == -1 || w->busy || !next_job(&queue, &job)) continue;
+            if (send_job(w, job, jobs[job])) {
+                lose_worker(w, i, &queue);
+                i = (size_t) -1; // the job goes to another worker
+            }
+        }
+
+        struct pollfd fds[MAX_WORKERS];
+        size_t n_fds = 0;
+        for (size_t i = 0; i < n_started; ++i) {
+            if (workers[i].busy) fds[n_fds++] = (struct pollfd) { .fd = workers[i].sock, .events = POLLIN };
+        }
+        if (n_fds == 0) break;
+
+        if (poll(fds, n_fds, -1) == -1) {
+            if (errno == EINTR) continue;
+            perror("poll failed");
+            break;
+        }
+
+        for (size_t i = 0; i < n_started; ++i) {
+            struct worker *w = &workers[i];
+            for (size_t j = 0; j < n_fds; ++j) {
+                if (fds[j].fd != w->sock || fds[j].revents == 0) continue;
+                if (handle_frame(w)) lose_worker(w, i, &queue);
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    report(workers, n_started, n_jobs, elapsed_ms(&begin, &end));
+
+    // The jobs left in the queue were not run, every worker is gone
+    bool success = n_started > 0 && queue.n_retry == 0 && queue.next == n_jobs;
+    for (size_t i = 0; i < n_started; ++i) {
+        struct worker *w = &workers[i];
+        if (w->failed > 0) success = false;
+        if (w->sock != -1) close(w->sock);
+        kill(w->pid, SIGTERM);
+        waitpid(w->pid, NULL, 0);
+    }
+    for (size_t i = 0; i < n_workers; ++i) free(workers[i].latencies);
+    for (size_t i = 0; i < n_jobs; ++i) free(jobs[i]);
+    free(jobs);
+    free(queue.retry);
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return success ? 0 : 1;
+}
@@ -0,0 +1,22 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include <stddef.h>
+
+/**
+ * The dispatch builtin : dispatch [-w K] FILE
+ *
+ * Runs every command line of FILE on K worker shells, each one running a server on a local
+ * Unix socket. The lines stay in a central queue, and each worker is sent the next one as
+ * soon as it is idle. The line of a worker which is gone goes back to the queue and is run
+ * by another worker. Prints the throughput and the latency of each worker once every line
+ * has been executed
+ *
+ * @param argc number of arguments, including the name of the builtin
+ * @param argv arguments of the builtin
+ *
+ * @return 0 if every command line succeeded, 1 otherwise
+ */
+int dispatch(size_t argc, char *const *argv);
+
+#endif
@@ -0,0 +1,580 @@
+#define _GNU_SOURCE // pipe2()
+
+#include "exec.h"
+#include "tee.h"
+#include "textutil.h"
+#include "zygote.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <sys/wait.h>
+
+#define BUFLEN 512
+#define MAX_REDIR_FD 9 // the descriptors of the redirections are digits
+
+/**
+ * Opens the files a command has to use as input and output
+ * @param line The command line the command is from
+ * @param commandIndex The index of the command in the list of commands
+ * @param pipeIn The fid of the pipe to use as input. -1 if no pipe has to be used
+ * @param input Retrieves the fid to use as input, -1 if the input is not redirected
+ * @param output Retrieves the fid to use as output, -1 if the output is not redirected to a file
+ */
+static void open_redirections(const struct line *line, size_t commandIndex, int pipeIn, int *input, int *output) {
+    *input = -1;
+    *output = -1;
+
+    // Redirecting input
+    if (pipeIn > 0) *input = pipeIn;
+    else if ((commandIndex == 0 && line->file_input != NULL) || line->background) {
+        *input = open(
+                line->file_input != NULL ? line->file_input : "/dev/null",
+                O_RDONLY | O_CLOEXEC
+        );
+        if (*input == -1) perror("Input redirection failed");
+    }
+
+    // Redirecting output
+    if (commandIndex == line->n_cmds - 1 && line->file_output != NULL) {
+        *output = open(
+                line->file_output,
+                O_WRONLY | O_CREAT | O_CLOEXEC | (line->file_output_append ? O_APPEND : O_TRUNC),
+                0666
+        );
+        if (*output == -1) perror("Output redirection failed");
+    }
+}
+
+/**
+ * Tells if a redirection is one more destination of the standard output
+ * @param r The redirection
+ * @return true for REDIR_TEE and REDIR_TEE_APPEND
+ */
+static bool is_tee(const struct redir *r) {
+    return r->kind == REDIR_TEE || r->kind == REDIR_TEE_APPEND;
+}
+
+/**
+ * Applies the numbered redirections of a command to the current process
+ * @param line The command line the command is from
+ * @param commandIndex The index of the command in the list of commands
+ * @return 0 on success, -1 if a redirection failed
+ */
+static int apply_redirs(const struct line *line, size_t commandIndex) {
+    for (size_t i = 0; i < line->n_redirs; ++i) {
+        const struct redir *r = &line->redirs[i];
+        if (r->cmd != commandIndex || is_tee(r)) continue;
+
+        if (r->kind == REDIR_CLOSE) {
+            close(r->fd);
+            continue;
+        }
+
+        int fd = r->target;
+        if (r->kind != REDIR_DUP) {
+            int flags = r->kind == REDIR_INPUT ? O_RDONLY
+                        : O_WRONLY | O_CREAT | (r->kind == REDIR_APPEND ? O_APPEND : O_TRUNC);
+            fd = open(r->file, flags, 0666);
+            if (fd == -1) {
+                perror("Redirection failed");
+                return -1;
+            }
+        }
+
+        if (fd != r->fd) {
+            int err = dup2(fd, r->fd);
+            if (r->kind != REDIR_DUP) close(fd);
+            if (err == -1) {
+                perror("Redirection failed");
+                return -1;
+            }
+        }
+        else if (r->kind == REDIR_DUP && fcntl(fd, F_GETFD) == -1) {
+            perror("Redirection failed");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Tells if a command has numbered redirections, or several destinations for its output
+ * @param line The command line the command is from
+ * @param commandIndex The index of the command in the list of commands
+ * @param tee true to look for the destinations of the output, false for the numbered redirections
+ * @return true if the command has at least one redirection of this type
+ */
+static bool has_redirs(const struct line *line, size_t commandIndex, bool tee) {
+    for (size_t i = 0; i < line->n_redirs; ++i) {
+        if (line->redirs[i].cmd == commandIndex && is_tee(&line->redirs[i]) == tee) return true;
+    }
+    return false;
+}
+
+/**
+ * Starts a process copying the output of a command to all its destinations
+ * @param line The command line the command is from
+ * @param commandIndex The index of the command in the list of commands
+ * @param primary The fid of the first destination : the pipe, the output file or the output of the shell
+ * @param closed fids the process must close, -1 for none
+ * @param pid Retrieves the PID of the process, -1 if an error occured
+ * @return The fid the command has to write its output to, -1 if an error occured
+ */
+static int start_tee(const struct line *line, size_t commandIndex, int primary, const int closed[2], pid_t *pid) {
+    int pipes[2];
+    *pid = -1;
+    if (pipe2(pipes, O_CLOEXEC) == -1) {
+        perror("pipe failed");
+        return -1;
+    }
+
+    *pid = fork();
+    if (*pid == -1) {
+        perror("fork failed");
+        close(pipes[0]);
+        close(pipes[1]);
+        return -1;
+    }
+    if (*pid > 0) {
+        close(pipes[0]);
+        return pipes[1];
+    }
+
+    // The shell blocks SIGCHLD while it launches commands
+    sigset_t empty;
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+
+    // A destination whose reader is gone is dropped instead of killing the copy
+    signal(SIGPIPE, SIG_IGN);
+    if (line->background) signal(SIGINT, SIG_IGN);
+
+    // The command must be the only writer, and the next one must see the end of its pipe
+    close(pipes[1]);
+    for (int i = 0; i < 2; ++i) {
+        if (closed[i] != -1) close(closed[i]);
+    }
+
+    int outs[MAX_TEE_OUTS];
+    size_t n_outs = 0;
+    outs[n_outs++] = primary;
+    for (size_t i = 0; i < line->n_redirs && n_outs < MAX_TEE_OUTS; ++i) {
+        const struct redir *r = &line->redirs[i];
+        if (r->cmd != commandIndex || !is_tee(r)) continue;
+        int fd = open(r->file, O_WRONLY | O_CREAT | (r->kind == REDIR_TEE_APPEND ? O_APPEND : O_TRUNC), 0666);
+        if (fd == -1) perror("Output redirection failed");
+        else outs[n_outs++] = fd;
+    }
+
+    _exit(tee_run(pipes[0], outs, n_outs) == -1 ? 1 : 0);
+}
+
+/**
+ * Executes a command, without waiting for it
+ * @param line The command line the command is from
+ * @param command The command to execute
+ * @param commandIndex The index of the command in the list of commands
+ * @param pipeIn The fid of the pipe to use. -1 if no pipe has to be used
+ * @param io The default streams of the line
+ * @param pid Retrieves the PID of the process, -1 if an error occured
+ * @param teePid Retrieves the PID of the process copying the output, -1 if there is none
+ * @return The fid of the pipe opened for the command, -1 if an error occured
+ */
+static int execute_command(
+        const struct line *line,
+        const struct cmd *command,
+        size_t commandIndex,
+        int pipeIn,
+        const struct exec_io *io,
+        pid_t *pid,
+        pid_t *teePid
+) {
+    // Opening pipe if needed
+    int pipes[2];
+    if (commandIndex != line->n_cmds - 1) pipe2(pipes, O_CLOEXEC);
+
+    int input, output;
+    open_redirections(line, commandIndex, pipeIn, &input, &output);
+    if (commandIndex != line->n_cmds - 1) output = pipes[1];
+
+    // Streams kept from the shell
+    int defaultIn = commandIndex == 0 && io->in != -1 ? io->in : STDIN_FILENO;
+    int defaultOut = commandIndex == line->n_cmds - 1 && io->out != -1 ? io->out : STDOUT_FILENO;
+    int defaultErr = io->err != -1 ? io->err : STDERR_FILENO;
+
+    *teePid = -1;
+
+    // The output goes to a copying process when there are several destinations
+    if (has_redirs(line, commandIndex, true)) {
+        const int closed[2] = { input, commandIndex != line->n_cmds - 1 ? pipes[0] : -1 };
+        int teeIn = start_tee(line, commandIndex, output != -1 ? output : defaultOut, closed, teePid);
+        if (teeIn == -1) {
+            *pid = -1;
+            if (input != -1) close(input);
+            if (output != -1) close(output);
+            if (commandIndex != line->n_cmds - 1) close(pipes[0]);
+            return -1;
+        }
+        if (output != -1) close(output);
+        output = teeIn;
+    }
+
+    // Handing the command to a pre-forked helper, forking if none is available.
+    // Helpers only get the standard streams
+    *pid = -1;
+    if (!has_redirs(line, commandIndex, false)) {
+        *pid = zygote_spawn(
+                command->args,
+                input != -1 ? input : defaultIn,
+                output != -1 ? output : defaultOut,
+                defaultErr,
+                line->background
+        );
+    }
+    if (*pid == -1) *pid = fork();
+    if (*pid == -1) {
+        perror("fork failed");
+        return -1;
+    }
+
+
+    if (*pid == 0) {
+        // The shell blocks SIGCHLD while it launches commands
+        sigset_t empty;
+        sigemptyset(&empty);
+        sigprocmask(SIG_SETMASK, &empty, NULL);
+
+        if (line->background) {
+            // Installing SIGINT signal handler
+            struct sigaction action;
+            action.sa_flags = 0;
+            sigemptyset(&action.sa_mask);
+            action.sa_handler = SIG_IGN;
+            sigaction(SIGCHLD, &action, NULL);
+        }
+
+        // Redirecting input
+        if (input == -1) input = defaultIn;
+        if (input != STDIN_FILENO) {
+            dup2(input, STDIN_FILENO);
+            close(input);
+        }
+
+        // Redirecting output
+        if (output == -1) output = defaultOut;
+        if (output != STDOUT_FILENO) {
+            dup2(output, STDOUT_FILENO);
+            close(output);
+        }
+        if (defaultErr != STDERR_FILENO) dup2(defaultErr, STDERR_FILENO);
+        if (apply_redirs(line, commandIndex) == -1) exit(1);
+
+        // Execute the command
+        execvp(command->args[0], command->args);
+        perror("execvp failed");
+        exit(1);
+    }
+
+    if (input != -1) close(input);
+    if (output != -1) close(output);
+
+    if (commandIndex != line->n_cmds - 1) return pipes[0];
+    else return -1;
+}
+
+void cd(char *path) {
+    char *newPath = NULL;
+
+    // Get the home path
+    if (strcmp(path, "~") == 0) {
+        newPath = getenv("HOME");
+        if (newPath == NULL) {
+            fprintf(stderr, "Error while reading the HOME environment variable");
+            return;
+        }
+    }
+    if (strlen(path) >= 2 && path[0] == '~' && path[1] != '/') {
+        char* user = calloc(BUFLEN, sizeof(char));
+        size_t index = 0;
+        path++;
+        while (*path != '/' && *path != '\0') {
+            user[index] = *path;
+            index++;
+            path++;
+        }
+        struct passwd *pw = getpwnam(user);
+        if (pw == NULL) {
+            fprintf(stderr, "This user does not exist\n");
+            return;
+        }
+        newPath = pw->pw_dir;
+    }
+
+    // Set the new current working directory
+    int status = chdir(newPath != NULL ? newPath : path);
+    if (status == -1) perror("Failed to set working directory");
+    else if (status != 0) {
+        fprintf(stderr, "Failed to set working directory with error %d", status);
+    }
+}
+
+int exec_command(const struct line *line, char *const *argv) {
+    int input, output;
+    open_redirections(line, 0, -1, &input, &output);
+    if ((line->file_input != NULL && input == -1) || (line->file_output != NULL && output == -1)) {
+        if (input != -1) close(input);
+        if (output != -1) close(output);
+        return -1;
+    }
+
+    // Several destinations for the output : it goes to a copying process
+    pid_t teePid = -1;
+    if (has_redirs(line, 0, true)) {
+        const int closed[2] = { input, -1 };
+        int teeIn = start_tee(line, 0, output != -1 ? output : STDOUT_FILENO, closed, &teePid);
+        if (output != -1) close(output);
+        output = teeIn;
+        if (teeIn == -1) {
+            if (input != -1) close(input);
+            return -1;
+        }
+    }
+
+    // Keep the descriptors of the shell to restore them if something fails.
+    // Descriptors which weren't open are closed again
+    int saved[MAX_REDIR_FD + 1];
+    bool affected[MAX_REDIR_FD + 1] = { false };
+    affected[STDIN_FILENO] = input != -1;
+    affected[STDOUT_FILENO] = output != -1;
+    for (size_t i = 0; i < line->n_redirs; ++i) affected[line->redirs[i].fd] = true;
+    for (int fd = 0; fd <= MAX_REDIR_FD; ++fd) {
+        saved[fd] = affected[fd] ? fcntl(fd, F_DUPFD_CLOEXEC, MAX_REDIR_FD + 1) : -1;
+    }
+
+    fflush(stdout);
+    if (input != -1) {
+        dup2(input, STDIN_FILENO);
+        close(input);
+    }
+    if (output != -1) {
+        dup2(output, STDOUT_FILENO);
+        close(output);
+    }
+
+    if (apply_redirs(line, 0) == 0) {
+        if (argv[0] == NULL) {
+            for (int fd = 0; fd <= MAX_REDIR_FD; ++fd) {
+                if (saved[fd] != -1) close(saved[fd]);
+            }
+            return 0;
+        }
+
+        // The helpers would stay zombies of the command
+        zygote_shutdown();
+
+        execvp(argv[0], argv);
+        perror("exec failed");
+    }
+
+    for (int fd = 0; fd <= MAX_REDIR_FD; ++fd) {
+        if (!affected[fd]) continue;
+        if (saved[fd] != -1) {
+            dup2(saved[fd], fd);
+            close(saved[fd]);
+        }
+        else close(fd);
+    }
+    // The copying process ends with the end of its pipe
+    if (teePid != -1) waitpid(teePid, NULL, 0);
+    return -1;
+}
+
+/**
+ * Tells if a command of a line can run as a text builtin in a thread of the shell
+ * @param line The line the command is from
+ * @param commandIndex The index of the command in the list of commands
+ * @param tc Retrieves the builtin if not NULL
+ * @return true if the command is a text builtin without redirections
+ */
+static bool is_text_builtin(const struct line *line, size_t commandIndex, struct text_cmd *tc) {
+    if (has_redirs(line, commandIndex, false) || has_redirs(line, commandIndex, true)) return false;
+
+    struct text_cmd parsed;
+    if (text_parse(&line->cmds[commandIndex], &parsed) == -1) return false;
+    if (tc != NULL) *tc = parsed;
+    else text_cmd_reset(&parsed);
+    return true;
+}
+
+/**
+ * Starts a text builtin followed by another command in a thread of the shell
+ * @param line The command line the builtin is from
+ * @param commandIndex The index of the builtin in the list of commands
+ * @param tc The builtin, moved to the thread
+ * @param in The output of the previous command, neither a descriptor nor a queue if there is none
+ * @param io The default streams of the line
+ * @param nextInShell true if the next command is a text builtin too : the builtins are connected
+ * by a queue instead of a pipe
+ * @param next Retrieves the stream the next command reads
+ * @return 0 on success, -1 if an error occured
+ */
+static int start_builtin(
+        const struct line *line,
+        size_t commandIndex,
+        struct text_cmd *tc,
+        struct text_end in,
+        const struct exec_io *io,
+        bool nextInShell,
+        struct text_end *next
+) {
+    // Without previous command, the builtin reads the file of the line or its own copy of the input
+    if (in.queue == NULL && in.fd == -1) {
+        int output;
+        open_redirections(line, commandIndex, -1, &in.fd, &output);
+        if (commandIndex == 0 && line->file_input != NULL && in.fd == -1) {
+            text_cmd_reset(tc);
+            return -1;
+        }
+        if (in.fd == -1) {
+            int defaultIn = commandIndex == 0 && io->in != -1 ? io->in : STDIN_FILENO;
+            in.fd = fcntl(defaultIn, F_DUPFD_CLOEXEC, MAX_REDIR_FD + 1);
+        }
+    }
+
+    struct text_end out = { .fd = -1, .queue = NULL };
+    *next = out;
+    if (nextInShell) {
+        out.queue = next->queue = text_queue_new();
+    }
+    else {
+        int pipes[2];
+        if (pipe2(pipes, O_CLOEXEC) == 0) {
+            out.fd = pipes[1];
+            next->fd = pipes[0];
+        }
+        else perror("pipe failed");
+    }
+
+    if ((in.queue == NULL && in.fd == -1) || (out.queue == NULL && out.fd == -1) || text_spawn(tc, in, out) == -1) {
+        text_cmd_reset(tc);
+        text_close_read(in);
+        text_close_write(out);
+        text_close_read(*next);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Launches the first commands of a line, without waiting for them
+ *
+ * Text builtins followed by a pipe run in threads of the shell. Consecutive builtins exchange
+ * their bytes through queues, without system calls
+ *
+ * @param line The line to launch
+ * @param io The default streams of the line
+ * @param pids Retrieves the PIDs of the launched processes
+ * @param n_cmds The number of commands to launch
+ * @param lastInShell true if the last command of the line is a text builtin run by the caller
+ * @param last Retrieves the output of the last command launched, neither a descriptor nor a
+ * queue if there is none
+ * @return The number of processes launched, -1 if an error occured
+ */
+static int launch_cmds(
+        const struct line *line,
+        const struct exec_io *io,
+        pid_t *pids,
+        size_t n_cmds,
+        bool lastInShell,
+        struct text_end *last
+) {
+    int n_pids = 0;
+    struct text_end curr = { .fd = -1, .queue = NULL };
+    for (size_t i = 0; i < n_cmds; ++i) {
+        struct text_cmd tc;
+
+        // Execute the cd command
+        if (line->cmds[i].n_args == 2 && strcmp(line->cmds[i].args[0], "cd") == 0) {
+            cd(line->cmds[i].args[1]);
+        }
+        // Start a builtin
+        else if (i != line->n_cmds - 1 && is_text_builtin(line, i, &tc)) {
+            bool nextInShell = i + 1 == line->n_cmds - 1 ? lastInShell : is_text_builtin(line, i + 1, NULL);
+            if (start_builtin(line, i, &tc, curr, io, nextInShell, &curr) == -1) return -1;
+        }
+        // Execute other commands
+        else {
+            pid_t pid, teePid;
+            curr.fd = execute_command(line, &line->cmds[i], i, curr.fd, io, &pid, &teePid);
+            if (teePid != -1) pids[n_pids++] = teePid;
+            if (pid == -1) return -1;
+            pids[n_pids++] = pid;
+        }
+    }
+    *last = curr;
+    return n_pids;
+}
+
+int launch_line(const struct line *line, const struct exec_io *io, pid_t *pids) {
+    const struct exec_io shell_io = { .in = -1, .out = -1, .err = -1 };
+    if (io == NULL) io = &shell_io;
+
+    struct text_end last;
+    return launch_cmds(line, io, pids, line->n_cmds, false, &last);
+}
+
+int run_line(const struct line *line, const struct exec_io *io, pid_t *pids, int *status) {
+    const struct exec_io shell_io = { .in = -1, .out = -1, .err = -1 };
+    if (io == NULL) io = &shell_io;
+
+    size_t last = line->n_cmds - 1;
+    struct text_cmd tc;
+    *status = -1;
+    if (
+            line->background
+            || has_redirs(line, last, false)
+            || has_redirs(line, last, true)
+            || text_parse(&line->cmds[last], &tc) == -1
+    ) {
+        return launch_line(line, io, pids);
+    }
+
+    // The commands before the builtin write to the pipe or the queue it reads
+    struct text_end in;
+    int n_pids = launch_cmds(line, io, pids, last, true, &in);
+    if (n_pids == -1) {
+        text_cmd_reset(&tc);
+        return -1;
+    }
+
+    int input, output;
+    open_redirections(line, last, in.queue == NULL ? in.fd : -1, &input, &output);
+    if ((last == 0 && line->file_input != NULL && input == -1) || (line->file_output != NULL && output == -1)) {
+        *status = 1;
+    }
+    else {
+        const struct text_end defaultIn = {
+                .fd = input != -1 ? input : last == 0 && io->in != -1 ? io->in : STDIN_FILENO,
+                .queue = NULL
+        };
+        const struct text_end out = {
+                .fd = output != -1 ? output : io->out != -1 ? io->out : STDOUT_FILENO,
+                .queue = NULL
+        };
+        fflush(stdout);
+        *status = text_exec(&tc, in.queue != NULL ? in : defaultIn, out);
+    }
+
+    // The commands still writing see the end of the pipe or the queue
+    if (in.queue != NULL) text_close_read(in);
+    if (input != -1) close(input);
+    if (output != -1) close(output);
+    text_cmd_reset(&tc);
+    return n_pids;
+}
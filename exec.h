@@ -0,0 +1,70 @@
+#ifndef EXEC_H
+#define EXEC_H
+
+#include <sys/types.h>
+
+#include "cmdline.h"
+
+#define MAX_PIDS (2 * MAX_CMDS) // each command, and the process copying its output to several destinations
+
+/**
+ * The default streams of a command line
+ *
+ * Each fid replaces the corresponding stream of the shell for the commands of the line,
+ * -1 keeps the stream of the shell. Redirections of the line take precedence over them
+ */
+struct exec_io {
+    int in; // input of the first command
+    int out; // output of the last command
+    int err; // error output of all the commands
+};
+
+/**
+ * Change the current working directory
+ * @param path The path to set the current working directory to
+ */
+void cd(char *path);
+
+/**
+ * Replaces the shell by a command, with the redirections of its line applied in the shell
+ *
+ * Without command, the redirections are applied to the shell itself and stay in place.
+ * If the command can't be executed, the streams of the shell are restored
+ *
+ * @param line The line of the command, a single command in the foreground
+ * @param argv The command and its arguments, ended by NULL
+ * @return 0 if there is no command and the redirections were applied, -1 if an error occured
+ */
+int exec_command(const struct line *line, char *const *argv);
+
+/**
+ * Launches all the commands of a line, without waiting for them
+ *
+ * SIGCHLD should be blocked by the caller until it has waited for the processes it needs
+ *
+ * @param line The line to launch
+ * @param io The default streams of the line, NULL to use the streams of the shell
+ * @param pids Retrieves the PIDs of the launched processes, must be able to hold MAX_PIDS PIDs.
+ * The process copying the output of a command comes just before it
+ * @return The number of processes launched, -1 if an error occured
+ */
+int launch_line(const struct line *line, const struct exec_io *io, pid_t *pids);
+
+/**
+ * Launches a line like launch_line(), and runs its last command in the shell if it is a text
+ * builtin in the foreground
+ *
+ * The builtin runs until the end of its input, while the commands before it run. Text builtins
+ * followed by a pipe always run in threads of the shell, which have no PID. Consecutive text
+ * builtins are connected by in-memory queues instead of pipes, so a pipeline made of builtins
+ * starts no process
+ *
+ * @param line The line to launch
+ * @param io The default streams of the line, NULL to use the streams of the shell
+ * @param pids Retrieves the PIDs of the launched processes, must be able to hold MAX_PIDS PIDs
+ * @param status Retrieves the exit status of the builtin, -1 if the last command is a process
+ * @return The number of processes launched, -1 if an error occured
+ */
+int run_line(const struct line *line, const struct exec_io *io, pid_t *pids, int *status);
+
+#endif
@@ -3,14 +3,30 @@
 #include <wait.h>
 #include <string.h>
 #include <stdlib.h>
-#include <fcntl.h>
 #include <libgen.h>
-#include <pwd.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <time.h>
 
+#include "admit.h"
 #include "cmdline.h"
+#include "coproc.h"
+#include "dag.h"
+#include "dispatch.h"
+#include "exec.h"
+#include "jobs.h"
+#include "journal.h"
+#include "memo.h"
+#include "reader.h"
+#include "server.h"
+#include "spool.h"
+#include "textutil.h"
+#include "watch.h"
+#include "zygote.h"
 
 #define BUFLEN 512
 #define ENDSTATUS_BUF_LEN 4096
+#define DEFAULT_CAPTURE_CAP (1 << 20) // output of a job kept in memory, in bytes
 
 #define YES_NO(i) ((i) ? "Y" : "N")
 
@@ -37,6 +53,56 @@ void display_process_end(int stat, pid_t pid) {
     }
 }
 
+/**
+ * Prints the end status of the processes which ended since the last call
+ */
+void flush_endstatus() {
+    if (strlen(endstatus) > 0) {
+        fprintf(stderr, "%s", endstatus);
+        for (int i = 0; i < ENDSTATUS_BUF_LEN; ++i) endstatus[i] = '\0';
+    }
+}
+
+/**
+ * Tells if a command is run by the shell itself
+ * @param name The name of the command
+ * @return true if the command is a builtin
+ */
+bool is_builtin(const char *name) {
+    const char *builtins[] = { "cached", "cd", "coproc", "dag", "dispatch", "exec", "exit", "jobout", "watch-run" };
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); ++i) {
+        if (strcmp(name, builtins[i]) == 0) return true;
+    }
+    return false;
+}
+
+/**
+ * Tells if the output of a command of a line goes to several destinations
+ * @param line The line
+ * @return true if a process has to copy an output
+ */
+bool has_tee(const struct line *line) {
+    for (size_t i = 0; i < line->n_redirs; ++i) {
+        if (line->redirs[i].kind == REDIR_TEE || line->redirs[i].kind == REDIR_TEE_APPEND) return true;
+    }
+    return false;
+}
+
+/**
+ * Tells if the completion of a line is recorded in the journal
+ *
+ * The lines changing the state of the shell run again after a restart, like the background
+ * lines, which aren't waited for
+ *
+ * @param line The line
+ * @return true if the line can be skipped once it succeeded
+ */
+bool is_journaled(const struct line *line) {
+    if (line->n_cmds == 0) return false;
+    const char *name = line->cmds[0].args[0];
+    return !line->background && strcmp(name, "cd") != 0 && strcmp(name, "exec") != 0 && strcmp(name, "coproc") != 0;
+}
+
 /**
  * An empty handler for SIGINT
  */
@@ -48,157 +114,238 @@ void sigint_handler() {}
 void sigchld_handler() {
     int stat;
     pid_t pid;
-    do {
-        pid = waitpid(-1, &stat, WNOHANG);
-        if (pid > 0) display_process_end(stat, pid);
-    } while (pid != -1);
+    // Stop as soon as no more child has ended, idle helpers would make the loop spin forever
+    while ((pid = waitpid(-1, &stat, WNOHANG)) > 0) {
+        display_process_end(stat, pid);
+    }
+    // A queued job may fit now
+    admit_notify();
 }
 
 /**
- * Executes a command
- * @param line The command line the command is from
- * @param command The command to execute
- * @param commandIndex The index of the command in the list of commands
- * @param pipeIn The fid of the pipe to use. -1 if no pipe has to be used
- * @return The fid of the pipe opened for the command, -1 if an error occured
+ * Launch a command line in the background
+ * @param line The line to launch
+ * @return The PID of the last process of the line, -1 if it couldn't be launched
  */
-int execute_command(struct line *line, struct cmd *command, size_t commandIndex, int pipeIn) {
-    // Opening pipe if needed
-    int pipes[2];
-    if (commandIndex != line->n_cmds - 1) pipe(pipes);
-
-    // Forking
-    pid_t pid = fork();
-    if (pid == -1) {
-        perror("fork failed");
-        return -1;
+pid_t launch_background(const struct line *line) {
+    // The outputs of the job are kept in the job table
+    if (jobs_enabled()) {
+        pid_t pid;
+        jobs_launch(line, &pid);
+        return pid;
     }
 
+    pid_t pids[MAX_PIDS];
+    int n_pids = launch_line(line, NULL, pids);
+    return n_pids > 0 ? pids[n_pids - 1] : -1;
+}
 
-    if (pid == 0) {
-        if (line->background) {
-            // Installing SIGINT signal handler
-            struct sigaction action;
-            action.sa_flags = 0;
-            sigemptyset(&action.sa_mask);
-            action.sa_handler = SIG_IGN;
-            sigaction(SIGCHLD, &action, NULL);
-        }
+/**
+ * Process a command line by executing all its commands
+ * @param line The line to process
+ * @return The exit status of the line, 128 + N if its last command was killed by the signal N
+ */
+int execute_line(const struct line *line) {
+    // Nothing to do for a blank line
+    if (line->n_cmds == 0) return 0;
 
-        // Redirecting input
-        if (pipeIn > 0) {
-            dup2(pipeIn, STDIN_FILENO);
-            close(pipeIn);
-        }
-        else if ((commandIndex == 0 && line->file_input != NULL) || line->background) {
-            int input = open(
-                    line->file_input != NULL ? line->file_input : "/dev/null",
-                    O_RDONLY
-            );
-            if (input == -1) perror("Input redirection failed");
-            else {
-                dup2(input, STDIN_FILENO);
-                close(input);
-            }
-        }
+    // Execute the dispatch builtin
+    if (line->n_cmds == 1 && strcmp(line->cmds[0].args[0], "dispatch") == 0) {
+        return dispatch(line->cmds[0].n_args, line->cmds[0].args);
+    }
 
-        // Redirecting output
-        if (commandIndex != line->n_cmds - 1) {
-            dup2(pipes[1], STDOUT_FILENO);
-            close(pipes[1]);
-        }
-        if (commandIndex == line->n_cmds - 1 && line->file_output != NULL) {
-            int output = open(
-                    line->file_output,
-                    O_WRONLY | O_CREAT | (line->file_output_append ? O_APPEND : O_TRUNC)
-            );
-            if (output == -1) perror("Output redirection failed");
-            else {
-                dup2(output, STDOUT_FILENO);
-                close(output);
-            }
-        }
+    // Execute the cached builtin
+    if (strcmp(line->cmds[0].args[0], "cached") == 0) {
+        return cached(line);
+    }
 
-        // Execute the command
-        execvp(command->args[0], command->args);
-        perror("execvp failed");
-        exit(1);
+    // Execute the dag builtin
+    if (line->n_cmds == 1 && strcmp(line->cmds[0].args[0], "dag") == 0) {
+        return dag(line->cmds[0].n_args, line->cmds[0].args);
     }
 
-    if (commandIndex != line->n_cmds - 1) close(pipes[1]);
-    if (pipeIn > 0) close(pipeIn);
+    // Execute the coproc builtin
+    if (strcmp(line->cmds[0].args[0], "coproc") == 0) {
+        return coproc(line);
+    }
 
-    if (!line->background && commandIndex == line->n_cmds - 1) {
-        int stat;
-        waitpid(pid, &stat, 0);
-        display_process_end(stat, pid);
+    // Execute the jobout builtin
+    if (line->n_cmds == 1 && strcmp(line->cmds[0].args[0], "jobout") == 0) {
+        return jobout(line->cmds[0].n_args, line->cmds[0].args);
     }
-    if (commandIndex != line->n_cmds - 1) return pipes[0];
-    else return -1;
-}
 
-/**
- * Change the current working directory
- * @param path The path to set the current working directory to
- */
-void cd(char *path) {
-    char *newPath = NULL;
-
-    // Get the home path
-    if (strcmp(path, "~") == 0) {
-        newPath = getenv("HOME");
-        if (newPath == NULL) {
-            fprintf(stderr, "Error while reading the HOME environment variable");
-            return;
-        }
+    // Execute the watch-run builtin
+    if (strcmp(line->cmds[0].args[0], "watch-run") == 0) {
+        return watch_run(line);
     }
-    if (strlen(path) >= 2 && path[0] == '~' && path[1] != '/') {
-        char* user = calloc(BUFLEN, sizeof(char));
-        size_t index = 0;
-        path++;
-        while (*path != '/' && *path != '\0') {
-            user[index] = *path;
-            index++;
-            path++;
-        }
-        struct passwd *pw = getpwnam(user);
-        if (pw == NULL) {
-            fprintf(stderr, "This user does not exist\n");
-            return;
+
+    // Execute the exec builtin
+    if (line->n_cmds == 1 && strcmp(line->cmds[0].args[0], "exec") == 0) {
+        if (line->background) {
+            fprintf(stderr, "exec can't be run in the background\n");
+            return 1;
         }
-        newPath = pw->pw_dir;
+        flush_endstatus();
+        return exec_command(line, line->cmds[0].args + 1) == -1 ? 1 : 0;
     }
 
-    // Set the new current working directory
-    int status = chdir(newPath != NULL ? newPath : path);
-    if (status == -1) perror("Failed to set working directory");
-    else if (status != 0) {
-        fprintf(stderr, "Failed to set working directory with error %d", status);
+    // Background jobs wait for the load to allow them
+    if (line->background && admit_enabled()) {
+        return admit_submit(line) == -1 ? 1 : 0;
     }
+    if (line->background) {
+        return launch_background(line) == -1 ? 1 : 0;
+    }
+
+    // Keep the SIGCHLD handler from reaping the commands before they are waited for
+    sigset_t chld, old;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &old);
+
+    // A text builtin at the end of the line runs in the shell
+    pid_t pids[MAX_PIDS];
+    int builtin_status;
+    int n_pids = run_line(line, NULL, pids, &builtin_status);
+    int status = n_pids == -1 ? 1 : 0;
+    if (n_pids > 0 && !line->background) {
+        // The copies of the outputs must be complete when the line is done
+        for (int i = 0; i < n_pids; ++i) {
+            int stat;
+            if (waitpid(pids[i], &stat, 0) != pids[i]) continue;
+            display_process_end(stat, pids[i]);
+            if (i == n_pids - 1) status = WIFEXITED(stat) ? WEXITSTATUS(stat) : 128 + WTERMSIG(stat);
+        }
+    }
+    if (builtin_status != -1) status = builtin_status;
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return status;
 }
 
 /**
- * Process a command line by executing all its commands
- * @param line The line to process
+ * Prints how to use the shell
+ * @param name The name the shell was invoked with
  */
-void execute_line(struct line *line) {
-    int currPipe = -1;
-    for (size_t i = 0; i < line->n_cmds; ++i) {
-        // Execute the cd command
-        if (line->cmds[i].n_args == 2 && strcmp(line->cmds[i].args[0], "cd") == 0) {
-            cd(line->cmds[i].args[1]);
+void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-c LINES] [-z N] [-j N] [-p K] [-l N] [--capture-jobs[=CAP]] [--tag-output] [--max-load L] [--min-free-mem MB] [--max-running N] [--journal FILE] [--result-cache DIR] [--result-cache-max MB] [--result-cache-env NAMES] [--text-builtins] [--serve PATH] [--spool DIR]\n", name);
+    fprintf(stderr, "\t-c LINES\tExecute the newline-separated command lines LINES instead of the standard input\n");
+    fprintf(stderr, "\t-z, --zygotes N\tKeep N pre-forked helpers to launch commands\n");
+    fprintf(stderr, "\t-p, --parse-ahead K\tRead and parse up to K lines ahead (non-interactive mode)\n");
+    fprintf(stderr, "\t-l, --line-cache N\tKeep the N last different lines parsed\n");
+    fprintf(stderr, "\t-j, --jobs N\tRun at most N command lines at the same time (server and spool modes)\n");
+    fprintf(stderr, "\t--capture-jobs[=CAP]\tKeep the outputs of the background jobs, up to CAP bytes in memory each, for jobout\n");
+    fprintf(stderr, "\t--tag-output\tWrite the lines of the background jobs whole, prefixed by their job ID\n");
+    fprintf(stderr, "\t--max-load L\tDelay the background jobs while the 1-minute load average is above L\n");
+    fprintf(stderr, "\t--min-free-mem MB\tDelay the background jobs while less than MB MiB of memory are available\n");
+    fprintf(stderr, "\t--max-running N\tDelay the background jobs while N of them are running\n");
+    fprintf(stderr, "\t--journal FILE\tRecord the completed lines in FILE, and skip the ones which succeeded in a previous run\n");
+    fprintf(stderr, "\t--result-cache DIR\tStore the results of the lines prefixed by cached in DIR\n");
+    fprintf(stderr, "\t--result-cache-max MB\tKeep at most MB MiB of results, the least recently used ones are removed\n");
+    fprintf(stderr, "\t--result-cache-env NAMES\tComma-separated environment variables the cached lines depend on\n");
+    fprintf(stderr, "\t--text-builtins\tRun wc, head, tail, grep -F and sort in the shell, at the end or in the middle of pipelines\n");
+    fprintf(stderr, "\t--serve PATH\tExecute the command lines received on the Unix socket PATH\n");
+    fprintf(stderr, "\t--spool DIR\tExecute the job files dropped in DIR, and move them to DIR/done or DIR/failed\n");
+}
+
+int main(int argc, char **argv) {
+    size_t zygotes = 0;
+    size_t jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t parse_ahead = 0;
+    size_t line_cache_size = 0;
+    const char *serve_path = NULL;
+    const char *spool_dir = NULL;
+    const char *lines = NULL;
+    const char *journal_path = NULL;
+    const char *memo_dir = NULL;
+    const char *memo_env = NULL;
+    size_t memo_max = DEFAULT_MEMO_MAX;
+    bool capture_jobs = false;
+    bool tag_output = false;
+    size_t capture_cap = DEFAULT_CAPTURE_CAP;
+    struct admit_limits limits = { .max_load = 0, .min_mem_kb = 0, .max_running = 0 };
+
+    // Parse the options
+    const struct option options[] = {
+            { "zygotes", required_argument, NULL, 'z' },
+            { "jobs", required_argument, NULL, 'j' },
+            { "parse-ahead", required_argument, NULL, 'p' },
+            { "line-cache", required_argument, NULL, 'l' },
+            { "text-builtins", no_argument, NULL, 'B' },
+            { "serve", required_argument, NULL, 'S' },
+            { "spool", required_argument, NULL, 'D' },
+            { "capture-jobs", optional_argument, NULL, 'C' },
+            { "tag-output", no_argument, NULL, 'T' },
+            { "max-load", required_argument, NULL, 'L' },
+            { "min-free-mem", required_argument, NULL, 'M' },
+            { "max-running", required_argument, NULL, 'R' },
+            { "journal", required_argument, NULL, 'J' },
+            { "result-cache", required_argument, NULL, 'K' },
+            { "result-cache-max", required_argument, NULL, 'X' },
+            { "result-cache-env", required_argument, NULL, 'E' },
+            { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "c:z:j:p:l:", options, NULL)) != -1) {
+        switch (opt) {
+            case 'c':
+                lines = optarg;
+                break;
+            case 'z':
+                zygotes = strtoul(optarg, NULL, 10);
+                break;
+            case 'j':
+                jobs = strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                parse_ahead = strtoul(optarg, NULL, 10);
+                break;
+            case 'l':
+                line_cache_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'B':
+                text_enable();
+                break;
+            case 'S':
+                serve_path = optarg;
+                break;
+            case 'D':
+                spool_dir = optarg;
+                break;
+            case 'C':
+                capture_jobs = true;
+                if (optarg != NULL) capture_cap = strtoul(optarg, NULL, 10);
+                break;
+            case 'T':
+                tag_output = true;
+                break;
+            case 'L':
+                limits.max_load = strtod(optarg, NULL);
+                break;
+            case 'M':
+                limits.min_mem_kb = strtoul(optarg, NULL, 10) * 1024;
+                break;
+            case 'R':
+                limits.max_running = strtoul(optarg, NULL, 10);
+                break;
+            case 'J':
+                journal_path = optarg;
+                break;
+            case 'K':
+                memo_dir = optarg;
+                break;
+            case 'X':
+                memo_max = strtoul(optarg, NULL, 10) * 1024 * 1024;
+                break;
+            case 'E':
+                memo_env = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
         }
-        // Execute other commands
-        else currPipe = execute_command(
-                line,
-                &line->cmds[i],
-                i,
-                currPipe
-        );
     }
-}
 
-int main() {
     // Create buffer for displaying end status
     endstatus = calloc(ENDSTATUS_BUF_LEN, sizeof(char));
 
@@ -216,72 +363,174 @@ int main() {
     act2.sa_handler = sigchld_handler;
     sigaction(SIGCHLD, &act2, NULL);
 
+    // Fork the helpers while the shell is still small
+    if (zygotes > 0 && zygote_init(zygotes) == -1) return 1;
+
+    if (serve_path != NULL) {
+        int err = serve(serve_path, jobs);
+        zygote_shutdown();
+        free(endstatus);
+        return err ? 1 : 0;
+    }
+
+    if (spool_dir != NULL) {
+        int err = spool(spool_dir, jobs);
+        zygote_shutdown();
+        free(endstatus);
+        return err ? 1 : 0;
+    }
+
+    FILE *input = stdin;
+    if (lines != NULL) {
+        input = fmemopen((void *) lines, strlen(lines), "r");
+        if (input == NULL) {
+            perror("Failed to read the command lines");
+            return 1;
+        }
+    }
+
+    // Scripts are read ahead while the commands run
+    bool interactive = lines == NULL && isatty(STDIN_FILENO);
+    if (interactive) parse_ahead = 0;
+
+    // Repeated lines are only parsed once
+    struct line_cache *cache = NULL;
+    if (line_cache_size > 0) {
+        cache = line_cache_new(line_cache_size);
+        if (cache == NULL) {
+            fprintf(stderr, "Memory allocation failure\n");
+            return 1;
+        }
+    }
+
+    if ((capture_jobs || tag_output) && jobs_init(capture_jobs, capture_cap, tag_output) == -1) return 1;
+
+    bool admission = limits.max_load > 0 || limits.min_mem_kb > 0 || limits.max_running > 0;
+    if (admission && admit_init(&limits, launch_background) == -1) return 1;
+
+    if (memo_dir != NULL && memo_init(memo_dir, memo_max, memo_env) == -1) return 1;
+
+    if (journal_path != NULL && journal_open(journal_path) == -1) return 1;
+
+    if (reader_init(input, parse_ahead, cache) == -1) return 1;
+
     struct line li;
-    char buf[BUFLEN];
+    const struct line *parsed;
 
     line_init(&li);
 
-
     for (;;) {
+        // Top up the helpers while waiting for the next command
+        zygote_refill();
+
         // Display end status
-        if (strlen(endstatus) > 0) {
-            fprintf(stderr, "%s", endstatus);
-            for (int i = 0; i < ENDSTATUS_BUF_LEN; ++i) endstatus[i] = '\0';
-        }
+        flush_endstatus();
 
         // Display prompt
-        char *cwd = getcwd(NULL, 0);
-        printf("fish %s> ", cwd != NULL ? basename(cwd) : "");
-        if (cwd != NULL) free(cwd);
-
-        fgets(buf, BUFLEN, stdin);
+        if (interactive) {
+            char *cwd = getcwd(NULL, 0);
+            printf("fish %s> ", cwd != NULL ? basename(cwd) : "");
+            if (cwd != NULL) free(cwd);
+        }
 
-        int err = line_parse(&li, buf);
+        int err = reader_next(&li, &parsed);
+        if (err == 1) break;
         if (err) {
             //the command line entered by the user isn't valid
-            line_reset(&li);
+            reader_release(&li, parsed);
+            continue;
+        }
+
+        // Lines which succeeded in a previous run are skipped
+        size_t number;
+        uint64_t hash;
+        reader_position(&number, &hash);
+        bool journaled = journal_enabled() && is_journaled(parsed);
+        if (journaled && journal_done(number, hash)) {
+            fprintf(stderr, "Line %zu already completed, skipped\n", number);
+            reader_release(&li, parsed);
             continue;
         }
 
         fprintf(stderr, "Command line:\n");
-        fprintf(stderr, "\tNumber of commands: %zu\n", li.n_cmds);
+        fprintf(stderr, "\tNumber of commands: %zu\n", parsed->n_cmds);
 
-        for (size_t i = 0; i < li.n_cmds; ++i) {
+        for (size_t i = 0; i < parsed->n_cmds; ++i) {
             fprintf(stderr, "\t\tCommand #%zu:\n", i);
-            fprintf(stderr, "\t\t\tNumber of args: %zu\n", li.cmds[i].n_args);
+            fprintf(stderr, "\t\t\tNumber of args: %zu\n", parsed->cmds[i].n_args);
             fprintf(stderr, "\t\t\tArgs:");
-            for (size_t j = 0; j < li.cmds[i].n_args; ++j) {
-                fprintf(stderr, " \"%s\"", li.cmds[i].args[j]);
+            for (size_t j = 0; j < parsed->cmds[i].n_args; ++j) {
+                fprintf(stderr, " \"%s\"", parsed->cmds[i].args[j]);
             }
             fprintf(stderr, "\n");
         }
 
-        fprintf(stderr, "\tRedirection of input: %s\n", YES_NO(li.file_input));
-        if (li.file_input) {
-            fprintf(stderr, "\t\tFilename: '%s'\n", li.file_input);
+        fprintf(stderr, "\tRedirection of input: %s\n", YES_NO(parsed->file_input));
+        if (parsed->file_input) {
+            fprintf(stderr, "\t\tFilename: '%s'\n", parsed->file_input);
         }
 
-        fprintf(stderr, "\tRedirection of output: %s\n", YES_NO(li.file_output));
-        if (li.file_output) {
-            fprintf(stderr, "\t\tFilename: '%s'\n", li.file_output);
-            fprintf(stderr, "\t\tMode: %s\n", li.file_output_append ? "APPEND" : "TRUNC");
+        fprintf(stderr, "\tRedirection of output: %s\n", YES_NO(parsed->file_output));
+        if (parsed->file_output) {
+            fprintf(stderr, "\t\tFilename: '%s'\n", parsed->file_output);
+            fprintf(stderr, "\t\tMode: %s\n", parsed->file_output_append ? "APPEND" : "TRUNC");
         }
 
-        fprintf(stderr, "\tBackground: %s\n", YES_NO(li.background));
+        fprintf(stderr, "\tBackground: %s\n", YES_NO(parsed->background));
 
         // Handle the exit command
         if (
-                li.n_cmds == 1
-                && li.cmds[0].n_args == 1
-                && strcmp(li.cmds[0].args[0], "exit") == 0
+                parsed->n_cmds == 1
+                && parsed->cmds[0].n_args == 1
+                && strcmp(parsed->cmds[0].args[0], "exit") == 0
+        ) {
+            reader_release(&li, parsed);
+            break;
+        }
+
+        // Nothing has to be done after the last command of a script : the shell is replaced by it
+        if (
+                !interactive
+                && cache == NULL
+                && parsed->n_cmds == 1
+                && !parsed->background
+                && !is_builtin(parsed->cmds[0].args[0])
+                && !has_tee(parsed)
+                && !jobs_enabled()
+                && !admit_enabled()
+                && !journal_enabled()
+                && reader_at_end()
         ) {
-            free(endstatus);
-            line_reset(&li);
-            return 0;
+            flush_endstatus();
+            exec_command(parsed, parsed->cmds[0].args);
+            return 1;
         }
 
-        execute_line(&li);
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int status = execute_line(parsed);
+        if (journaled) {
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            journal_record(number, hash, status, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+        }
 
-        line_reset(&li);
+        reader_release(&li, parsed);
     }
+
+    // The queued jobs are launched before leaving
+    admit_drain();
+    journal_close();
+
+    if (cache != NULL) {
+        size_t hits, misses;
+        line_cache_stats(cache, &hits, &misses);
+        fprintf(
+                stderr, "Line cache: %zu hits, %zu misses (%.1f%% hit rate)\n",
+                hits, misses, hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0
+        );
+    }
+
+    zygote_shutdown();
+    free(endstatus);
+    return 0;
 }
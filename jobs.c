@@ -0,0 +1,472 @@
+#define _GNU_SOURCE // memfd_create(), O_TMPFILE and pipe2()
+
+#include "jobs.h"
+#include "exec.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+
+#define MAX_EVENTS 64
+#define READ_BUF_LEN 65536
+#define MIN_JOB_FD 10 // descriptors 0 to 9 are left to the redirections of the user
+
+struct job;
+
+/**
+ * One captured output of a job
+ */
+struct job_stream {
+    struct job *job; // job the stream belongs to
+    int pipe; // read end of the pipe the job writes to, -1 once the job closed it
+    int fd; // memory file, or temporary file once spilled
+    size_t size;
+    bool spilled;
+
+    // Line being received, only used by the pump thread
+    char *pending;
+    size_t pending_len;
+};
+
+struct job {
+    int id; // -1 if this slot of the table is empty
+    pid_t pid; // last process of the line
+    struct job_stream streams[2]; // standard and error outputs
+};
+
+// The jobs are allocated one by one, so the pump thread can keep pointers to their streams
+static struct job **jobs = NULL;
+static size_t n_jobs = 0;
+static int next_id = 1;
+static size_t capture_cap;
+static bool capturing = false;
+static bool tagging = false;
+static int epfd = -1;
+
+// Protects the job table against the pump thread
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char buf[READ_BUF_LEN];
+
+/**
+ * Move a descriptor out of the range left to the user
+ * @param fd The descriptor, closed if it was moved
+ * @return The descriptor to use from now on
+ */
+static int high_fd(int fd) {
+    int moved = fcntl(fd, F_DUPFD_CLOEXEC, MIN_JOB_FD);
+    if (moved == -1) return fd;
+    close(fd);
+    return moved;
+}
+
+/**
+ * Create an unlinked temporary file
+ * @return The descriptor of the file, -1 if an error occured
+ */
+static int temp_file(void) {
+    const char *dir = getenv("TMPDIR");
+    if (dir == NULL) dir = "/tmp";
+    int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd != -1) return fd;
+
+    // The file system doesn't support O_TMPFILE
+    char path[BUFSIZ];
+    snprintf(path, sizeof(path), "%s/fish-job-XXXXXX", dir);
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd != -1) unlink(path);
+    return fd;
+}
+
+/**
+ * Move a stream from memory to a temporary file, the lock must be held
+ * @param s The stream
+ * @return 0 on success, -1 if an error occured
+ */
+static int stream_spill(struct job_stream *s) {
+    int fd = temp_file();
+    if (fd == -1) return -1;
+
+    off_t off = 0;
+    while ((size_t) off < s->size) {
+        ssize_t n = sendfile(fd, s->fd, &off, s->size - off);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    close(s->fd);
+    s->fd = high_fd(fd);
+    s->spilled = true;
+    return 0;
+}
+
+/**
+ * Write a line of a job prefixed by its tag, with a single write when possible
+ * @param fd The descriptor to write to
+ * @param id The ID of the job
+ * @param data The line
+ * @param len The length of the line
+ * @param newline true to end the line, if it was broken or not ended
+ */
+static void tag_write(int fd, int id, const char *data, size_t len, bool newline) {
+    char tag[32];
+    struct iovec iov[3] = {
+            { .iov_base = tag, .iov_len = snprintf(tag, sizeof(tag), "[%d] ", id) },
+            { .iov_base = (char *) data, .iov_len = len },
+            { .iov_base = "\n", .iov_len = newline ? 1 : 0 }
+    };
+    struct iovec *v = iov;
+    int n_iov = 3;
+    while (n_iov > 0) {
+        ssize_t n = writev(fd, v, n_iov);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) return;
+
+        // Partial write : the output is slow, go on with the rest
+        while (n_iov > 0 && (size_t) n >= v->iov_len) {
+            n -= v->iov_len;
+            ++v;
+            --n_iov;
+        }
+        if (n_iov > 0) {
+            v->iov_base = (char *) v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+}
+
+/**
+ * Write the complete lines received on a stream, keeping the last incomplete one
+ * @param s The stream
+ * @param fd The descriptor to write to
+ * @param id The ID of the job
+ * @param data The bytes received
+ * @param n The number of bytes
+ */
+static void tag_lines(struct job_stream *s, int fd, int id, const char *data, size_t n) {
+    while (n > 0) {
+        const char *nl = memchr(data, '\n', n);
+        size_t take = nl != NULL ? (size_t) (nl - data) + 1 : n;
+
+        // A complete line, nothing to keep
+        if (nl != NULL && s->pending_len == 0 && take <= TAG_LINE_MAX) {
+            tag_write(fd, id, data, take, false);
+            data += take;
+            n -= take;
+            continue;
+        }
+
+        // The line is too long to be kept : it is broken
+        if (s->pending_len + take > TAG_LINE_MAX) {
+            size_t fill = TAG_LINE_MAX - s->pending_len;
+            memcpy(s->pending + s->pending_len, data, fill);
+            tag_write(fd, id, s->pending, TAG_LINE_MAX, true);
+            s->pending_len = 0;
+            data += fill;
+            n -= fill;
+            continue;
+        }
+
+        memcpy(s->pending + s->pending_len, data, take);
+        s->pending_len += take;
+        data += take;
+        n -= take;
+        if (nl != NULL) {
+            tag_write(fd, id, s->pending, s->pending_len, false);
+            s->pending_len = 0;
+        }
+    }
+}
+
+/**
+ * Store what is available on the pipe of a stream, or close it at the end
+ * @param s The stream
+ */
+static void stream_pump(struct job_stream *s) {
+    struct job *job = s->job;
+
+    // An event of the same batch may have closed it
+    pthread_mutex_lock(&lock);
+    int pipe = s->pipe;
+    int id = job->id;
+    pthread_mutex_unlock(&lock);
+    if (pipe == -1) return;
+
+    ssize_t n = read(pipe, buf, sizeof(buf));
+    if (n == -1 && (errno == EINTR || errno == EAGAIN)) return;
+
+    // Written without the lock : a slow output holds the jobs back, not the shell
+    if (tagging) {
+        int out = s == &job->streams[0] ? STDOUT_FILENO : STDERR_FILENO;
+        if (n > 0) tag_lines(s, out, id, buf, n);
+        else if (s->pending_len > 0) {
+            tag_write(out, id, s->pending, s->pending_len, true);
+            s->pending_len = 0;
+        }
+    }
+
+    pthread_mutex_lock(&lock);
+    if (n <= 0) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, s->pipe, NULL);
+        close(s->pipe);
+        s->pipe = -1;
+    }
+    else if (s->fd != -1) {
+        if (!s->spilled && s->size + n > capture_cap && stream_spill(s) == -1) {
+            // Keep it in memory rather than losing it
+            perror("Failed to spill the output of a job");
+            s->spilled = true;
+        }
+        for (ssize_t done = 0; done < n;) {
+            ssize_t w = write(s->fd, buf + done, n - done);
+            if (w == -1 && errno == EINTR) continue;
+            if (w == -1) {
+                perror("Failed to store the output of a job");
+                break;
+            }
+            done += w;
+            s->size += w;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Main loop of the pump thread : move the outputs of the jobs to their files
+ */
+static void *pump_main(void *arg) {
+    (void) arg;
+    struct epoll_event events[MAX_EVENTS];
+    for (;;) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) {
+            perror("epoll_wait failed");
+            return NULL;
+        }
+        for (int i = 0; i < n; ++i) stream_pump(events[i].data.ptr);
+    }
+}
+
+int jobs_init(bool capture, size_t cap, bool tag) {
+    capturing = capture;
+    capture_cap = cap;
+    tagging = tag;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        perror("epoll_create1 failed");
+        return -1;
+    }
+    epfd = high_fd(epfd);
+
+    // The signals are handled by the main thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, pump_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err) {
+        fprintf(stderr, "Failed to start the capture of the jobs\n");
+        close(epfd);
+        capturing = tagging = false;
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+bool jobs_enabled(void) {
+    return capturing || tagging;
+}
+
+/**
+ * Close the files of a job and empty its slot, the lock must be held
+ * @param job The job
+ */
+static void job_release(struct job *job) {
+    for (int i = 0; i < 2; ++i) {
+        struct job_stream *s = &job->streams[i];
+        if (s->pipe != -1) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, s->pipe, NULL);
+            close(s->pipe);
+        }
+        if (s->fd != -1) close(s->fd);
+        free(s->pending);
+    }
+    job->id = -1;
+}
+
+/**
+ * Find a slot for a new job. Once KEPT_JOBS jobs are in the table, the oldest finished job is
+ * forgotten. If every job is still running, the table grows. The lock must be held
+ * @return The slot, NULL if the table couldn't grow
+ */
+static struct job *job_slot(void) {
+    struct job *oldest = NULL;
+    for (size_t i = 0; i < n_jobs; ++i) {
+        struct job *job = jobs[i];
+        if (job->id == -1) return job;
+        bool done = job->streams[0].pipe == -1 && job->streams[1].pipe == -1;
+        if (done && (oldest == NULL || job->id < oldest->id)) oldest = job;
+    }
+    if (n_jobs >= KEPT_JOBS && oldest != NULL) {
+        job_release(oldest);
+        return oldest;
+    }
+
+    struct job **grown = realloc(jobs, (n_jobs + 1) * sizeof(struct job *));
+    if (grown == NULL) return NULL;
+    jobs = grown;
+    struct job *job = malloc(sizeof(struct job));
+    if (job == NULL) return NULL;
+    job->id = -1;
+    jobs[n_jobs++] = job;
+    return job;
+}
+
+int jobs_launch(const struct line *line, pid_t *pid) {
+    *pid = -1;
+    pthread_mutex_lock(&lock);
+    struct job *job = job_slot();
+    if (job == NULL) {
+        pthread_mutex_unlock(&lock);
+        fprintf(stderr, "Memory allocation failure\n");
+        return -1;
+    }
+
+    // The writers are only kept by the job, so the pump sees the end of its outputs
+    int writers[2] = { -1, -1 };
+    job->id = next_id++;
+    job->pid = -1;
+    for (int i = 0; i < 2; ++i) {
+        struct job_stream *s = &job->streams[i];
+        s->job = job;
+        s->pipe = -1;
+        s->fd = -1;
+        s->size = 0;
+        s->spilled = false;
+        s->pending = NULL;
+        s->pending_len = 0;
+        if (capturing) {
+            s->fd = memfd_create("fish-job", MFD_CLOEXEC);
+            if (s->fd == -1) s->fd = temp_file();
+            if (s->fd == -1) {
+                perror("Failed to capture the output of a job");
+                continue;
+            }
+            s->fd = high_fd(s->fd);
+        }
+        if (tagging && (s->pending = malloc(TAG_LINE_MAX)) == NULL) {
+            fprintf(stderr, "Memory allocation failure\n");
+            continue;
+        }
+
+        int pipes[2];
+        if (pipe2(pipes, O_CLOEXEC) == -1) {
+            perror("Failed to capture the output of a job");
+            continue;
+        }
+        s->pipe = high_fd(pipes[0]);
+        writers[i] = pipes[1];
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = s };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, s->pipe, &ev);
+    }
+    int id = job->id;
+    pthread_mutex_unlock(&lock);
+
+    const struct exec_io io = { .in = -1, .out = writers[0], .err = writers[1] };
+    pid_t pids[MAX_PIDS];
+    int n_pids = launch_line(line, &io, pids);
+    for (int i = 0; i < 2; ++i) {
+        if (writers[i] != -1) close(writers[i]);
+    }
+    if (n_pids <= 0) return -1;
+
+    pthread_mutex_lock(&lock);
+    job->pid = pids[n_pids - 1];
+    pthread_mutex_unlock(&lock);
+    *pid = pids[n_pids - 1];
+    fprintf(stderr, "[%d] %d\n", id, pids[n_pids - 1]);
+    return id;
+}
+
+/**
+ * Print the jobs of the table
+ */
+static void jobs_list(void) {
+    pthread_mutex_lock(&lock);
+    for (size_t i = 0; i < n_jobs; ++i) {
+        const struct job *job = jobs[i];
+        if (job->id == -1) continue;
+        bool done = job->streams[0].pipe == -1 && job->streams[1].pipe == -1;
+        printf(
+                "[%d] PID %d %s\tstdout %zu bytes%s\tstderr %zu bytes%s\n",
+                job->id, job->pid, done ? "done" : "running",
+                job->streams[0].size, job->streams[0].spilled ? " (on disk)" : "",
+                job->streams[1].size, job->streams[1].spilled ? " (on disk)" : ""
+        );
+    }
+    pthread_mutex_unlock(&lock);
+    fflush(stdout);
+}
+
+int jobout(size_t argc, char *const *argv) {
+    int stream = 0;
+    const char *id_str = NULL;
+    for (size_t i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-e") == 0) stream = 1;
+        else if (id_str == NULL) id_str = argv[i];
+    }
+    if (!capturing) {
+        fprintf(stderr, "jobout: the output of the jobs isn't captured, see --capture-jobs\n");
+        return 1;
+    }
+    if (id_str == NULL) {
+        jobs_list();
+        return 0;
+    }
+
+    // Take a copy of the descriptor : the pump may spill the stream meanwhile
+    int id = atoi(id_str);
+    int fd = -1;
+    size_t size = 0;
+    pthread_mutex_lock(&lock);
+    for (size_t i = 0; i < n_jobs; ++i) {
+        if (jobs[i]->id != id || id == -1 || jobs[i]->streams[stream].fd == -1) continue;
+        fd = fcntl(jobs[i]->streams[stream].fd, F_DUPFD_CLOEXEC, MIN_JOB_FD);
+        size = jobs[i]->streams[stream].size;
+    }
+    pthread_mutex_unlock(&lock);
+    if (fd == -1) {
+        fprintf(stderr, "jobout: no job %s\n", id_str);
+        return 1;
+    }
+
+    fflush(stdout);
+    int err = 0;
+    off_t off = 0;
+    while ((size_t) off < size) {
+        ssize_t n = sendfile(STDOUT_FILENO, fd, &off, size - off);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == -1) perror("jobout: write failed");
+            err = 1;
+            break;
+        }
+    }
+    close(fd);
+    return err;
+}
@@ -0,0 +1,66 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "cmdline.h"
+
+#define KEPT_JOBS 64 // jobs kept in the table before the oldest finished one is forgotten
+#define TAG_LINE_MAX 4096 // bytes of a tagged line kept before it is broken
+
+/**
+ * Start handling the outputs of the background jobs
+ *
+ * A thread reads everything the jobs write on their standard and error outputs. When they are
+ * captured, it moves them into memory files, one per stream. A stream which grows past "cap"
+ * bytes is moved to an unlinked temporary file, and keeps growing there.
+ * When they are tagged, it writes every complete line on the corresponding output of the shell,
+ * prefixed by "[ID] " and in a single write, so the lines of the jobs don't mix. At most
+ * TAG_LINE_MAX bytes of a line are kept, a longer line is broken. A slow output holds the
+ * jobs back, as their pipes fill up
+ *
+ * @param capture true to capture the outputs for jobout
+ * @param cap size of a captured stream kept in memory, in bytes
+ * @param tag true to write the lines of the outputs prefixed by the ID of their job
+ *
+ * @return 0 on success, -1 on failure
+ */
+int jobs_init(bool capture, size_t cap, bool tag);
+
+/**
+ * Tells if the outputs of the background jobs are handled by the job table
+ * @return true once jobs_init() succeeded
+ */
+bool jobs_enabled(void);
+
+/**
+ * Launch a command line in the background, with its outputs handled by the job table
+ *
+ * The job takes a slot of the job table. Once it holds KEPT_JOBS jobs, the oldest job whose
+ * outputs are closed is forgotten. The table grows as long as every job is still running, so
+ * handling the outputs never keeps a job from being launched. Redirections of the line take
+ * precedence over the capture
+ *
+ * @param line The line to launch, in the background
+ * @param pid Retrieves the PID of the last process of the line, -1 if it couldn't be launched
+ *
+ * @return the ID of the job, -1 if it couldn't be launched
+ */
+int jobs_launch(const struct line *line, pid_t *pid);
+
+/**
+ * The jobout builtin : jobout [-e] [ID]
+ *
+ * Prints what job ID has written so far on its standard output, or on its error output with
+ * -e. Without ID, lists the jobs of the table with the size of their outputs
+ *
+ * @param argc number of arguments, including the name of the builtin
+ * @param argv arguments of the builtin
+ *
+ * @return 0 on success, 1 if the job doesn't exist
+ */
+int jobout(size_t argc, char *const *argv);
+
+#endif
@@ -0,0 +1,146 @@
+#include "journal.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MIN_JOURNAL_FD 10 // descriptors 0 to 9 are left to the redirections of the user
+
+/**
+ * A line which completed successfully during a previous run
+ */
+struct done_line {
+    size_t number;
+    uint64_t hash;
+};
+
+static int journal_fd = -1;
+static struct done_line *done = NULL; // sorted
+static size_t n_done = 0;
+static size_t n_unsynced = 0; // records written since the last sync
+static struct timespec last_sync;
+
+/**
+ * Compare two completed lines, for qsort() and bsearch()
+ */
+static int compare_done(const void *a, const void *b) {
+    const struct done_line *x = a, *y = b;
+    if (x->number != y->number) return x->number < y->number ? -1 : 1;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return 0;
+}
+
+/**
+ * Read the successful lines of the records of a journal
+ * @param path The path of the journal
+ * @return 0 on success, -1 on failure
+ */
+static int read_journal(const char *path) {
+    FILE *file = fopen(path, "re");
+    if (file == NULL) return 0;
+
+    size_t cap = 0;
+    char *buf = NULL;
+    size_t buf_cap = 0;
+    ssize_t len;
+    while ((len = getline(&buf, &buf_cap, file)) != -1) {
+        // The last record may have been cut by a crash
+        struct done_line line;
+        int status, end = 0;
+        double seconds;
+        if (
+                sscanf(buf, "%zu %" SCNx64 " %d %lf%n", &line.number, &line.hash, &status, &seconds, &end) != 4
+                || buf[end] != '\n'
+                || status != 0
+        ) {
+            continue;
+        }
+
+        if (n_done == cap) {
+            cap = cap ? cap * 2 : 256;
+            struct done_line *more = realloc(done, cap * sizeof(struct done_line));
+            if (more == NULL) {
+                fprintf(stderr, "Memory allocation failure\n");
+                free(buf);
+                fclose(file);
+                return -1;
+            }
+            done = more;
+        }
+        done[n_done++] = line;
+    }
+    free(buf);
+    fclose(file);
+
+    qsort(done, n_done, sizeof(struct done_line), compare_done);
+    return 0;
+}
+
+int journal_open(const char *path) {
+    if (read_journal(path) == -1) return -1;
+
+    int fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror("Failed to open the journal");
+        return -1;
+    }
+    journal_fd = fcntl(fd, F_DUPFD_CLOEXEC, MIN_JOURNAL_FD);
+    if (journal_fd == -1) journal_fd = fd;
+    else close(fd);
+
+    // A record cut by a crash must not swallow the next one
+    char last;
+    off_t size = lseek(journal_fd, 0, SEEK_END);
+    if (size > 0 && pread(journal_fd, &last, 1, size - 1) == 1 && last != '\n') {
+        if (write(journal_fd, "\n", 1) != 1) perror("Failed to write the journal");
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &last_sync);
+    return 0;
+}
+
+bool journal_enabled(void) {
+    return journal_fd != -1;
+}
+
+bool journal_done(size_t number, uint64_t hash) {
+    struct done_line line = { .number = number, .hash = hash };
+    return n_done > 0 && bsearch(&line, done, n_done, sizeof(struct done_line), compare_done) != NULL;
+}
+
+void journal_record(size_t number, uint64_t hash, int status, double seconds) {
+    if (journal_fd == -1) return;
+
+    // A single write, the record can't be interleaved with another one
+    char buf[128];
+    int len = snprintf(buf, sizeof(buf), "%zu %016" PRIx64 " %d %.3f\n", number, hash, status, seconds);
+    if (write(journal_fd, buf, len) != len) {
+        perror("Failed to write the journal");
+        return;
+    }
+
+    // Syncing every record would cost more than short lines
+    ++n_unsynced;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed_ms = (now.tv_sec - last_sync.tv_sec) * 1000 + (now.tv_nsec - last_sync.tv_nsec) / 1000000;
+    if (n_unsynced >= JOURNAL_BATCH || elapsed_ms >= JOURNAL_SYNC_MS) {
+        if (fdatasync(journal_fd) == -1) perror("Failed to sync the journal");
+        n_unsynced = 0;
+        last_sync = now;
+    }
+}
+
+void journal_close(void) {
+    if (journal_fd == -1) return;
+    if (n_unsynced > 0 && fdatasync(journal_fd) == -1) perror("Failed to sync the journal");
+    close(journal_fd);
+    journal_fd = -1;
+    free(done);
+    done = NULL;
+    n_done = 0;
+}
@@ -0,0 +1,62 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define JOURNAL_BATCH 64 // records written between two syncs at most
+#define JOURNAL_SYNC_MS 1000 // time between two syncs at most, while lines complete
+
+/**
+ * Open the journal of the completed command lines, creating it if needed
+ *
+ * The journal is an append-only text file with one record per completed line :
+ * "NUMBER HASH STATUS SECONDS". The records already in it are read first, the lines they
+ * describe as successful can then be skipped by journal_done()
+ *
+ * @param path path of the journal
+ *
+ * @return 0 on success, -1 on failure
+ */
+int journal_open(const char *path);
+
+/**
+ * Tells if the completed lines are recorded
+ * @return true once journal_open() succeeded
+ */
+bool journal_enabled(void);
+
+/**
+ * Check if a line completed successfully during a previous run
+ *
+ * A line is identified by its number in the input and by the hash of its text, so the
+ * lines of an edited script run again
+ *
+ * @param number number of the line in the input, from 1
+ * @param hash hash of the text of the line
+ *
+ * @return true if the line can be skipped
+ */
+bool journal_done(size_t number, uint64_t hash);
+
+/**
+ * Append the record of a completed line to the journal
+ *
+ * The record is written at once, so it survives the shell. The records are synced to the disk
+ * by batches of JOURNAL_BATCH, or sooner when JOURNAL_SYNC_MS passed since the last sync, so
+ * a crash of the machine loses little work
+ *
+ * @param number number of the line in the input, from 1
+ * @param hash hash of the text of the line
+ * @param status exit status of the line
+ * @param seconds duration of the line
+ */
+void journal_record(size_t number, uint64_t hash, int status, double seconds);
+
+/**
+ * Sync the last records and close the journal
+ */
+void journal_close(void);
+
+#endif
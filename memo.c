@@ -0,0 +1,415 @@
+#define _GNU_SOURCE // mkostemp(), O_DIRECTORY
+
+#include "memo.h"
+#include "exec.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define MEMO_MAGIC "FISHMEMO"
+#define NAME_LEN 16 // hexadecimal hash of the key
+#define COPY_BUF_LEN 65536
+
+/**
+ * Beginning of a stored result, followed by the key then by the standard output
+ */
+struct memo_header {
+    char magic[8];
+    int32_t status; // exit status of the line
+    uint32_t key_len;
+};
+
+/**
+ * Everything a result depends on, compared byte by byte
+ */
+struct memo_key {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+/**
+ * A stored result, for the eviction
+ */
+struct memo_entry {
+    char name[NAME_LEN + 1];
+    off_t size;
+    struct timespec used;
+};
+
+static char *memo_dir = NULL;
+static int memo_fd = -1;
+static size_t memo_max;
+static char *memo_env = NULL;
+
+/**
+ * Append bytes to a key
+ * @return 0 on success, -1 on failure
+ */
+static int key_add(struct memo_key *key, const void *data, size_t len) {
+    if (key->len + len > key->cap) {
+        size_t cap = key->cap ? key->cap : 256;
+        while (cap < key->len + len) cap *= 2;
+        char *more = realloc(key->data, cap);
+        if (more == NULL) return -1;
+        key->data = more;
+        key->cap = cap;
+    }
+    memcpy(key->data + key->len, data, len);
+    key->len += len;
+    return 0;
+}
+
+/**
+ * Append a string and its terminating '\0' to a key
+ * @return 0 on success, -1 on failure
+ */
+static int key_add_str(struct memo_key *key, const char *str) {
+    return key_add(key, str, strlen(str) + 1);
+}
+
+/**
+ * Append the identity of an input file to a key
+ * @return 0 on success, -1 on failure
+ */
+static int key_add_file(struct memo_key *key, const char *path) {
+    struct stat st;
+    char buf[128];
+    if (stat(path, &st) == -1) strcpy(buf, "-");
+    else {
+        snprintf(
+                buf, sizeof(buf), "%ju:%ju:%jd:%jd.%09ld",
+                (uintmax_t) st.st_dev, (uintmax_t) st.st_ino, (intmax_t) st.st_size,
+                (intmax_t) st.st_mtim.tv_sec, st.st_mtim.tv_nsec
+        );
+    }
+    return key_add_str(key, path) || key_add_str(key, buf) ? -1 : 0;
+}
+
+/**
+ * Build the key of a line
+ * @param key The key, empty
+ * @param line The line, without "cached"
+ * @return 0 on success, -1 on failure
+ */
+static int build_key(struct memo_key *key, const struct line *line) {
+    int err = 0;
+
+    // Relative paths depend on the working directory
+    char *cwd = getcwd(NULL, 0);
+    err |= key_add_str(key, cwd != NULL ? cwd : "");
+    free(cwd);
+
+    for (size_t i = 0; i < line->n_cmds; ++i) {
+        for (size_t j = 0; j < line->cmds[i].n_args; ++j) err |= key_add_str(key, line->cmds[i].args[j]);
+        err |= key_add(key, "|", 1);
+    }
+
+    if (line->file_input != NULL) err |= key_add(key, "<", 1) || key_add_file(key, line->file_input);
+    for (size_t i = 0; i < line->n_redirs; ++i) {
+        const struct redir *r = &line->redirs[i];
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%zu:%i:%i:%i", r->cmd, r->fd, r->kind, r->target);
+        err |= key_add_str(key, buf);
+        if (r->kind == REDIR_INPUT) err |= key_add_file(key, r->file);
+        else if (r->file != NULL) err |= key_add_str(key, r->file);
+    }
+
+    if (memo_env != NULL) {
+        char *names = strdup(memo_env);
+        if (names == NULL) return -1;
+        for (char *save, *name = strtok_r(names, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+            const char *value = getenv(name);
+            err |= key_add_str(key, name);
+            err |= value != NULL ? key_add_str(key, value) : key_add(key, "", 1);
+            err |= key_add(key, value != NULL ? "=" : "-", 1);
+        }
+        free(names);
+    }
+    return err ? -1 : 0;
+}
+
+/**
+ * Copy the end of a file to a descriptor
+ * @param in The file
+ * @param off The offset of the first byte to copy
+ * @param out The destination
+ * @return 0 on success, -1 on failure
+ */
+static int copy_output(int in, off_t off, int out) {
+    struct stat st;
+    if (fstat(in, &st) == -1) return -1;
+    while (off < st.st_size) {
+        ssize_t n = sendfile(out, in, &off, st.st_size - off);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && (errno == EINVAL || errno == ENOSYS)) break;
+        if (n <= 0) return -1;
+    }
+
+    // sendfile() can't write to every kind of file
+    char buf[COPY_BUF_LEN];
+    while (off < st.st_size) {
+        ssize_t n = pread(in, buf, sizeof(buf), off);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        for (ssize_t done = 0; done < n;) {
+            ssize_t w = write(out, buf + done, n - done);
+            if (w == -1 && errno == EINTR) continue;
+            if (w <= 0) return -1;
+            done += w;
+        }
+        off += n;
+    }
+    return 0;
+}
+
+/**
+ * Launch a line and wait for all its processes
+ * @param line The line
+ * @param io The default streams of the line
+ * @return The status of its last command, as returned by waitpid(), -1 if it couldn't be launched
+ */
+static int run_and_wait(const struct line *line, const struct exec_io *io) {
+    sigset_t chld, old;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &old);
+
+    pid_t pids[MAX_PIDS];
+    int n_pids = launch_line(line, io, pids);
+    int status = n_pids == -1 ? -1 : 0;
+    for (int i = 0; i < n_pids; ++i) {
+        int stat;
+        if (waitpid(pids[i], &stat, 0) == pids[i] && i == n_pids - 1) status = stat;
+    }
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return status;
+}
+
+/**
+ * Compare the last uses of two results, for qsort()
+ */
+static int compare_used(const void *a, const void *b) {
+    const struct memo_entry *x = a, *y = b;
+    if (x->used.tv_sec != y->used.tv_sec) return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+    if (x->used.tv_nsec != y->used.tv_nsec) return x->used.tv_nsec < y->used.tv_nsec ? -1 : 1;
+    return 0;
+}
+
+/**
+ * Remove the least recently used results until they fit in the maximal size
+ */
+static void evict(void) {
+    int fd = dup(memo_fd);
+    DIR *dir = fd != -1 ? fdopendir(fd) : NULL;
+    if (dir == NULL) {
+        if (fd != -1) close(fd);
+        return;
+    }
+
+    struct memo_entry *entries = NULL;
+    size_t n_entries = 0, cap = 0;
+    off_t total = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        struct stat st;
+        if (strlen(ent->d_name) != NAME_LEN || fstatat(memo_fd, ent->d_name, &st, 0) == -1) continue;
+        if (n_entries == cap) {
+            cap = cap ? cap * 2 : 256;
+            struct memo_entry *more = realloc(entries, cap * sizeof(struct memo_entry));
+            if (more == NULL) break;
+            entries = more;
+        }
+        strcpy(entries[n_entries].name, ent->d_name);
+        entries[n_entries].size = st.st_size;
+        entries[n_entries].used = st.st_mtim;
+        ++n_entries;
+        total += st.st_size;
+    }
+    closedir(dir);
+
+    if ((size_t) total > memo_max) {
+        qsort(entries, n_entries, sizeof(struct memo_entry), compare_used);
+        for (size_t i = 0; i < n_entries && (size_t) total > memo_max; ++i) {
+            if (unlinkat(memo_fd, entries[i].name, 0) == 0) total -= entries[i].size;
+        }
+    }
+    free(entries);
+}
+
+/**
+ * Write the output of a stored result, if it is the result of a key
+ * @param name The name of the result
+ * @param key The key of the line
+ * @param out The destination of the output
+ * @param status Retrieves the exit status of the line
+ * @return true if the result was found
+ */
+static bool replay(const char *name, const struct memo_key *key, int out, int *status) {
+    int fd = openat(memo_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+
+    // Another key with the same hash is a miss
+    struct memo_header header;
+    char *stored = malloc(key->len + 1);
+    bool found = stored != NULL
+            && pread(fd, &header, sizeof(header), 0) == sizeof(header)
+            && memcmp(header.magic, MEMO_MAGIC, sizeof(header.magic)) == 0
+            && header.key_len == key->len
+            && pread(fd, stored, key->len, sizeof(header)) == (ssize_t) key->len
+            && memcmp(stored, key->data, key->len) == 0;
+    free(stored);
+
+    if (found) {
+        // The modification time tells the last use to the eviction
+        utimensat(memo_fd, name, NULL, 0);
+        if (copy_output(fd, sizeof(header) + key->len, out) == -1) perror("cached: write failed");
+        *status = header.status;
+    }
+    close(fd);
+    return found;
+}
+
+int memo_init(const char *dir, size_t max_bytes, const char *env) {
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        perror("Failed to create the result cache");
+        return -1;
+    }
+    memo_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (memo_fd == -1) {
+        perror("Failed to open the result cache");
+        return -1;
+    }
+    memo_dir = strdup(dir);
+    memo_env = env != NULL ? strdup(env) : NULL;
+    if (memo_dir == NULL || (env != NULL && memo_env == NULL)) {
+        fprintf(stderr, "Memory allocation failure\n");
+        return -1;
+    }
+    memo_max = max_bytes;
+    return 0;
+}
+
+int cached(const struct line *line) {
+    if (line->background) {
+        fprintf(stderr, "cached can't be run in the background\n");
+        return 1;
+    }
+    if (line->cmds[0].n_args < 2) {
+        fprintf(stderr, "Usage: cached COMMAND [ARG...]\n");
+        return 1;
+    }
+    for (size_t i = 0; i < line->n_redirs; ++i) {
+        const struct redir *r = &line->redirs[i];
+        if (r->cmd == line->n_cmds - 1 && (r->kind == REDIR_TEE || r->kind == REDIR_TEE_APPEND)) {
+            fprintf(stderr, "cached: the output can only go to a single file\n");
+            return 1;
+        }
+    }
+
+    // The copy of the line runs without "cached"
+    struct line li;
+    line_init(&li);
+    if (line_dup(&li, line) == -1) {
+        fprintf(stderr, "Memory allocation failure\n");
+        return 1;
+    }
+    ++li.cmds[0].args;
+    --li.cmds[0].n_args;
+
+    if (memo_fd == -1) {
+        int stat = run_and_wait(&li, NULL);
+        line_reset(&li);
+        if (stat == -1) return 1;
+        return WIFEXITED(stat) ? WEXITSTATUS(stat) : 128 + WTERMSIG(stat);
+    }
+
+    // The output is written by the shell, from the stored result
+    int out = STDOUT_FILENO;
+    if (li.file_output != NULL) {
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (li.file_output_append ? O_APPEND : O_TRUNC);
+        out = open(li.file_output, flags, 0644);
+        if (out == -1) {
+            perror("cached: failed to open the output");
+            line_reset(&li);
+            return 1;
+        }
+        li.file_output = NULL;
+    }
+    else {
+        fflush(stdout);
+    }
+
+    int status = 1;
+    struct memo_key key = { .data = NULL, .len = 0, .cap = 0 };
+    char name[NAME_LEN + 1];
+    char *tmp_path = NULL;
+    int tmp = -1;
+    bool published = false;
+    if (build_key(&key, &li) == -1) {
+        fprintf(stderr, "Memory allocation failure\n");
+        goto end;
+    }
+    snprintf(name, sizeof(name), "%016" PRIx64, line_hash(key.data, key.len));
+    if (replay(name, &key, out, &status)) goto end;
+
+    // Miss : the output is stored in a temporary file, published once complete
+    tmp_path = malloc(strlen(memo_dir) + sizeof("/.tmp-XXXXXX"));
+    if (tmp_path == NULL) {
+        fprintf(stderr, "Memory allocation failure\n");
+        goto end;
+    }
+    sprintf(tmp_path, "%s/.tmp-XXXXXX", memo_dir);
+    tmp = mkostemp(tmp_path, O_CLOEXEC);
+    struct memo_header header = { .status = 0, .key_len = key.len };
+    memcpy(header.magic, MEMO_MAGIC, sizeof(header.magic));
+    if (
+            tmp == -1
+            || write(tmp, &header, sizeof(header)) != sizeof(header)
+            || write(tmp, key.data, key.len) != (ssize_t) key.len
+    ) {
+        perror("cached: failed to store the result");
+        goto end;
+    }
+
+    struct exec_io io = { .in = -1, .out = tmp, .err = -1 };
+    int stat = run_and_wait(&li, &io);
+    if (stat == -1) goto end;
+    status = WIFEXITED(stat) ? WEXITSTATUS(stat) : 128 + WTERMSIG(stat);
+    if (copy_output(tmp, sizeof(header) + key.len, out) == -1) perror("cached: write failed");
+
+    // A line interrupted by a signal may have an incomplete output
+    header.status = status;
+    if (
+            WIFEXITED(stat)
+            && pwrite(tmp, &header, sizeof(header), 0) == sizeof(header)
+            && renameat(memo_fd, strrchr(tmp_path, '/') + 1, memo_fd, name) == 0
+    ) {
+        published = true;
+        evict();
+    }
+
+end:
+    if (tmp != -1) {
+        close(tmp);
+        if (!published) unlink(tmp_path);
+    }
+    free(tmp_path);
+    free(key.data);
+    if (out != STDOUT_FILENO) close(out);
+    line_reset(&li);
+    return status;
+}
@@ -0,0 +1,41 @@
+#ifndef MEMO_H
+#define MEMO_H
+
+#include <stddef.h>
+
+#include "cmdline.h"
+
+#define DEFAULT_MEMO_MAX (256 * 1024 * 1024) // size of the stored results, in bytes
+
+/**
+ * Set up the store of the results of the cached command lines
+ *
+ * @param dir directory of the results, created if needed
+ * @param max_bytes size of the results kept, the least recently used ones are removed above it
+ * @param env comma-separated names of the environment variables the commands depend on, NULL
+ * for none
+ *
+ * @return 0 on success, -1 on failure
+ */
+int memo_init(const char *dir, size_t max_bytes, const char *env);
+
+/**
+ * The cached builtin : cached COMMAND LINE
+ *
+ * The result of the line is identified by the arguments of its commands, the working directory,
+ * the values of the environment variables given to memo_init(), and the inode, size and
+ * modification time of its input files. If a result of the same line is stored, its standard
+ * output is written again and its exit status returned, without running anything. Otherwise the
+ * line runs with its standard output stored, and written once the line is done. Error outputs
+ * are never stored, nor the results of lines killed by a signal
+ *
+ * Without memo_init(), the line just runs
+ *
+ * @param line The line, in the foreground, starting with "cached". The output of its last
+ * command can't go to several destinations
+ *
+ * @return the exit status of the line, 128 + N if its last command was killed by the signal N
+ */
+int cached(const struct line *line);
+
+#endif
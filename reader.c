@@ -0,0 +1,195 @@
+#include "reader.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define BUFLEN 512 // same limit as the command lines read by the shell
+
+struct slot {
+    struct line li;
+    const struct line *shared; // line of the cache, NULL if the line is in "li"
+    int err;
+    bool too_long; // the line was dropped, it is longer than BUFLEN
+    struct line_ctx ctx; // error of the parsing, printed by the shell when it takes the line
+    bool eof;
+    size_t number; // number of the line in the input, from 1
+    uint64_t hash; // hash of the text of the line, without the '\n'
+};
+
+static FILE *input = NULL;
+static bool input_seekable = false; // reading ahead of the shell can't block
+static struct line_cache *line_cache = NULL;
+static size_t n_read = 0; // lines read from the input
+static size_t last_number = 0; // line returned by reader_next()
+static uint64_t last_hash = 0;
+
+static struct slot *ring = NULL; // NULL if the lines aren't read ahead
+static size_t ring_size;
+static size_t head = 0; // next slot to take
+static size_t count = 0; // number of slots filled
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t not_full = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t not_empty = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Read and parse the next line of the input into a slot, without printing anything
+ * @param slot The slot to fill, its line must have been initialized
+ */
+static void read_line(struct slot *slot) {
+    char buf[BUFLEN + 1]; // +1 to add the '\n' missing at the end of the input
+
+    slot->shared = NULL;
+    slot->err = 0;
+    slot->too_long = false;
+    line_ctx_init(&slot->ctx);
+    slot->eof = fgets(buf, BUFLEN, input) == NULL;
+    if (slot->eof) return;
+
+    size_t len = strlen(buf);
+    slot->number = ++n_read;
+    slot->hash = line_hash(buf, buf[len - 1] == '\n' ? len - 1 : len);
+    if (buf[len - 1] != '\n') {
+        if (len < BUFLEN - 1) {
+            // The last line of the input
+            buf[len] = '\n';
+            buf[len + 1] = '\0';
+        }
+        else {
+            slot->too_long = true;
+            int c;
+            do {
+                c = fgetc(input);
+            } while (c != '\n' && c != EOF);
+            slot->err = -1;
+            return;
+        }
+    }
+
+    if (line_cache != NULL) slot->err = line_cache_parse_r(line_cache, buf, &slot->shared, &slot->ctx);
+    else slot->err = line_parse_r(&slot->li, buf, &slot->ctx);
+    if (slot->err) {
+        line_reset(&slot->li);
+        slot->shared = NULL;
+    }
+}
+
+/**
+ * Fill the next free slot of the ring buffer, waiting for one if it is full
+ */
+static void ring_push(const struct slot *slot) {
+    pthread_mutex_lock(&lock);
+    while (count == ring_size) pthread_cond_wait(&not_full, &lock);
+    ring[(head + count) % ring_size] = *slot;
+    ++count;
+    pthread_cond_signal(&not_empty);
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Main loop of the reader thread
+ */
+static void *reader_main(void *arg) {
+    (void) arg;
+    struct slot slot;
+
+    for (;;) {
+        line_init(&slot.li);
+        read_line(&slot);
+        ring_push(&slot);
+        if (slot.eof) return NULL;
+    }
+}
+
+int reader_init(FILE *in, size_t depth, struct line_cache *cache) {
+    input = in;
+    line_cache = cache;
+
+    // A stream in memory has no file descriptor
+    struct stat st;
+    input_seekable = fileno(input) == -1 || (fstat(fileno(input), &st) == 0 && S_ISREG(st.st_mode));
+    if (depth == 0) return 0;
+
+    ring_size = depth;
+    ring = calloc(ring_size, sizeof(struct slot));
+    if (ring == NULL) {
+        fprintf(stderr, "Memory allocation failure\n");
+        return -1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, reader_main, NULL)) {
+        fprintf(stderr, "Failed to start the reader thread\n");
+        free(ring);
+        ring = NULL;
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+int reader_next(struct line *li, const struct line **parsed) {
+    struct slot slot;
+
+    if (ring == NULL) {
+        slot.li = *li;
+        read_line(&slot);
+    }
+    else {
+        pthread_mutex_lock(&lock);
+        while (count == 0) pthread_cond_wait(&not_empty, &lock);
+        slot = ring[head];
+
+        // The end of the input stays in the ring buffer for the next calls
+        if (!slot.eof) {
+            head = (head + 1) % ring_size;
+            --count;
+            pthread_cond_signal(&not_full);
+        }
+        pthread_mutex_unlock(&lock);
+    }
+
+    if (slot.eof) return 1;
+    last_number = slot.number;
+    last_hash = slot.hash;
+
+    // Printed here rather than by the reader thread, after the output of the previous lines
+    if (slot.too_long) fprintf(stderr, "The command line is too long\n");
+    else if (slot.err) fprintf(stderr, "Error while parsing: %s\n", slot.ctx.message);
+
+    // The line moves from the slot to "li"
+    *li = slot.li;
+    *parsed = slot.shared != NULL ? slot.shared : li;
+    return slot.err ? -1 : 0;
+}
+
+bool reader_at_end(void) {
+    if (!input_seekable) return false;
+
+    if (ring == NULL) {
+        int c = fgetc(input);
+        if (c == EOF) return true;
+        ungetc(c, input);
+        return false;
+    }
+
+    pthread_mutex_lock(&lock);
+    while (count == 0) pthread_cond_wait(&not_empty, &lock);
+    bool eof = ring[head].eof;
+    pthread_mutex_unlock(&lock);
+    return eof;
+}
+
+void reader_position(size_t *number, uint64_t *hash) {
+    *number = last_number;
+    *hash = last_hash;
+}
+
+void reader_release(struct line *li, const struct line *parsed) {
+    if (parsed != li) line_cache_release(line_cache, parsed);
+    line_reset(li);
+}
@@ -0,0 +1,70 @@
+#ifndef READER_H
+#define READER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "cmdline.h"
+
+/**
+ * Set up how the command lines of the input are read and parsed
+ *
+ * If "depth" isn't 0, a thread reads and parses up to "depth" lines ahead of the shell and
+ * keeps them in a ring buffer, so the next command line is ready as soon as the previous one
+ * is finished. The input must not be read by anything else then
+ *
+ * @param in stream the command lines are read from
+ * @param depth number of lines parsed ahead, 0 to read each line when it is needed
+ * @param cache cache of parsed lines to use, NULL to parse every line
+ *
+ * @return 0 on success, -1 on failure
+ */
+int reader_init(FILE *in, size_t depth, struct line_cache *cache);
+
+/**
+ * Get the next command line of the input
+ *
+ * "li" must have been initialized or reset. The parsed line is either stored in "li",
+ * or shared with the cache of parsed lines : it must not be modified, and must be
+ * released with reader_release()
+ *
+ * @param li pointer on a struct line the line may be stored in
+ * @param parsed retrieves a pointer on the parsed line
+ *
+ * @return 0 on success, -1 if the line isn't valid, 1 at the end of the input
+ */
+int reader_next(struct line *li, const struct line **parsed);
+
+/**
+ * Check if the last line was read
+ *
+ * Only regular files and streams in memory are checked, reading the input must not block the
+ * shell before it runs the line it already has
+ *
+ * @return true if the next call of reader_next() is known to return the end of the input
+ */
+bool reader_at_end(void);
+
+/**
+ * Identify the last line obtained with reader_next()
+ *
+ * Lines too long to be parsed are counted too, so the numbers are the ones of the input
+ *
+ * @param number retrieves the number of the line in the input, from 1
+ * @param hash retrieves the hash of the text of the line, without the '\n'
+ */
+void reader_position(size_t *number, uint64_t *hash);
+
+/**
+ * Release a line obtained with reader_next()
+ *
+ * "li" is reset and can be given to reader_next() again
+ *
+ * @param li pointer on the struct line given to reader_next()
+ * @param parsed pointer on the parsed line
+ */
+void reader_release(struct line *li, const struct line *parsed);
+
+#endif
@@ -0,0 +1,525 @@
+#define _GNU_SOURCE // accept4()
+
+#include "server.h"
+#include "cmdline.h"
+#include "exec.h"
+#include "zygote.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define MAX_CLIENTS 256
+#define MAX_EVENTS 64
+#define BUFLEN 512 // same limit as the command lines read by the shell
+#define READ_BUF_LEN 4096
+#define MAX_PENDING_OUTPUT 65536 // stop reading the output of the commands above this
+
+enum watch_kind {
+    WATCH_LISTEN,
+    WATCH_SIGNAL,
+    WATCH_CLIENT,
+    WATCH_STDOUT,
+    WATCH_STDERR
+};
+
+struct client;
+
+/**
+ * What a file descriptor registered in epoll stands for
+ */
+struct watch {
+    enum watch_kind kind;
+    struct client *client;
+};
+
+struct client {
+    int sock;
+    bool closed; // the client closed the connection
+    bool released; // freed at the end of the current epoll batch
+
+    // Bytes received, not consumed yet
+    char in[sizeof(struct fish_request) + BUFLEN];
+    size_t in_len;
+
+    // Frames waiting to be sent
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+
+    // Command line currently running
+    bool queued;
+    bool running;
+    pid_t pids[MAX_PIDS];
+    size_t n_pids; // PIDs not reaped yet
+    pid_t last_pid;
+    int outputs[2]; // read ends of the stdout and stderr pipes, -1 if closed
+    struct fish_status status;
+
+    struct watch w_sock;
+    struct watch w_outputs[2];
+    struct client *next_queued;
+};
+
+static int epfd;
+static int null_fd;
+static struct client *clients[MAX_CLIENTS];
+static size_t max_running;
+static size_t n_running = 0;
+static struct client *queue_head = NULL;
+static struct client *queue_tail = NULL;
+
+/**
+ * Change the events watched for a file descriptor
+ */
+static void watch_set(int fd, struct watch *w, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.ptr = w };
+    epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+/**
+ * Stop watching a file descriptor and close it
+ *
+ * Helpers of the pool may hold a copy of the file descriptor, so closing it is not enough
+ */
+static void watch_close(int fd) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+}
+
+/**
+ * Start watching a file descriptor
+ */
+static int watch_add(int fd, struct watch *w, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.ptr = w };
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/**
+ * Update the events watched for a client, depending on its buffers
+ */
+static void client_update_watches(struct client *c) {
+    bool full = c->out_len >= MAX_PENDING_OUTPUT;
+
+    uint32_t events = 0;
+    if (!c->closed && c->in_len < sizeof(c->in)) events |= EPOLLIN;
+    if (c->out_len > 0) events |= EPOLLOUT;
+    watch_set(c->sock, &c->w_sock, events);
+
+    // Backpressure : the commands block when the client does not read fast enough
+    for (int i = 0; i < 2; ++i) {
+        if (c->outputs[i] != -1) watch_set(c->outputs[i], &c->w_outputs[i], full ? 0 : EPOLLIN);
+    }
+}
+
+/**
+ * Append a frame to the frames waiting to be sent to a client
+ */
+static void client_push_frame(struct client *c, uint32_t type, const void *payload, uint32_t len) {
+    struct fish_frame frame = { .type = type, .len = len };
+    size_t needed = c->out_len + sizeof(frame) + len;
+    if (needed > c->out_cap) {
+        size_t cap = c->out_cap ? c->out_cap : READ_BUF_LEN;
+        while (cap < needed) cap *= 2;
+        char *out = realloc(c->out, cap);
+        if (out == NULL) {
+            fprintf(stderr, "Memory allocation failure\n");
+            return;
+        }
+        c->out = out;
+        c->out_cap = cap;
+    }
+    memcpy(c->out + c->out_len, &frame, sizeof(frame));
+    memcpy(c->out + c->out_len + sizeof(frame), payload, len);
+    c->out_len = needed;
+}
+
+/**
+ * Send as many waiting frames as possible without blocking
+ */
+static void client_flush(struct client *c) {
+    size_t sent = 0;
+    while (sent < c->out_len) {
+        ssize_t n = send(c->sock, c->out + sent, c->out_len - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n == -1) {
+            // The client is gone, drop what it did not read
+            c->closed = true;
+            sent = c->out_len;
+            break;
+        }
+        sent += n;
+    }
+    memmove(c->out, c->out + sent, c->out_len - sent);
+    c->out_len -= sent;
+}
+
+/**
+ * Release a client once it is closed and nothing is running for it
+ * @return true if the client has been released
+ */
+static bool client_release_if_done(struct client *c) {
+    if (!c->closed || c->running || c->queued) return false;
+    if (!c->released) watch_close(c->sock);
+    c->released = true;
+    return true;
+}
+
+/**
+ * Free the released clients, once none of their events can be pending
+ */
+static void free_released_clients(void) {
+    for (size_t i = 0; i < MAX_CLIENTS; ++i) {
+        if (clients[i] == NULL || !clients[i]->released) continue;
+        free(clients[i]->out);
+        free(clients[i]);
+        clients[i] = NULL;
+    }
+}
+
+/**
+ * Parse and launch the next request of a client
+ */
+static void client_start(struct client *c) {
+    struct fish_request req;
+    memcpy(&req, c->in, sizeof(req));
+
+    char buf[BUFLEN + 1];
+    memcpy(buf, c->in + sizeof(req), req.len);
+    buf[req.len] = '\0';
+
+    size_t consumed = sizeof(req) + req.len;
+    memmove(c->in, c->in + consumed, c->in_len - consumed);
+    c->in_len -= consumed;
+
+    memset(&c->status, 0, sizeof(c->status));
+    c->outputs[0] = -1;
+    c->outputs[1] = -1;
+    c->n_pids = 0;
+    c->last_pid = -1;
+
+    struct line li;
+    struct line_ctx ctx;
+    line_init(&li);
+    line_ctx_init(&ctx);
+    if (line_parse_r(&li, buf, &ctx)) {
+        line_reset(&li);
+        if (req.flags & FISH_REQUEST_CAPTURE) {
+            char msg[sizeof(ctx.message) + 64];
+            int n = snprintf(msg, sizeof(msg), "Error while parsing: %s\n", ctx.message);
+            client_push_frame(c, FISH_FRAME_STDERR, msg, n);
+        }
+        else {
+            fprintf(stderr, "Error while parsing: %s\n", ctx.message);
+        }
+        c->status.parse_error = 1;
+        client_push_frame(c, FISH_FRAME_STATUS, &c->status, sizeof(c->status));
+        return;
+    }
+
+    // Capture the output of the commands in pipes
+    struct exec_io io = { .in = null_fd, .out = -1, .err = -1 };
+    int writers[2] = { -1, -1 };
+    if (req.flags & FISH_REQUEST_CAPTURE) {
+        for (int i = 0; i < 2; ++i) {
+            int pipes[2];
+            if (pipe2(pipes, O_CLOEXEC) == -1) {
+                perror("pipe failed");
+                continue;
+            }
+            c->outputs[i] = pipes[0];
+            writers[i] = pipes[1];
+            watch_add(c->outputs[i], &c->w_outputs[i], EPOLLIN);
+        }
+        io.out = writers[0];
+        io.err = writers[1];
+    }
+
+    int n_pids = launch_line(&li, &io, c->pids);
+    for (int i = 0; i < 2; ++i) {
+        if (writers[i] != -1) close(writers[i]);
+    }
+
+    // Background commands are not waited for
+    if (n_pids > 0 && !li.background) {
+        c->n_pids = n_pids;
+        c->last_pid = c->pids[n_pids - 1];
+    }
+    line_reset(&li);
+
+    c->running = true;
+    ++n_running;
+}
+
+/**
+ * Check whether a complete request has been received
+ */
+static bool client_has_request(struct client *c) {
+    if (c->in_len < sizeof(struct fish_request)) return false;
+    struct fish_request req;
+    memcpy(&req, c->in, sizeof(req));
+    return c->in_len >= sizeof(req) + req.len;
+}
+
+/**
+ * Send the status of the running command line of a client once it is completely finished
+ * @return true if the command line was finished
+ */
+static bool client_finish(struct client *c) {
+    if (!c->running || c->n_pids > 0 || c->outputs[0] != -1 || c->outputs[1] != -1) return false;
+
+    client_push_frame(c, FISH_FRAME_STATUS, &c->status, sizeof(c->status));
+    c->running = false;
+    --n_running;
+    return true;
+}
+
+/**
+ * Start the next requests of a client, or queue it if too many command lines are running
+ */
+static void client_next(struct client *c) {
+    while (!c->closed && !c->running && !c->queued && client_has_request(c)) {
+        if (n_running >= max_running) {
+            c->queued = true;
+            c->next_queued = NULL;
+            if (queue_tail) queue_tail->next_queued = c;
+            else queue_head = c;
+            queue_tail = c;
+            return;
+        }
+        client_start(c);
+        client_finish(c);
+    }
+}
+
+/**
+ * Give the free slots to the queued clients
+ */
+static void dispatch_queue(void) {
+    while (queue_head != NULL && n_running < max_running) {
+        struct client *next = queue_head;
+        queue_head = next->next_queued;
+        if (queue_head == NULL) queue_tail = NULL;
+        next->queued = false;
+        client_next(next);
+        client_flush(next);
+        if (!client_release_if_done(next)) client_update_watches(next);
+    }
+}
+
+static void handle_accept(int listen_fd) {
+    int sock = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (sock == -1) {
+        perror("accept failed");
+        return;
+    }
+
+    size_t slot = 0;
+    while (slot < MAX_CLIENTS && clients[slot] != NULL) ++slot;
+    struct client *c = slot < MAX_CLIENTS ? calloc(1, sizeof(struct client)) : NULL;
+    if (c == NULL) {
+        fprintf(stderr, "Too much clients. Max: %i\n", MAX_CLIENTS);
+        close(sock);
+        return;
+    }
+
+    c->sock = sock;
+    c->outputs[0] = -1;
+    c->outputs[1] = -1;
+    c->w_sock = (struct watch) { .kind = WATCH_CLIENT, .client = c };
+    c->w_outputs[0] = (struct watch) { .kind = WATCH_STDOUT, .client = c };
+    c->w_outputs[1] = (struct watch) { .kind = WATCH_STDERR, .client = c };
+    clients[slot] = c;
+    watch_add(sock, &c->w_sock, EPOLLIN);
+}
+
+static void handle_client(struct client *c, uint32_t events) {
+    if (events & EPOLLIN) {
+        ssize_t n = recv(c->sock, c->in + c->in_len, sizeof(c->in) - c->in_len, MSG_DONTWAIT);
+        if (n > 0) c->in_len += n;
+        else if (n == 0 || (errno != EINTR && errno != EAGAIN)) c->closed = true;
+
+        // A request too long for the shell can never be parsed
+        struct fish_request req;
+        if (c->in_len >= sizeof(req)) {
+            memcpy(&req, c->in, sizeof(req));
+            if (req.len >= BUFLEN) {
+                fprintf(stderr, "The command line is too long\n");
+                c->closed = true;
+            }
+        }
+        if (!c->closed) client_next(c);
+    }
+    if (events & (EPOLLHUP | EPOLLERR)) c->closed = true;
+
+    client_flush(c);
+    if (!client_release_if_done(c)) client_update_watches(c);
+}
+
+static void handle_output(struct client *c, int stream) {
+    char buf[READ_BUF_LEN];
+    ssize_t n = read(c->outputs[stream], buf, sizeof(buf));
+    if (n == -1 && errno == EINTR) return;
+
+    if (n > 0) {
+        if (!c->closed) {
+            client_push_frame(c, stream == 0 ? FISH_FRAME_STDOUT : FISH_FRAME_STDERR, buf, n);
+        }
+    }
+    else {
+        watch_close(c->outputs[stream]);
+        c->outputs[stream] = -1;
+        if (client_finish(c)) {
+            client_next(c);
+            dispatch_queue();
+        }
+    }
+
+    client_flush(c);
+    if (!client_release_if_done(c)) client_update_watches(c);
+}
+
+/**
+ * Reap the ended commands and account their resource usage
+ */
+static void handle_children(void) {
+    int stat;
+    pid_t pid;
+    struct rusage ru;
+    while ((pid = wait4(-1, &stat, WNOHANG, &ru)) > 0) {
+        for (size_t i = 0; i < MAX_CLIENTS; ++i) {
+            struct client *c = clients[i];
+            if (c == NULL || c->released || !c->running || c->n_pids == 0) continue;
+
+            bool found = false;
+            for (size_t j = 0; j < c->n_pids && !found; ++j) {
+                if (c->pids[j] != pid) continue;
+                c->pids[j] = c->pids[--c->n_pids];
+                found = true;
+            }
+            if (!found) continue;
+
+            c->status.utime_usec += ru.ru_utime.tv_sec * 1000000LL + ru.ru_utime.tv_usec;
+            c->status.stime_usec += ru.ru_stime.tv_sec * 1000000LL + ru.ru_stime.tv_usec;
+            if (ru.ru_maxrss > c->status.maxrss_kb) c->status.maxrss_kb = ru.ru_maxrss;
+            if (pid == c->last_pid) c->status.status = stat;
+
+            if (client_finish(c)) {
+                client_next(c);
+                dispatch_queue();
+            }
+            client_flush(c);
+            if (!client_release_if_done(c)) client_update_watches(c);
+            break;
+        }
+    }
+}
+
+int server_listen(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "The socket path is too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (
+            listen_fd == -1
+            || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+            || listen(listen_fd, SOMAXCONN) == -1
+    ) {
+        perror("Failed to listen on the socket");
+        if (listen_fd != -1) close(listen_fd);
+        return -1;
+    }
+    return listen_fd;
+}
+
+int serve_socket(int listen_fd, size_t max_jobs) {
+    max_running = max_jobs > 0 ? max_jobs : 1;
+
+    // Handle the signals through epoll
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int sigfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+
+    null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct watch w_listen = { .kind = WATCH_LISTEN, .client = NULL };
+    struct watch w_signal = { .kind = WATCH_SIGNAL, .client = NULL };
+    watch_add(listen_fd, &w_listen, EPOLLIN);
+    watch_add(sigfd, &w_signal, EPOLLIN);
+
+    bool stop = false;
+    while (!stop) {
+        zygote_refill();
+
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) {
+            perror("epoll_wait failed");
+            break;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            struct watch *w = events[i].data.ptr;
+            if (w->client != NULL && w->client->released) continue;
+            switch (w->kind) {
+                case WATCH_LISTEN:
+                    handle_accept(listen_fd);
+                    break;
+                case WATCH_SIGNAL: {
+                    struct signalfd_siginfo info;
+                    while (read(sigfd, &info, sizeof(info)) == sizeof(info)) {
+                        if (info.ssi_signo != SIGCHLD) stop = true;
+                    }
+                    handle_children();
+                    break;
+                }
+                case WATCH_CLIENT:
+                    handle_client(w->client, events[i].events);
+                    break;
+                case WATCH_STDOUT:
+                case WATCH_STDERR:
+                    handle_output(w->client, w->kind == WATCH_STDOUT ? 0 : 1);
+                    break;
+            }
+        }
+        free_released_clients();
+    }
+
+    close(epfd);
+    close(sigfd);
+    close(null_fd);
+    return 0;
+}
+
+int serve(const char *path, size_t max_jobs) {
+    int listen_fd = server_listen(path);
+    if (listen_fd == -1) return -1;
+
+    int err = serve_socket(listen_fd, max_jobs);
+    close(listen_fd);
+    unlink(path);
+    return err;
+}
@@ -0,0 +1,74 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Protocol of the server, every integer is in the byte order of the host
+ *
+ * The client sends requests : a struct fish_request followed by "len" bytes of command line.
+ * For each request, in order, the server sends back zero or more output frames then one
+ * status frame. A frame is a struct fish_frame followed by "len" bytes of payload.
+ */
+
+#define FISH_REQUEST_CAPTURE 1 // send the output of the commands back to the client
+
+#define FISH_FRAME_STDOUT 1 // payload : bytes written by the commands on their standard output
+#define FISH_FRAME_STDERR 2 // payload : bytes written by the commands on their error output
+#define FISH_FRAME_STATUS 3 // payload : a struct fish_status
+
+struct fish_request {
+    uint32_t len;
+    uint32_t flags;
+};
+
+struct fish_frame {
+    uint32_t type;
+    uint32_t len;
+};
+
+struct fish_status {
+    int32_t parse_error; // 1 if the command line isn't valid, nothing was executed
+    int32_t status; // status of the last command, as returned by waitpid()
+    int64_t utime_usec; // user time of all the commands
+    int64_t stime_usec; // system time of all the commands
+    int64_t maxrss_kb; // biggest resident set size of the commands
+};
+
+/**
+ * Create a Unix socket listening for the clients of a server
+ *
+ * An existing file at "path" is replaced
+ *
+ * @param path path of the socket to create
+ *
+ * @return the listening socket, -1 on failure
+ */
+int server_listen(const char *path);
+
+/**
+ * Run the shell as a server accepting clients on a listening socket
+ *
+ * Returns when SIGINT or SIGTERM is received, the socket is left open
+ *
+ * @param listen_fd socket created by server_listen()
+ * @param max_jobs maximal number of command lines running at the same time
+ *
+ * @return 0 on success, -1 on failure
+ */
+int serve_socket(int listen_fd, size_t max_jobs);
+
+/**
+ * Run the shell as a server listening on a Unix socket
+ *
+ * Returns when SIGINT or SIGTERM is received
+ *
+ * @param path path of the socket to create
+ * @param max_jobs maximal number of command lines running at the same time
+ *
+ * @return 0 on success, -1 on failure
+ */
+int serve(const char *path, size_t max_jobs);
+
+#endif
@@ -0,0 +1,713 @@
+#define _GNU_SOURCE // mkostemp(), memrchr()
+
+#include "sort.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SORT_MIN_SLICE 4096 // fewer lines aren't worth a thread
+#define SORT_READ_LEN 65536
+
+/**
+ * A line of the input, without its newline
+ */
+struct sort_line {
+    const char *text;
+    size_t len;
+};
+
+/**
+ * Sorted lines being merged : a slice of a part of the input in memory, or a run in a file
+ */
+struct source {
+    struct sort_line line; // current line
+    struct sort_line *next, *end; // lines left in the slice
+    FILE *file; // NULL for a slice
+    char *buf; // current line of the run
+    size_t cap;
+};
+
+/**
+ * Where merged lines go : the output of the builtin, or a run in a file
+ */
+struct sink {
+    FILE *file; // NULL for the output
+    sort_write_fn write;
+    void *ctx;
+    bool failed; // the file couldn't be written
+    char *prev; // last line written, to drop the following equal ones with -u
+    size_t prev_len, prev_cap;
+    bool has_prev;
+};
+
+/**
+ * Part of the input sorted by a thread
+ */
+struct sort_task {
+    const struct sort_opts *opts;
+    struct sort_line *lines, *tmp;
+    size_t n;
+};
+
+/**
+ * Read a positive decimal number
+ * @param s The text, moved after the number
+ * @param n Retrieves the number
+ * @return 0 on success, -1 if there is no number
+ */
+static int parse_count(const char **s, size_t *n) {
+    if (**s < '0' || **s > '9') return -1;
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(*s, &end, 10);
+    if (errno != 0 || v > SIZE_MAX) return -1;
+    *n = v;
+    *s = end;
+    return 0;
+}
+
+/**
+ * Read the ordering options of a key, n and r only
+ * @return 0 on success, -1 on an unsupported option
+ */
+static int parse_key_opts(const char **s, struct sort_key *key, bool *has_opts) {
+    for (; **s != '\0' && **s != ','; ++*s) {
+        if (**s == 'n') key->numeric = true;
+        else if (**s == 'r') key->reverse = true;
+        else return -1;
+        *has_opts = true;
+    }
+    return 0;
+}
+
+/**
+ * Read the key of -k F[.C][OPTS][,F[.C][OPTS]]
+ * @return 0 on success, -1 if it is invalid or unsupported
+ */
+static int parse_key(const char *s, struct sort_key *key, bool *has_opts) {
+    *key = (struct sort_key) { .eword = SIZE_MAX };
+    *has_opts = false;
+
+    size_t n;
+    if (parse_count(&s, &n) == -1 || n == 0) return -1;
+    key->sword = n - 1;
+    if (*s == '.') {
+        ++s;
+        if (parse_count(&s, &n) == -1 || n == 0) return -1;
+        key->schar = n - 1;
+    }
+    if (parse_key_opts(&s, key, has_opts) == -1) return -1;
+    if (*s == '\0') return 0;
+
+    ++s;
+    if (parse_count(&s, &n) == -1 || n == 0) return -1;
+    key->eword = n - 1;
+    if (*s == '.') {
+        ++s;
+        if (parse_count(&s, &key->echar) == -1) return -1;
+    }
+    if (parse_key_opts(&s, key, has_opts) == -1) return -1;
+    return *s == '\0' ? 0 : -1;
+}
+
+/**
+ * Read the size of -S, in KiB without suffix
+ * @return 0 on success, -1 if it is invalid or unsupported
+ */
+static int parse_size(const char *s, size_t *size) {
+    size_t n;
+    if (parse_count(&s, &n) == -1) return -1;
+    size_t unit = 1024;
+    if (*s != '\0') {
+        const char *units = "bKMGT";
+        const char *u = strchr(units, *s);
+        if (u == NULL || s[1] != '\0') return -1;
+        unit = 1;
+        for (const char *p = units; p < u; ++p) unit *= 1024;
+    }
+    if (n == 0 || n > SIZE_MAX / unit) return -1;
+    *size = n * unit;
+    return 0;
+}
+
+int sort_parse(const struct cmd *cmd, struct sort_opts *opts) {
+    if (cmd->n_args == 0 || strcmp(cmd->args[0], "sort") != 0) return -1;
+    memset(opts, 0, sizeof(struct sort_opts));
+    opts->tab = -1;
+    opts->buffer_size = DEFAULT_SORT_BUFFER;
+
+    bool numeric = false;
+    bool key_opts[SORT_MAX_KEYS];
+    size_t i = 1;
+    for (; i < cmd->n_args && cmd->args[i][0] == '-' && cmd->args[i][1] != '\0'; ++i) {
+        const char *a = cmd->args[i];
+        if (strcmp(a, "--") == 0) {
+            ++i;
+            break;
+        }
+        for (size_t j = 1; a[j] != '\0'; ++j) {
+            if (a[j] == 'n') numeric = true;
+            else if (a[j] == 'r') opts->reverse = true;
+            else if (a[j] == 'u') opts->unique = true;
+            else if (a[j] == 't' || a[j] == 'k' || a[j] == 'S') {
+                // The value follows the letter, or is the next argument
+                const char *value = a + j + 1;
+                if (*value == '\0') {
+                    if (++i == cmd->n_args) return -1;
+                    value = cmd->args[i];
+                }
+                if (a[j] == 't') {
+                    if (value[0] == '\0' || value[1] != '\0') return -1;
+                    opts->tab = (unsigned char) value[0];
+                }
+                else if (a[j] == 'k') {
+                    if (opts->n_keys == SORT_MAX_KEYS) return -1;
+                    if (parse_key(value, &opts->keys[opts->n_keys], &key_opts[opts->n_keys]) == -1) return -1;
+                    ++opts->n_keys;
+                }
+                else if (parse_size(value, &opts->buffer_size) == -1) return -1;
+                break;
+            }
+            else return -1;
+        }
+    }
+    // Only the standard input is sorted
+    if (i != cmd->n_args) return -1;
+
+    // Keys without options of their own take the global ones, which otherwise apply to the line
+    if (opts->n_keys == 0 && (numeric || opts->reverse)) {
+        opts->keys[0] = (struct sort_key) { .eword = SIZE_MAX };
+        key_opts[0] = false;
+        opts->n_keys = 1;
+    }
+    for (size_t k = 0; k < opts->n_keys; ++k) {
+        if (key_opts[k]) continue;
+        opts->keys[k].numeric = numeric;
+        opts->keys[k].reverse = opts->reverse;
+    }
+    return 0;
+}
+
+static bool is_blank(char c) {
+    return c == ' ' || c == '\t';
+}
+
+/**
+ * Find where a key starts in a line
+ */
+static const char *key_start(const struct sort_opts *opts, const struct sort_key *key, const struct sort_line *l) {
+    const char *p = l->text, *lim = l->text + l->len;
+    for (size_t word = key->sword; p < lim && word > 0; --word) {
+        if (opts->tab != -1) {
+            while (p < lim && *p != (char) opts->tab) ++p;
+            if (p < lim) ++p;
+        }
+        else {
+            while (p < lim && is_blank(*p)) ++p;
+            while (p < lim && !is_blank(*p)) ++p;
+        }
+    }
+    return (size_t) (lim - p) < key->schar ? lim : p + key->schar;
+}
+
+/**
+ * Find where a key ends in a line
+ */
+static const char *key_end(const struct sort_opts *opts, const struct sort_key *key, const struct sort_line *l) {
+    const char *p = l->text, *lim = l->text + l->len;
+    if (key->eword == SIZE_MAX) return lim;
+
+    // Without character, the whole end field is part of the key
+    size_t word = key->eword + (key->echar == 0);
+    while (p < lim && word-- > 0) {
+        if (opts->tab != -1) {
+            while (p < lim && *p != (char) opts->tab) ++p;
+            if (p < lim && (word > 0 || key->echar > 0)) ++p;
+        }
+        else {
+            while (p < lim && is_blank(*p)) ++p;
+            while (p < lim && !is_blank(*p)) ++p;
+        }
+    }
+    if (key->echar > 0) p = (size_t) (lim - p) < key->echar ? lim : p + key->echar;
+    return p;
+}
+
+/**
+ * Split a number into its sign, its integer digits without leading zeros and its fraction
+ * digits without trailing zeros. Text which isn't a number is 0
+ */
+static void parse_number(const char *p, const char *lim, bool *neg, const char **int_start, size_t *int_len, const char **frac_start, size_t *frac_len) {
+    while (p < lim && is_blank(*p)) ++p;
+    *neg = p < lim && *p == '-';
+    if (*neg) ++p;
+    while (p < lim && *p == '0') ++p;
+    *int_start = p;
+    while (p < lim && *p >= '0' && *p <= '9') ++p;
+    *int_len = p - *int_start;
+
+    *frac_start = p;
+    *frac_len = 0;
+    if (p < lim && *p == '.') {
+        *frac_start = ++p;
+        while (p < lim && *p >= '0' && *p <= '9') ++p;
+        *frac_len = p - *frac_start;
+        while (*frac_len > 0 && (*frac_start)[*frac_len - 1] == '0') --*frac_len;
+    }
+}
+
+/**
+ * Compare two numbers like sort -n
+ */
+static int compare_numbers(const char *a, const char *alim, const char *b, const char *blim) {
+    bool aneg, bneg;
+    const char *ai, *af, *bi, *bf;
+    size_t ail, afl, bil, bfl;
+    parse_number(a, alim, &aneg, &ai, &ail, &af, &afl);
+    parse_number(b, blim, &bneg, &bi, &bil, &bf, &bfl);
+
+    // -0 is 0
+    if (ail == 0 && afl == 0) aneg = false;
+    if (bil == 0 && bfl == 0) bneg = false;
+    if (aneg != bneg) return aneg ? -1 : 1;
+
+    int diff = ail != bil ? (ail < bil ? -1 : 1) : memcmp(ai, bi, ail);
+    if (diff == 0) {
+        size_t common = afl < bfl ? afl : bfl;
+        diff = memcmp(af, bf, common);
+        // The longer fraction ends with a digit other than 0
+        if (diff == 0 && afl != bfl) diff = afl < bfl ? -1 : 1;
+    }
+    return aneg ? -diff : diff;
+}
+
+/**
+ * Compare bytes, a prefix first
+ */
+static int compare_bytes(const char *a, size_t alen, const char *b, size_t blen) {
+    int diff = memcmp(a, b, alen < blen ? alen : blen);
+    if (diff == 0 && alen != blen) diff = alen < blen ? -1 : 1;
+    return diff;
+}
+
+/**
+ * Compare two lines by their keys, then by their bytes unless -u is given
+ */
+static int compare(const struct sort_opts *opts, const struct sort_line *a, const struct sort_line *b) {
+    for (size_t i = 0; i < opts->n_keys; ++i) {
+        const struct sort_key *key = &opts->keys[i];
+        const char *as = key_start(opts, key, a), *ae = key_end(opts, key, a);
+        const char *bs = key_start(opts, key, b), *be = key_end(opts, key, b);
+        if (ae < as) ae = as;
+        if (be < bs) be = bs;
+
+        int diff = key->numeric ? compare_numbers(as, ae, bs, be) : compare_bytes(as, ae - as, bs, be - bs);
+        if (diff != 0) return key->reverse ? -diff : diff;
+    }
+    if (opts->n_keys > 0 && opts->unique) return 0;
+
+    int diff = compare_bytes(a->text, a->len, b->text, b->len);
+    return opts->reverse ? -diff : diff;
+}
+
+/**
+ * Sort lines, keeping the order of the equal ones
+ * @param tmp Room for n lines
+ */
+static void merge_sort(const struct sort_opts *opts, struct sort_line *lines, struct sort_line *tmp, size_t n) {
+    if (n < 16) {
+        for (size_t i = 1; i < n; ++i) {
+            struct sort_line l = lines[i];
+            size_t j = i;
+            for (; j > 0 && compare(opts, &lines[j - 1], &l) > 0; --j) lines[j] = lines[j - 1];
+            lines[j] = l;
+        }
+        return;
+    }
+
+    size_t half = n / 2;
+    merge_sort(opts, lines, tmp, half);
+    merge_sort(opts, lines + half, tmp, n - half);
+    // Already in order
+    if (compare(opts, &lines[half - 1], &lines[half]) <= 0) return;
+
+    size_t i = 0, j = half, k = 0;
+    while (i < half && j < n) {
+        // The left line first when equal
+        if (compare(opts, &lines[j], &lines[i]) < 0) tmp[k++] = lines[j++];
+        else tmp[k++] = lines[i++];
+    }
+    while (i < half) tmp[k++] = lines[i++];
+    memcpy(lines, tmp, k * sizeof(struct sort_line));
+}
+
+/**
+ * Main function of a thread sorting a slice
+ */
+static void *sort_main(void *arg) {
+    struct sort_task *task = arg;
+    merge_sort(task->opts, task->lines, task->tmp, task->n);
+    return NULL;
+}
+
+/**
+ * Sort lines in slices, one per thread
+ * @param slices Retrieves the sorted slices, must be able to hold SORT_MAX_THREADS slices
+ * @return The number of slices, 0 on failure
+ */
+static size_t sort_slices(const struct sort_opts *opts, struct sort_line *lines, size_t n, struct source *slices) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t n_slices = cpus > 0 ? (size_t) cpus : 1;
+    if (n_slices > SORT_MAX_THREADS) n_slices = SORT_MAX_THREADS;
+    if (n_slices > n / SORT_MIN_SLICE) n_slices = n / SORT_MIN_SLICE;
+    if (n_slices == 0) n_slices = 1;
+
+    struct sort_line *tmp = malloc((n > 0 ? n : 1) * sizeof(struct sort_line));
+    if (tmp == NULL) {
+        fprintf(stderr, "sort: memory allocation failure\n");
+        return 0;
+    }
+
+    // The signals are handled by the main thread
+    struct sort_task tasks[SORT_MAX_THREADS];
+    pthread_t threads[SORT_MAX_THREADS];
+    bool started[SORT_MAX_THREADS] = { false };
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (size_t i = 0; i < n_slices; ++i) {
+        size_t first = n * i / n_slices, last = n * (i + 1) / n_slices;
+        tasks[i] = (struct sort_task) { .opts = opts, .lines = lines + first, .tmp = tmp + first, .n = last - first };
+        slices[i] = (struct source) { .next = lines + first, .end = lines + last };
+        if (i > 0) started[i] = pthread_create(&threads[i], NULL, sort_main, &tasks[i]) == 0;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    // The calling thread sorts the first slice, and the ones without thread
+    for (size_t i = 0; i < n_slices; ++i) {
+        if (!started[i]) sort_main(&tasks[i]);
+    }
+    for (size_t i = 0; i < n_slices; ++i) {
+        if (started[i]) pthread_join(threads[i], NULL);
+    }
+    free(tmp);
+    return n_slices;
+}
+
+/**
+ * Move a source to its next line
+ * @return 1 if there is one, 0 at the end, -1 on failure
+ */
+static int source_next(struct source *s) {
+    if (s->file == NULL) {
+        if (s->next == s->end) return 0;
+        s->line = *s->next++;
+        return 1;
+    }
+
+    ssize_t len = getline(&s->buf, &s->cap, s->file);
+    if (len == -1) {
+        if (ferror(s->file)) {
+            perror("sort: failed to read a temporary file");
+            return -1;
+        }
+        return 0;
+    }
+    // The runs end each line with a newline
+    s->line = (struct sort_line) { .text = s->buf, .len = len - 1 };
+    return 1;
+}
+
+/**
+ * Write a line, unless it is equal to the previous one with -u
+ * @return 0 on success, -1 if the line couldn't be written
+ */
+static int sink_put(const struct sort_opts *opts, struct sink *sink, const struct sort_line *line) {
+    if (opts->unique) {
+        struct sort_line prev = { .text = sink->prev, .len = sink->prev_len };
+        if (sink->has_prev && compare(opts, &prev, line) == 0) return 0;
+        if (line->len >= sink->prev_cap) {
+            char *more = realloc(sink->prev, line->len + 1);
+            if (more == NULL) {
+                fprintf(stderr, "sort: memory allocation failure\n");
+                sink->failed = true;
+                return -1;
+            }
+            sink->prev = more;
+            sink->prev_cap = line->len + 1;
+        }
+        memcpy(sink->prev, line->text, line->len);
+        sink->prev_len = line->len;
+        sink->has_prev = true;
+    }
+
+    if (sink->file != NULL) {
+        if (fwrite(line->text, 1, line->len, sink->file) != line->len || putc('\n', sink->file) == EOF) {
+            perror("sort: failed to write a temporary file");
+            sink->failed = true;
+            return -1;
+        }
+        return 0;
+    }
+    if (sink->write(sink->ctx, line->text, line->len) == -1 || sink->write(sink->ctx, "\n", 1) == -1) return -1;
+    return 0;
+}
+
+/**
+ * Tells if a source comes before another one in the heap of a merge
+ */
+static bool before(const struct sort_opts *opts, const struct source *srcs, size_t a, size_t b) {
+    int diff = compare(opts, &srcs[a].line, &srcs[b].line);
+    // Equal lines come from the earlier part of the input first
+    return diff < 0 || (diff == 0 && a < b);
+}
+
+/**
+ * Restore the order of a heap of sources from one of its nodes
+ */
+static void sift_down(const struct sort_opts *opts, const struct source *srcs, size_t *heap, size_t n, size_t i) {
+    for (;;) {
+        size_t min = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < n && before(opts, srcs, heap[l], heap[min])) min = l;
+        if (r < n && before(opts, srcs, heap[r], heap[min])) min = r;
+        if (min == i) return;
+        size_t t = heap[i];
+        heap[i] = heap[min];
+        heap[min] = t;
+        i = min;
+    }
+}
+
+/**
+ * Merge sorted sources, given in the order of the input
+ * @return 0 on success, -1 on failure or if the output is gone
+ */
+static int merge(const struct sort_opts *opts, struct source *srcs, size_t n_srcs, struct sink *sink) {
+    size_t *heap = malloc((n_srcs > 0 ? n_srcs : 1) * sizeof(size_t));
+    if (heap == NULL) {
+        fprintf(stderr, "sort: memory allocation failure\n");
+        sink->failed = true;
+        return -1;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < n_srcs; ++i) {
+        int r = source_next(&srcs[i]);
+        if (r == -1) sink->failed = true;
+        if (r == 1) heap[n++] = i;
+    }
+    for (size_t i = n / 2; i-- > 0;) sift_down(opts, srcs, heap, n, i);
+
+    int err = sink->failed ? -1 : 0;
+    while (n > 0 && err == 0) {
+        struct source *s = &srcs[heap[0]];
+        err = sink_put(opts, sink, &s->line);
+
+        int r = source_next(s);
+        if (r == -1) {
+            sink->failed = true;
+            err = -1;
+        }
+        if (r != 1) heap[0] = heap[--n];
+        sift_down(opts, srcs, heap, n, 0);
+    }
+    free(heap);
+    return err;
+}
+
+/**
+ * Create a temporary file for a run, removed once closed
+ * @return The file, NULL on failure
+ */
+static FILE *new_run(void) {
+    const char *dir = getenv("TMPDIR");
+    if (dir == NULL || dir[0] == '\0') dir = "/tmp";
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/fish-sort-XXXXXX", dir) >= (int) sizeof(path)) {
+        fprintf(stderr, "sort: temporary directory path too long\n");
+        return NULL;
+    }
+    int fd = mkostemp(path, O_CLOEXEC);
+    if (fd == -1) {
+        perror("sort: failed to create a temporary file");
+        return NULL;
+    }
+    unlink(path);
+    FILE *file = fdopen(fd, "w+");
+    if (file == NULL) {
+        perror("sort: failed to create a temporary file");
+        close(fd);
+    }
+    return file;
+}
+
+/**
+ * Close runs and free what their sources hold
+ */
+static void close_sources(struct source *srcs, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        if (srcs[i].file != NULL) fclose(srcs[i].file);
+        free(srcs[i].buf);
+        srcs[i] = (struct source) { .file = NULL };
+    }
+}
+
+/**
+ * Merge groups of runs until they can be merged at once, keeping their order
+ * @param runs The runs, read from their start
+ * @param n_runs The number of runs, updated
+ * @return 0 on success, -1 on failure
+ */
+static int reduce_runs(const struct sort_opts *opts, struct source *runs, size_t *n_runs) {
+    while (*n_runs > SORT_MERGE_WAYS) {
+        size_t n_merged = 0;
+        for (size_t i = 0; i < *n_runs; i += SORT_MERGE_WAYS) {
+            size_t n = *n_runs - i < SORT_MERGE_WAYS ? *n_runs - i : SORT_MERGE_WAYS;
+            struct sink sink = { .file = new_run() };
+            if (
+                    sink.file == NULL
+                    || merge(opts, runs + i, n, &sink) == -1
+                    || fflush(sink.file) == EOF
+                    || fseek(sink.file, 0, SEEK_SET) == -1
+            ) {
+                if (sink.file != NULL) fclose(sink.file);
+                free(sink.prev);
+                close_sources(runs + n_merged, *n_runs - n_merged);
+                *n_runs = n_merged;
+                return -1;
+            }
+            free(sink.prev);
+            close_sources(runs + i, n);
+            runs[n_merged++] = (struct source) { .file = sink.file };
+        }
+        *n_runs = n_merged;
+    }
+    return 0;
+}
+
+/**
+ * Split a part of the input into lines
+ * @param lines Retrieves the lines, reallocated as needed
+ * @param cap The room of "lines", updated
+ * @return The number of lines, -1 on failure
+ */
+static ssize_t split_lines(const char *buf, size_t len, struct sort_line **lines, size_t *cap) {
+    size_t n = 0;
+    for (const char *p = buf, *end = buf + len; p < end;) {
+        const char *nl = memchr(p, '\n', end - p);
+        if (nl == NULL) nl = end;
+        if (n == *cap) {
+            size_t new_cap = *cap > 0 ? 2 * *cap : 1024;
+            struct sort_line *more = realloc(*lines, new_cap * sizeof(struct sort_line));
+            if (more == NULL) {
+                fprintf(stderr, "sort: memory allocation failure\n");
+                return -1;
+            }
+            *lines = more;
+            *cap = new_cap;
+        }
+        (*lines)[n++] = (struct sort_line) { .text = p, .len = nl - p };
+        p = nl + 1;
+    }
+    return n;
+}
+
+int sort_run(const struct sort_opts *opts, sort_read_fn in, void *in_ctx, sort_write_fn out, void *out_ctx) {
+    char *buf = NULL;
+    size_t len = 0, cap = 0;
+    struct sort_line *lines = NULL;
+    size_t lines_cap = 0;
+    struct source *srcs = NULL; // the runs, then the slices of the last part
+    size_t n_runs = 0, srcs_cap = 0;
+    bool failed = false;
+
+    for (bool eof = false; !eof && !failed;) {
+        // The buffer grows up to its size, and beyond only for a line longer than it
+        if (len == cap) {
+            size_t new_cap = cap > 0 ? 2 * cap : SORT_READ_LEN;
+            if (cap < opts->buffer_size && new_cap > opts->buffer_size) new_cap = opts->buffer_size;
+            char *more = realloc(buf, new_cap);
+            if (more == NULL) {
+                fprintf(stderr, "sort: memory allocation failure\n");
+                failed = true;
+                break;
+            }
+            buf = more;
+            cap = new_cap;
+        }
+        ssize_t n = in(in_ctx, buf + len, cap - len < SORT_READ_LEN ? cap - len : SORT_READ_LEN);
+        if (n == -1) {
+            failed = true;
+            break;
+        }
+        len += n;
+        eof = n == 0;
+        if (eof || len < opts->buffer_size) continue;
+
+        // Full : the complete lines are sorted to a run, the rest stays for the next part
+        const char *nl = memrchr(buf, '\n', len);
+        if (nl == NULL) continue;
+        if (n_runs == srcs_cap) {
+            size_t new_cap = srcs_cap > 0 ? 2 * srcs_cap : SORT_MERGE_WAYS;
+            struct source *more = realloc(srcs, (new_cap + SORT_MAX_THREADS) * sizeof(struct source));
+            if (more == NULL) {
+                fprintf(stderr, "sort: memory allocation failure\n");
+                failed = true;
+                break;
+            }
+            srcs = more;
+            srcs_cap = new_cap;
+        }
+
+        size_t part = nl + 1 - buf;
+        ssize_t n_lines = split_lines(buf, part, &lines, &lines_cap);
+        struct source slices[SORT_MAX_THREADS];
+        size_t n_slices = n_lines == -1 ? 0 : sort_slices(opts, lines, n_lines, slices);
+        struct sink sink = { .file = n_slices > 0 ? new_run() : NULL };
+        if (
+                sink.file == NULL
+                || merge(opts, slices, n_slices, &sink) == -1
+                || fflush(sink.file) == EOF
+                || fseek(sink.file, 0, SEEK_SET) == -1
+        ) {
+            if (sink.file != NULL) fclose(sink.file);
+            failed = true;
+        }
+        else srcs[n_runs++] = (struct source) { .file = sink.file };
+        free(sink.prev);
+
+        memmove(buf, buf + part, len - part);
+        len -= part;
+    }
+
+    // The runs are merged with the last part, sorted in memory
+    if (!failed && reduce_runs(opts, srcs, &n_runs) == -1) failed = true;
+    ssize_t n_lines = failed ? -1 : split_lines(buf, len, &lines, &lines_cap);
+    if (n_lines != -1 && srcs == NULL) {
+        srcs = malloc(SORT_MAX_THREADS * sizeof(struct source));
+        if (srcs == NULL) {
+            fprintf(stderr, "sort: memory allocation failure\n");
+            n_lines = -1;
+        }
+    }
+    if (n_lines != -1) {
+        size_t n_slices = sort_slices(opts, lines, n_lines, srcs + n_runs);
+        struct sink sink = { .write = out, .ctx = out_ctx };
+        if (n_slices == 0 || (merge(opts, srcs, n_runs + n_slices, &sink) == -1 && sink.failed)) failed = true;
+        free(sink.prev);
+    }
+    else failed = true;
+
+    if (srcs != NULL) close_sources(srcs, n_runs);
+    free(srcs);
+    free(lines);
+    free(buf);
+    return failed ? 2 : 0;
+}
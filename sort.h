@@ -0,0 +1,72 @@
+#ifndef SORT_H
+#define SORT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "cmdline.h"
+
+#define SORT_MAX_KEYS 8
+#define SORT_MAX_THREADS 8 // threads sorting the parts of the input held in memory
+#define SORT_MERGE_WAYS 16 // sorted runs merged at once
+#define DEFAULT_SORT_BUFFER (64 * 1024 * 1024) // input sorted in memory before spilling, in bytes
+
+/**
+ * A key of sort -k : from a character of a field to a character of another one
+ */
+struct sort_key {
+    size_t sword, schar; // field and character where the key starts, from 0
+    size_t eword, echar; // field and character where the key ends : SIZE_MAX fields for the end
+                         // of the line, 0 characters for the end of the field
+    bool numeric, reverse;
+};
+
+/**
+ * The options of sort [-n] [-r] [-u] [-t C] [-k KEY]... [-S SIZE]
+ */
+struct sort_opts {
+    struct sort_key keys[SORT_MAX_KEYS];
+    size_t n_keys;
+    bool reverse, unique;
+    int tab; // field separator, -1 for the transitions to blanks
+    size_t buffer_size; // bytes of input held in memory before sorted runs go to temporary files
+};
+
+/**
+ * Reads the input of the sort, like read()
+ */
+typedef ssize_t (*sort_read_fn)(void *ctx, char *buf, size_t len);
+
+/**
+ * Writes the sorted lines
+ * @return 0 on success, -1 if the output is gone
+ */
+typedef int (*sort_write_fn)(void *ctx, const char *buf, size_t len);
+
+/**
+ * Tells if a command is a sort of the standard input with options the builtin supports
+ * @param cmd The command
+ * @param opts Retrieves the options
+ * @return 0 if the builtin can run it, -1 if it has to be executed
+ */
+int sort_parse(const struct cmd *cmd, struct sort_opts *opts);
+
+/**
+ * Sort lines like sort in the C locale
+ *
+ * The input is read in parts of the size of the buffer, each sorted by several threads and
+ * written to a temporary file if more input follows. The sorted parts are then merged. Equal
+ * lines keep their order, so -u keeps the first one of the input
+ *
+ * @param opts The options
+ * @param in Reads the input
+ * @param in_ctx Argument of "in"
+ * @param out Writes the sorted lines
+ * @param out_ctx Argument of "out"
+ *
+ * @return 0 on success or if the output is gone, 2 on failure like sort
+ */
+int sort_run(const struct sort_opts *opts, sort_read_fn in, void *in_ctx, sort_write_fn out, void *out_ctx);
+
+#endif
@@ -0,0 +1,379 @@
+#define _GNU_SOURCE // O_DIRECTORY
+
+#include "spool.h"
+#include "cmdline.h"
+#include "exec.h"
+#include "zygote.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define BUFLEN 512 // same limit as the command lines read by the shell
+#define LOG_SUFFIX ".log"
+
+/**
+ * A job being executed
+ */
+struct job {
+    bool used;
+    char name[NAME_MAX + 1];
+    FILE *file; // lines of the job, in the running directory
+    int log; // outputs of the commands
+    size_t line_number; // line running
+    pid_t pids[MAX_PIDS];
+    size_t n_pids; // PIDs not reaped yet
+    pid_t last_pid;
+    int status; // status of the last command of the line running, as returned by waitpid()
+    struct timespec start;
+};
+
+static int spool_fd, running_fd, done_fd, failed_fd;
+static int null_fd;
+static struct job *jobs;
+static size_t max_running;
+static size_t n_running = 0;
+
+// Names of the jobs not started yet, in order of arrival
+static char (*pending)[NAME_MAX + 1] = NULL;
+static size_t pending_head = 0;
+static size_t pending_count = 0;
+static size_t pending_cap = 0;
+
+/**
+ * Open a subdirectory of the spool directory, creating it if needed
+ * @param name The name of the subdirectory
+ * @return The subdirectory, -1 on failure
+ */
+static int open_subdir(const char *name) {
+    if (mkdirat(spool_fd, name, 0755) == -1 && errno != EEXIST) {
+        perror("Failed to create a spool subdirectory");
+        return -1;
+    }
+    int fd = openat(spool_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) perror("Failed to open a spool subdirectory");
+    return fd;
+}
+
+/**
+ * Add a file of the spool directory to the jobs to start
+ * @param name The name of the file
+ */
+static void push_pending(const char *name) {
+    if (name[0] == '.' || strlen(name) > NAME_MAX - strlen(LOG_SUFFIX)) return;
+
+    if (pending_head + pending_count == pending_cap) {
+        // Reuse the names already taken before growing
+        memmove(pending, pending + pending_head, pending_count * sizeof(*pending));
+        pending_head = 0;
+        if (pending_count == pending_cap) {
+            size_t cap = pending_cap ? pending_cap * 2 : 64;
+            void *more = realloc(pending, cap * sizeof(*pending));
+            if (more == NULL) {
+                fprintf(stderr, "Memory allocation failure\n");
+                return;
+            }
+            pending = more;
+            pending_cap = cap;
+        }
+    }
+    strcpy(pending[pending_head + pending_count++], name);
+}
+
+/**
+ * Move a job and its log from the running directory to another one
+ * @param job The job
+ * @param dir_fd The destination directory
+ */
+static void move_job(const struct job *job, int dir_fd) {
+    char log_name[NAME_MAX + sizeof(LOG_SUFFIX)];
+    snprintf(log_name, sizeof(log_name), "%s%s", job->name, LOG_SUFFIX);
+    if (renameat(running_fd, log_name, dir_fd, log_name) == -1) perror("Failed to move the log of a job");
+    if (renameat(running_fd, job->name, dir_fd, job->name) == -1) perror("Failed to move a job");
+}
+
+/**
+ * Finish a job, and move it to the done or failed directory
+ * @param job The job
+ * @param ok true if every line of the job succeeded
+ */
+static void finish_job(struct job *job, bool ok) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - job->start.tv_sec) + (end.tv_nsec - job->start.tv_nsec) / 1e9;
+
+    if (ok) {
+        fprintf(stderr, "spool: %s done in %.2f s\n", job->name, seconds);
+    }
+    else if (WIFSIGNALED(job->status)) {
+        fprintf(stderr, "spool: %s failed at line %zu with signal %i\n", job->name, job->line_number, WTERMSIG(job->status));
+    }
+    else {
+        fprintf(stderr, "spool: %s failed at line %zu with exit status %i\n", job->name, job->line_number, WEXITSTATUS(job->status));
+    }
+
+    fclose(job->file);
+    close(job->log);
+    move_job(job, ok ? done_fd : failed_fd);
+    job->used = false;
+    --n_running;
+}
+
+/**
+ * Launch the next lines of a job, until one of them is running or the job is finished
+ * @param job The job
+ */
+static void advance_job(struct job *job) {
+    char buf[BUFLEN + 1];
+    while (fgets(buf, BUFLEN, job->file) != NULL) {
+        ++job->line_number;
+        size_t len = strlen(buf);
+        if (buf[len - 1] != '\n' && !feof(job->file)) {
+            fprintf(stderr, "spool: %s:%zu: The command line is too long\n", job->name, job->line_number);
+            job->status = 1 << 8;
+            finish_job(job, false);
+            return;
+        }
+
+        // Skip empty lines and comments
+        size_t i = 0;
+        while (buf[i] == ' ' || buf[i] == '\t') ++i;
+        if (buf[i] == '\n' || buf[i] == '\0' || buf[i] == '#') continue;
+
+        struct line li;
+        struct line_ctx ctx;
+        line_init(&li);
+        line_ctx_init(&ctx);
+        if (line_parse_r(&li, buf, &ctx)) {
+            fprintf(stderr, "spool: %s:%zu:%zu: %s\n", job->name, job->line_number, ctx.offset + 1, ctx.message);
+            line_reset(&li);
+            job->status = 1 << 8;
+            finish_job(job, false);
+            return;
+        }
+
+        struct exec_io io = { .in = null_fd, .out = job->log, .err = job->log };
+        int n_pids = launch_line(&li, &io, job->pids);
+        bool background = li.background;
+        line_reset(&li);
+        if (n_pids == -1) {
+            job->status = 1 << 8;
+            finish_job(job, false);
+            return;
+        }
+
+        // Background commands are not waited for
+        if (n_pids > 0 && !background) {
+            job->n_pids = n_pids;
+            job->last_pid = job->pids[n_pids - 1];
+            return;
+        }
+    }
+    job->status = 0;
+    finish_job(job, true);
+}
+
+/**
+ * Claim a job of the spool directory and start it
+ * @param job The free slot of the job
+ * @param name The name of the job in the spool directory
+ */
+static void start_job(struct job *job, const char *name) {
+    // Only regular files are jobs, opening a FIFO would block
+    struct stat st;
+    if (fstatat(spool_fd, name, &st, 0) == -1 || !S_ISREG(st.st_mode)) return;
+
+    // Only one shell gets the job, and a name notified twice is only run once
+    if (renameat(spool_fd, name, running_fd, name) == -1) return;
+
+    memset(job, 0, sizeof(struct job));
+    strcpy(job->name, name);
+    int fd = openat(running_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || (job->file = fdopen(fd, "r")) == NULL) {
+        perror("Failed to open a job");
+        if (fd != -1) close(fd);
+        renameat(running_fd, name, failed_fd, name);
+        return;
+    }
+
+    char log_name[NAME_MAX + sizeof(LOG_SUFFIX)];
+    snprintf(log_name, sizeof(log_name), "%s%s", name, LOG_SUFFIX);
+    job->log = openat(running_fd, log_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (job->log == -1) {
+        perror("Failed to create the log of a job");
+        fclose(job->file);
+        renameat(running_fd, name, failed_fd, name);
+        return;
+    }
+
+    fprintf(stderr, "spool: %s started\n", name);
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    job->used = true;
+    ++n_running;
+    advance_job(job);
+}
+
+/**
+ * Start the pending jobs while there are free slots
+ */
+static void start_pending(void) {
+    size_t slot = 0;
+    while (pending_count > 0) {
+        while (slot < max_running && jobs[slot].used) ++slot;
+        if (slot == max_running) return;
+
+        // A job which could not start or is already finished leaves its slot to the next one
+        const char *name = pending[pending_head++];
+        --pending_count;
+        start_job(&jobs[slot], name);
+    }
+}
+
+/**
+ * Read the files created or moved in the spool directory
+ * @param inotify_fd The inotify instance watching the spool directory
+ */
+static void handle_inotify(int inotify_fd) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len;) {
+            const struct inotify_event *event = (const struct inotify_event *) p;
+            if (event->len > 0 && !(event->mask & IN_ISDIR)) push_pending(event->name);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+/**
+ * Reap the ended commands, and launch the next lines of their jobs
+ */
+static void handle_children(void) {
+    int stat;
+    pid_t pid;
+    while ((pid = waitpid(-1, &stat, WNOHANG)) > 0) {
+        for (size_t i = 0; i < max_running; ++i) {
+            struct job *job = &jobs[i];
+            if (!job->used || job->n_pids == 0) continue;
+
+            size_t j = 0;
+            while (j < job->n_pids && job->pids[j] != pid) ++j;
+            if (j == job->n_pids) continue;
+
+            job->pids[j] = job->pids[--job->n_pids];
+            if (pid == job->last_pid) job->status = stat;
+            if (job->n_pids > 0) break;
+
+            if (WIFEXITED(job->status) && WEXITSTATUS(job->status) == 0) advance_job(job);
+            else finish_job(job, false);
+            break;
+        }
+    }
+}
+
+/**
+ * Queue the files already in the spool directory
+ */
+static void scan_spool(void) {
+    int fd = dup(spool_fd);
+    DIR *dir = fd != -1 ? fdopendir(fd) : NULL;
+    if (dir == NULL) {
+        if (fd != -1) close(fd);
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_type == DT_REG || entry->d_type == DT_UNKNOWN) push_pending(entry->d_name);
+    }
+    closedir(dir);
+}
+
+int spool(const char *dir, size_t max_jobs) {
+    max_running = max_jobs > 0 ? max_jobs : 1;
+
+    spool_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (spool_fd == -1) {
+        perror("Failed to open the spool directory");
+        return -1;
+    }
+    running_fd = open_subdir("running");
+    done_fd = open_subdir("done");
+    failed_fd = open_subdir("failed");
+    jobs = calloc(max_running, sizeof(struct job));
+    if (running_fd == -1 || done_fd == -1 || failed_fd == -1 || jobs == NULL) {
+        if (jobs == NULL) fprintf(stderr, "Memory allocation failure\n");
+        return -1;
+    }
+
+    // The files are complete once closed, or moved in the spool directory
+    int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd == -1 || inotify_add_watch(inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR) == -1) {
+        perror("Failed to watch the spool directory");
+        return -1;
+    }
+
+    // Handle the signals through poll
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int sigfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+
+    null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    // Watched first, the files arriving during the scan are not missed
+    scan_spool();
+
+    bool stop = false;
+    while (!stop || n_running > 0) {
+        if (!stop) start_pending();
+        zygote_refill();
+
+        struct pollfd pfds[2] = {
+                { .fd = sigfd, .events = POLLIN },
+                { .fd = inotify_fd, .events = stop ? 0 : POLLIN }
+        };
+        if (poll(pfds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            perror("poll failed");
+            break;
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            while (read(sigfd, &info, sizeof(info)) == sizeof(info)) {
+                if (info.ssi_signo != SIGCHLD) stop = true;
+            }
+            handle_children();
+        }
+        if (pfds[1].revents & POLLIN) handle_inotify(inotify_fd);
+    }
+
+    close(inotify_fd);
+    close(sigfd);
+    close(null_fd);
+    close(running_fd);
+    close(done_fd);
+    close(failed_fd);
+    close(spool_fd);
+    free(jobs);
+    free(pending);
+    pending = NULL;
+    pending_head = pending_count = pending_cap = 0;
+    return 0;
+}
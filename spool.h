@@ -0,0 +1,27 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <stddef.h>
+
+/**
+ * Run the shell on the jobs dropped in a spool directory
+ *
+ * Each regular file appearing in "dir" is a job : its lines are executed in order, like a
+ * script read by the shell, and the job stops at its first failing line. Files whose name starts
+ * with '.' are ignored, so a job can be written under a hidden name then renamed.
+ *
+ * A job is claimed by moving it to "dir"/running, its standard input is /dev/null and its
+ * outputs go to "dir"/running/NAME.log. Once finished, both files are moved to "dir"/done or
+ * "dir"/failed. The subdirectories are created if needed, and the jobs already in "dir" when
+ * the shell starts are run first
+ *
+ * Returns when SIGINT or SIGTERM is received, once the running jobs are finished
+ *
+ * @param dir path of the spool directory
+ * @param max_jobs maximal number of jobs running at the same time
+ *
+ * @return 0 on success, -1 on failure
+ */
+int spool(const char *dir, size_t max_jobs);
+
+#endif
@@ -0,0 +1,200 @@
+#define _GNU_SOURCE // tee() and splice()
+
+#include "tee.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define TEE_CHUNK (1 << 16)
+
+struct tee_out {
+    int fd;
+    int pipe[2]; // intermediate pipe, -1 for the last output
+    bool copy; // splice() isn't supported by fd, write() is used instead
+    bool dead; // the reader of fd is gone
+};
+
+static char buf[TEE_CHUNK];
+
+/**
+ * Write "len" bytes to an output
+ * @param out The output
+ * @param data The bytes to write
+ * @param len The number of bytes
+ * @return 0 on success, -1 if an error occured
+ */
+static int write_all(struct tee_out *out, const char *data, size_t len) {
+    while (len > 0 && !out->dead) {
+        ssize_t n = write(out->fd, data, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EPIPE) {
+                out->dead = true;
+                return 0;
+            }
+            perror("tee: write failed");
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Move "len" bytes from a pipe to an output
+ *
+ * The bytes are read from the pipe even if the output is dead
+ *
+ * @param from The pipe
+ * @param out The output
+ * @param len The number of bytes, they must be in the pipe already
+ * @return 0 on success, -1 if an error occured
+ */
+static int move(int from, struct tee_out *out, size_t len) {
+    while (len > 0) {
+        if (!out->copy && !out->dead) {
+            ssize_t n = splice(from, NULL, out->fd, NULL, len, SPLICE_F_MOVE);
+            if (n >= 0) {
+                len -= n;
+                continue;
+            }
+            if (errno == EINTR) continue;
+            if (errno == EPIPE) out->dead = true;
+            else if (errno == EINVAL) out->copy = true;
+            else {
+                perror("tee: splice failed");
+                return -1;
+            }
+        }
+
+        size_t chunk = len < TEE_CHUNK ? len : TEE_CHUNK;
+        ssize_t n = read(from, buf, chunk);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            perror("tee: read failed");
+            return -1;
+        }
+        if (write_all(out, buf, n) == -1) return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Copy a pipe to several outputs with read() and write(), if tee() can't be used
+ * @param in The pipe
+ * @param outs The outputs
+ * @param n_outs The number of outputs
+ * @return 0 at the end of the pipe, -1 if an error occured
+ */
+static int copy_loop(int in, struct tee_out *outs, size_t n_outs) {
+    for (;;) {
+        ssize_t n = read(in, buf, TEE_CHUNK);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) {
+            perror("tee: read failed");
+            return -1;
+        }
+        if (n == 0) return 0;
+        for (size_t i = 0; i < n_outs; ++i) {
+            if (write_all(&outs[i], buf, n) == -1) return -1;
+        }
+    }
+}
+
+int tee_run(int in, const int *fds, size_t n_outs) {
+    struct tee_out outs[MAX_TEE_OUTS];
+    if (n_outs == 0 || n_outs > MAX_TEE_OUTS) return -1;
+
+    // Intermediate pipes as big as the input one, so that a tee() to an empty one takes it all
+    int size = fcntl(in, F_GETPIPE_SZ);
+    for (size_t i = 0; i < n_outs; ++i) {
+        outs[i].fd = fds[i];
+        outs[i].pipe[0] = outs[i].pipe[1] = -1;
+        outs[i].copy = false;
+        outs[i].dead = false;
+        if (i == n_outs - 1) continue;
+        if (pipe2(outs[i].pipe, O_CLOEXEC) == -1) {
+            perror("tee: pipe failed");
+            return -1;
+        }
+        if (size > 0) fcntl(outs[i].pipe[1], F_SETPIPE_SZ, size);
+    }
+
+    int err = 0;
+    for (;;) {
+        // Wait for data, the first tee() takes as much as it can
+        struct tee_out *last = &outs[n_outs - 1];
+        ssize_t n = n_outs > 1 ? tee(in, outs[0].pipe[1], TEE_CHUNK, 0) : splice(in, NULL, last->fd, NULL, TEE_CHUNK, SPLICE_F_MOVE);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && errno == EINVAL) {
+            // The input isn't a pipe, or the only output doesn't support splice()
+            err = copy_loop(in, outs, n_outs);
+            break;
+        }
+        if (n == -1) {
+            perror("tee: tee failed");
+            err = -1;
+            break;
+        }
+        if (n == 0) break;
+        if (n_outs == 1) continue;
+
+        // Duplicate the same bytes for the other outputs
+        size_t got[MAX_TEE_OUTS];
+        bool partial = false;
+        got[0] = n;
+        for (size_t i = 1; i < n_outs - 1; ++i) {
+            ssize_t m;
+            do {
+                m = tee(in, outs[i].pipe[1], n, 0);
+            } while (m == -1 && errno == EINTR);
+            got[i] = m > 0 ? m : 0;
+            partial = partial || got[i] < (size_t) n;
+        }
+
+        for (size_t i = 0; i < n_outs - 1 && !err; ++i) {
+            err = move(outs[i].pipe[0], &outs[i], got[i]);
+        }
+        if (err) break;
+
+        // Consume the bytes from the input
+        if (!partial) {
+            err = move(in, last, n);
+        }
+        else {
+            // Some outputs didn't get everything : the rest is written from a copy
+            size_t len = 0;
+            while (len < (size_t) n) {
+                ssize_t r = read(in, buf + len, n - len);
+                if (r == -1 && errno == EINTR) continue;
+                if (r <= 0) {
+                    perror("tee: read failed");
+                    err = -1;
+                    break;
+                }
+                len += r;
+            }
+            for (size_t i = 0; i < n_outs - 1 && !err; ++i) {
+                if (got[i] < len) err = write_all(&outs[i], buf + got[i], len - got[i]);
+            }
+            if (!err) err = write_all(last, buf, len);
+        }
+        if (err) break;
+
+        // Nobody reads anymore : the writer gets SIGPIPE
+        bool alive = false;
+        for (size_t i = 0; i < n_outs; ++i) alive = alive || !outs[i].dead;
+        if (!alive) break;
+    }
+
+    for (size_t i = 0; i < n_outs - 1; ++i) {
+        close(outs[i].pipe[0]);
+        close(outs[i].pipe[1]);
+    }
+    return err;
+}
@@ -0,0 +1,24 @@
+#ifndef TEE_H
+#define TEE_H
+
+#include <stddef.h>
+
+#define MAX_TEE_OUTS 17 // the pipe or the file of a command, and its MAX_REDIRS other outputs
+
+/**
+ * Copy everything read from a pipe to several descriptors, until the end of the pipe
+ *
+ * The data stays in the kernel : it is duplicated with tee(2) into one intermediate pipe per
+ * descriptor but the last one, then moved with splice(2). Descriptors which don't support
+ * splice(2), like files opened with O_APPEND on some kernels, are written with write(2).
+ * A descriptor whose reader is gone is dropped, the others still get the data
+ *
+ * @param in read end of the pipe to copy
+ * @param outs descriptors to copy the pipe to
+ * @param n_outs number of descriptors, at most MAX_TEE_OUTS
+ *
+ * @return 0 at the end of the pipe, -1 if an error occured
+ */
+int tee_run(int in, const int *outs, size_t n_outs);
+
+#endif
@@ -0,0 +1,661 @@
+#define _GNU_SOURCE // memrchr()
+
+#include "textutil.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define DEFAULT_LINES 10
+#define TEXT_QUEUE_LEN (4 * TEXT_BUF_LEN)
+
+static bool enabled = false;
+
+/**
+ * Bytes passed from a builtin to the next one, without going through the kernel
+ */
+struct text_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // bytes were added or taken, or a side was closed
+    char buf[TEXT_QUEUE_LEN]; // ring buffer
+    size_t head;
+    size_t len;
+    bool writer_closed;
+    bool reader_closed;
+};
+
+/**
+ * Bytes waiting to be written, to write many short lines at once
+ */
+struct text_out {
+    struct text_end end;
+    char buf[TEXT_BUF_LEN];
+    size_t len;
+    bool broken; // the reader is gone, or writing failed
+};
+
+/**
+ * A text builtin running in a thread
+ */
+struct text_job {
+    struct text_cmd tc;
+    struct text_end in;
+    struct text_end out;
+};
+
+/**
+ * Count the newlines of a buffer
+ *
+ * With SSE2, 16 bytes are compared at once, and the matches are summed in byte counters
+ * which are only added up every 255 blocks
+ */
+static size_t count_newlines(const char *buf, size_t len) {
+    size_t n = 0, i = 0;
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+    while (i + 16 <= len) {
+        __m128i counters = _mm_setzero_si128();
+        for (size_t blocks = 0; blocks < 255 && i + 16 <= len; ++blocks, i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (buf + i));
+            // A match is 0xFF, which is -1
+            counters = _mm_sub_epi8(counters, _mm_cmpeq_epi8(v, nl));
+        }
+        __m128i sums = _mm_sad_epu8(counters, _mm_setzero_si128());
+        n += _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+    }
+#endif
+    for (; i < len; ++i) n += buf[i] == '\n';
+    return n;
+}
+
+/**
+ * Find the first occurrence of a string in a buffer
+ *
+ * With SSE2, the first and the last bytes of the string are looked for in 16 positions at once,
+ * and the whole string is only compared at the positions where both match
+ *
+ * @return A pointer on the occurrence, NULL if there is none
+ */
+static const char *find_fixed(const char *hay, size_t len, const char *needle, size_t n) {
+    if (n == 0) return hay;
+    if (n > len) return NULL;
+    if (n == 1) return memchr(hay, needle[0], len);
+
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[n - 1]);
+    for (; i + n - 1 + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (hay + i + n - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask != 0) {
+            unsigned bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, n - 2) == 0) return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    while (i + n <= len) {
+        const char *p = memchr(hay + i, needle[0], len - n + 1 - i);
+        if (p == NULL) return NULL;
+        if (memcmp(p + 1, needle + 1, n - 1) == 0) return p;
+        i = p - hay + 1;
+    }
+    return NULL;
+}
+
+/**
+ * Take bytes from a queue, waiting for some if it is empty
+ * @return The number of bytes taken, 0 once the queue is empty and its writer is gone
+ */
+static size_t queue_read(struct text_queue *q, char *buf, size_t len) {
+    pthread_mutex_lock(&q->lock);
+    while (q->len == 0 && !q->writer_closed) pthread_cond_wait(&q->changed, &q->lock);
+
+    // The bytes may wrap around the end of the ring
+    size_t n = q->len < len ? q->len : len;
+    size_t first = TEXT_QUEUE_LEN - q->head < n ? TEXT_QUEUE_LEN - q->head : n;
+    memcpy(buf, q->buf + q->head, first);
+    memcpy(buf + first, q->buf, n - first);
+    q->head = (q->head + n) % TEXT_QUEUE_LEN;
+    q->len -= n;
+
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+    return n;
+}
+
+/**
+ * Add bytes to a queue, waiting for room if it is full
+ * @return 0 on success, -1 if the reader is gone
+ */
+static int queue_write(struct text_queue *q, const char *buf, size_t len) {
+    pthread_mutex_lock(&q->lock);
+    while (len > 0) {
+        while (q->len == TEXT_QUEUE_LEN && !q->reader_closed) pthread_cond_wait(&q->changed, &q->lock);
+        if (q->reader_closed) break;
+
+        size_t tail = (q->head + q->len) % TEXT_QUEUE_LEN;
+        size_t n = TEXT_QUEUE_LEN - q->len < len ? TEXT_QUEUE_LEN - q->len : len;
+        size_t first = TEXT_QUEUE_LEN - tail < n ? TEXT_QUEUE_LEN - tail : n;
+        memcpy(q->buf + tail, buf, first);
+        memcpy(q->buf, buf + first, n - first);
+        q->len += n;
+        buf += n;
+        len -= n;
+        pthread_cond_broadcast(&q->changed);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return len > 0 ? -1 : 0;
+}
+
+/**
+ * Close a side of a queue, the queue is freed once both are closed
+ * @param q The queue
+ * @param reader true to close the side of the reader
+ */
+static void queue_close(struct text_queue *q, bool reader) {
+    pthread_mutex_lock(&q->lock);
+    if (reader) q->reader_closed = true;
+    else q->writer_closed = true;
+    bool unused = q->reader_closed && q->writer_closed;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+
+    if (unused) {
+        pthread_mutex_destroy(&q->lock);
+        pthread_cond_destroy(&q->changed);
+        free(q);
+    }
+}
+
+/**
+ * Read from a descriptor or a queue, retrying if interrupted
+ * @return The number of bytes read, 0 at the end, -1 on failure
+ */
+static ssize_t read_some(struct text_end in, char *buf, size_t len) {
+    if (in.queue != NULL) return queue_read(in.queue, buf, len);
+
+    ssize_t n;
+    do {
+        n = read(in.fd, buf, len);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1) perror("read failed");
+    return n;
+}
+
+/**
+ * Write bytes to a descriptor or a queue
+ *
+ * SIGPIPE is blocked by the caller : the signal raised by a reader which is gone is taken
+ * back, so the shell survives it
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int write_all(struct text_end out, const char *buf, size_t len) {
+    if (out.queue != NULL) return queue_write(out.queue, buf, len);
+
+    int fd = out.fd;
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) {
+            if (errno == EPIPE) {
+                sigset_t pipe_set;
+                sigemptyset(&pipe_set);
+                sigaddset(&pipe_set, SIGPIPE);
+                const struct timespec zero = { 0, 0 };
+                sigtimedwait(&pipe_set, NULL, &zero);
+            }
+            else {
+                perror("write failed");
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Write the waiting bytes
+ */
+static void out_flush(struct text_out *o) {
+    if (!o->broken && o->len > 0 && write_all(o->end, o->buf, o->len) == -1) o->broken = true;
+    o->len = 0;
+}
+
+/**
+ * Add bytes to write, large ones are written at once
+ */
+static void out_add(struct text_out *o, const char *data, size_t len) {
+    if (o->len + len > sizeof(o->buf)) out_flush(o);
+    if (len >= sizeof(o->buf)) {
+        if (!o->broken && write_all(o->end, data, len) == -1) o->broken = true;
+        return;
+    }
+    memcpy(o->buf + o->len, data, len);
+    o->len += len;
+}
+
+/**
+ * wc : count the lines, the words and the bytes
+ */
+static int run_wc(const struct text_cmd *tc, struct text_end in, struct text_out *o) {
+    char buf[TEXT_BUF_LEN];
+    size_t lines = 0, words = 0, bytes = 0;
+    bool in_word = false;
+    ssize_t n;
+    while ((n = read_some(in, buf, sizeof(buf))) > 0) {
+        bytes += n;
+        if (tc->lines) lines += count_newlines(buf, n);
+        if (tc->words) {
+            for (ssize_t i = 0; i < n; ++i) {
+                char c = buf[i];
+                bool space = c == ' ' || (c >= '\t' && c <= '\r');
+                words += !space && !in_word;
+                in_word = !space;
+            }
+        }
+    }
+
+    char line[96];
+    int len = 0;
+    size_t counts[3] = { lines, words, bytes };
+    bool shown[3] = { tc->lines, tc->words, tc->bytes };
+    int n_shown = tc->lines + tc->words + tc->bytes;
+    for (int i = 0; i < 3; ++i) {
+        if (!shown[i]) continue;
+        if (n_shown == 1) len += snprintf(line + len, sizeof(line) - len, "%zu", counts[i]);
+        else len += snprintf(line + len, sizeof(line) - len, "%s%7zu", len > 0 ? " " : "", counts[i]);
+    }
+    line[len++] = '\n';
+    out_add(o, line, len);
+    return n == -1 ? 1 : 0;
+}
+
+/**
+ * head : copy the first lines
+ */
+static int run_head(const struct text_cmd *tc, struct text_end in, struct text_out *o) {
+    char buf[TEXT_BUF_LEN];
+    size_t left = tc->n;
+    ssize_t n = 0;
+    while (left > 0 && !o->broken && (n = read_some(in, buf, sizeof(buf))) > 0) {
+        // Most blocks are copied whole
+        size_t len = n;
+        size_t newlines = count_newlines(buf, len);
+        if (newlines >= left) {
+            const char *p = buf;
+            for (; left > 0; --left) p = (const char *) memchr(p, '\n', buf + len - p) + 1;
+            len = p - buf;
+        }
+        else {
+            left -= newlines;
+        }
+        out_add(o, buf, len);
+    }
+    return n == -1 ? 1 : 0;
+}
+
+/**
+ * Find where the last lines of a buffer start, the last line may have no newline
+ * @param buf The buffer
+ * @param len The length of the buffer
+ * @param n The number of lines
+ * @return The offset of the first of the last "n" lines, 0 if there are fewer lines
+ */
+static size_t last_lines(const char *buf, size_t len, size_t n) {
+    if (n == 0) return len;
+    size_t end = len;
+    if (end > 0 && buf[end - 1] == '\n') --end;
+    for (size_t found = 0; end > 0;) {
+        const char *p = memrchr(buf, '\n', end);
+        if (p == NULL) return 0;
+        if (++found == n) return p + 1 - buf;
+        end = p - buf;
+    }
+    return 0;
+}
+
+/**
+ * tail : copy the last lines, keeping only the end of the input which may contain them
+ */
+static int run_tail(const struct text_cmd *tc, struct text_end in, struct text_out *o) {
+    char *buf = NULL;
+    size_t len = 0, cap = 0;
+    ssize_t n;
+    for (;;) {
+        if (cap - len < TEXT_BUF_LEN) {
+            // The lines before the last ones are dropped instead of growing
+            size_t start = last_lines(buf, len, tc->n);
+            if (start > 0) {
+                memmove(buf, buf + start, len - start);
+                len -= start;
+            }
+
+            // Twice what is kept, so the lines are looked for once per size of what is kept
+            if (cap - len < len + TEXT_BUF_LEN) {
+                size_t new_cap = 2 * (len + TEXT_BUF_LEN);
+                char *more = realloc(buf, new_cap);
+                if (more == NULL) {
+                    fprintf(stderr, "Memory allocation failure\n");
+                    free(buf);
+                    return 1;
+                }
+                buf = more;
+                cap = new_cap;
+            }
+        }
+        n = read_some(in, buf + len, cap - len);
+        if (n <= 0) break;
+        len += n;
+    }
+
+    size_t start = last_lines(buf, len, tc->n);
+    out_add(o, buf + start, len - start);
+    free(buf);
+    return n == -1 ? 1 : 0;
+}
+
+/**
+ * Read the input of sort
+ */
+static ssize_t sort_read(void *ctx, char *buf, size_t len) {
+    return read_some(*(struct text_end *) ctx, buf, len);
+}
+
+/**
+ * Write the output of sort
+ */
+static int sort_write(void *ctx, const char *buf, size_t len) {
+    struct text_out *o = ctx;
+    out_add(o, buf, len);
+    return o->broken ? -1 : 0;
+}
+
+/**
+ * sort : sort the lines in memory with several threads, through temporary files beyond the
+ * size of its buffer
+ */
+static int run_sort(const struct text_cmd *tc, struct text_end in, struct text_out *o) {
+    return sort_run(&tc->sort, sort_read, &in, sort_write, o);
+}
+
+/**
+ * grep -F : copy the lines containing the pattern, or the other ones
+ *
+ * Only complete lines are searched, the last incomplete one waits for the next block
+ */
+static int run_grep(const struct text_cmd *tc, struct text_end in, struct text_out *o) {
+    size_t cap = TEXT_BUF_LEN;
+    char *buf = malloc(cap);
+    if (buf == NULL) {
+        fprintf(stderr, "Memory allocation failure\n");
+        return 2;
+    }
+    size_t len = 0, selected = 0;
+    bool eof = false;
+    ssize_t n = 0;
+    while (!eof && !o->broken) {
+        if (len == cap) {
+            // A line longer than the buffer
+            char *more = realloc(buf, cap * 2);
+            if (more == NULL) {
+                fprintf(stderr, "Memory allocation failure\n");
+                free(buf);
+                return 2;
+            }
+            buf = more;
+            cap *= 2;
+        }
+        n = read_some(in, buf + len, cap - len);
+        if (n == -1) break;
+        eof = n == 0;
+        len += n;
+
+        // The last line gets its missing newline, there is room left by the previous block
+        if (eof && len > 0 && buf[len - 1] != '\n') buf[len++] = '\n';
+        const char *nl = memrchr(buf, '\n', len);
+        if (nl == NULL) continue;
+        size_t end = nl + 1 - buf;
+
+        size_t pos = 0;
+        while (pos < end) {
+            const char *m = find_fixed(buf + pos, end - pos, tc->pattern, tc->pattern_len);
+            size_t line_start = end, line_end = end;
+            if (m != NULL) {
+                const char *p = memrchr(buf + pos, '\n', m - (buf + pos));
+                line_start = p != NULL ? (size_t) (p + 1 - buf) : pos;
+                p = memchr(m, '\n', buf + end - m);
+                line_end = p != NULL ? (size_t) (p + 1 - buf) : end;
+            }
+
+            if (tc->invert) {
+                // Every line before the match is selected
+                selected += count_newlines(buf + pos, line_start - pos);
+                if (!tc->count) out_add(o, buf + pos, line_start - pos);
+            }
+            else if (m != NULL) {
+                ++selected;
+                if (!tc->count) out_add(o, buf + line_start, line_end - line_start);
+            }
+            pos = line_end;
+        }
+        memmove(buf, buf + end, len - end);
+        len -= end;
+    }
+    free(buf);
+
+    if (tc->count) {
+        char line[32];
+        int l = snprintf(line, sizeof(line), "%zu\n", selected);
+        out_add(o, line, l);
+    }
+    if (n == -1) return 2;
+    return selected > 0 ? 0 : 1;
+}
+
+/**
+ * Parse the number of lines of head and tail
+ * @return 0 on success, -1 if the options aren't supported
+ */
+static int parse_lines(const struct cmd *cmd, struct text_cmd *tc) {
+    tc->n = DEFAULT_LINES;
+    char *end;
+    if (cmd->n_args == 1) return 0;
+    if (cmd->n_args == 2 && cmd->args[1][0] == '-' && cmd->args[1][1] >= '0' && cmd->args[1][1] <= '9') {
+        tc->n = strtoul(cmd->args[1] + 1, &end, 10);
+        return *end == '\0' ? 0 : -1;
+    }
+    if (cmd->n_args == 3 && strcmp(cmd->args[1], "-n") == 0 && cmd->args[2][0] >= '0' && cmd->args[2][0] <= '9') {
+        tc->n = strtoul(cmd->args[2], &end, 10);
+        return *end == '\0' ? 0 : -1;
+    }
+    return -1;
+}
+
+void text_enable(void) {
+    enabled = true;
+}
+
+int text_parse(const struct cmd *cmd, struct text_cmd *tc) {
+    if (!enabled || cmd->n_args == 0) return -1;
+    memset(tc, 0, sizeof(struct text_cmd));
+    const char *name = cmd->args[0];
+
+    if (strcmp(name, "wc") == 0) {
+        tc->kind = TEXT_WC;
+        for (size_t i = 1; i < cmd->n_args; ++i) {
+            const char *a = cmd->args[i];
+            if (a[0] != '-' || a[1] == '\0') return -1;
+            for (size_t j = 1; a[j] != '\0'; ++j) {
+                if (a[j] == 'l') tc->lines = true;
+                else if (a[j] == 'w') tc->words = true;
+                else if (a[j] == 'c') tc->bytes = true;
+                else return -1;
+            }
+        }
+        if (!tc->lines && !tc->words && !tc->bytes) tc->lines = tc->words = tc->bytes = true;
+        return 0;
+    }
+    if (strcmp(name, "head") == 0 || strcmp(name, "tail") == 0) {
+        tc->kind = name[0] == 'h' ? TEXT_HEAD : TEXT_TAIL;
+        return parse_lines(cmd, tc);
+    }
+    if (strcmp(name, "grep") == 0 || strcmp(name, "fgrep") == 0) {
+        tc->kind = TEXT_GREP;
+        bool fixed = name[0] == 'f';
+        size_t i = 1;
+        for (; i < cmd->n_args && cmd->args[i][0] == '-' && cmd->args[i][1] != '\0'; ++i) {
+            const char *a = cmd->args[i];
+            if (strcmp(a, "--") == 0) {
+                ++i;
+                break;
+            }
+            for (size_t j = 1; a[j] != '\0'; ++j) {
+                if (a[j] == 'F') fixed = true;
+                else if (a[j] == 'v') tc->invert = true;
+                else if (a[j] == 'c') tc->count = true;
+                else return -1;
+            }
+        }
+        // Exactly one pattern, the standard input, and no regular expression
+        if (!fixed || i + 1 != cmd->n_args) return -1;
+        tc->pattern = strdup(cmd->args[i]);
+        if (tc->pattern == NULL) return -1;
+        tc->pattern_len = strlen(tc->pattern);
+        return 0;
+    }
+    if (strcmp(name, "sort") == 0) {
+        tc->kind = TEXT_SORT;
+        return sort_parse(cmd, &tc->sort);
+    }
+    return -1;
+}
+
+void text_cmd_reset(struct text_cmd *tc) {
+    free(tc->pattern);
+    tc->pattern = NULL;
+}
+
+struct text_queue *text_queue_new(void) {
+    struct text_queue *q = malloc(sizeof(struct text_queue));
+    if (q == NULL) {
+        fprintf(stderr, "Memory allocation failure\n");
+        return NULL;
+    }
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->changed, NULL);
+    q->head = 0;
+    q->len = 0;
+    q->writer_closed = false;
+    q->reader_closed = false;
+    return q;
+}
+
+void text_close_read(struct text_end end) {
+    if (end.queue != NULL) queue_close(end.queue, true);
+    else if (end.fd != -1) close(end.fd);
+}
+
+void text_close_write(struct text_end end) {
+    if (end.queue != NULL) queue_close(end.queue, false);
+    else if (end.fd != -1) close(end.fd);
+}
+
+int text_exec(const struct text_cmd *tc, struct text_end in, struct text_end out) {
+    // The SIGPIPE of a write to a closed pipe is taken back by write_all()
+    sigset_t pipe_set, old;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &old);
+
+    struct text_out *o = malloc(sizeof(struct text_out));
+    if (o == NULL) {
+        fprintf(stderr, "Memory allocation failure\n");
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        return 1;
+    }
+    o->end = out;
+    o->len = 0;
+    o->broken = false;
+
+    int status = 1;
+    switch (tc->kind) {
+        case TEXT_WC:
+            status = run_wc(tc, in, o);
+            break;
+        case TEXT_HEAD:
+            status = run_head(tc, in, o);
+            break;
+        case TEXT_TAIL:
+            status = run_tail(tc, in, o);
+            break;
+        case TEXT_GREP:
+            status = run_grep(tc, in, o);
+            break;
+        case TEXT_SORT:
+            status = run_sort(tc, in, o);
+            break;
+    }
+    out_flush(o);
+
+    // Like a command killed by SIGPIPE
+    if (o->broken && status == 0) status = 128 + SIGPIPE;
+    free(o);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return status;
+}
+
+/**
+ * Main function of the thread of a text builtin
+ */
+static void *text_main(void *arg) {
+    struct text_job *job = arg;
+    text_exec(&job->tc, job->in, job->out);
+    text_close_read(job->in);
+    text_close_write(job->out);
+    text_cmd_reset(&job->tc);
+    free(job);
+    return NULL;
+}
+
+int text_spawn(struct text_cmd *tc, struct text_end in, struct text_end out) {
+    struct text_job *job = malloc(sizeof(struct text_job));
+    if (job == NULL) {
+        fprintf(stderr, "Memory allocation failure\n");
+        return -1;
+    }
+    job->tc = *tc;
+    job->in = in;
+    job->out = out;
+    tc->pattern = NULL;
+
+    // The signals are handled by the main thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, text_main, job);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err) {
+        fprintf(stderr, "Failed to start the thread of a text builtin\n");
+        *tc = job->tc;
+        free(job);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
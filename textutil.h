@@ -0,0 +1,115 @@
+#ifndef TEXTUTIL_H
+#define TEXTUTIL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "cmdline.h"
+#include "sort.h"
+
+#define TEXT_BUF_LEN 65536
+
+#define TEXT_WC 0 // wc [-l] [-w] [-c]
+#define TEXT_HEAD 1 // head [-n N | -N]
+#define TEXT_TAIL 2 // tail [-n N | -N]
+#define TEXT_GREP 3 // grep -F [-v] [-c] PATTERN, or fgrep
+#define TEXT_SORT 4 // sort [-n] [-r] [-u] [-t C] [-k KEY]... [-S SIZE]
+
+struct text_queue;
+
+/**
+ * A side of the stream between a text builtin and its neighbour in the pipeline : a
+ * descriptor, or an in-memory queue when both commands are text builtins
+ */
+struct text_end {
+    int fd; // used when "queue" is NULL, -1 if none
+    struct text_queue *queue;
+};
+
+/**
+ * A text builtin with its options, independent of the line it comes from
+ */
+struct text_cmd {
+    int kind; // TEXT_* kind
+    bool lines, words, bytes; // counts of wc
+    size_t n; // lines of head and tail
+    bool invert, count; // options of grep
+    char *pattern; // fixed string of grep
+    size_t pattern_len;
+    struct sort_opts sort; // options of sort
+};
+
+/**
+ * Run wc, head, tail, fixed-string grep and sort in the shell instead of executing them
+ */
+void text_enable(void);
+
+/**
+ * Tells if a command can be run as a text builtin
+ *
+ * Only the standard input is read, a command with files or other options is executed
+ *
+ * @param cmd The command
+ * @param tc Retrieves the builtin, to be reset with text_cmd_reset()
+ *
+ * @return 0 if the command is a text builtin, -1 if it has to be executed
+ */
+int text_parse(const struct cmd *cmd, struct text_cmd *tc);
+
+/**
+ * Free what a text builtin holds
+ * @param tc The builtin
+ */
+void text_cmd_reset(struct text_cmd *tc);
+
+/**
+ * Run a text builtin in the calling thread, until the end of its input or until it doesn't
+ * need more
+ *
+ * A reader of "out" which is gone ends the builtin, instead of killing the shell with SIGPIPE
+ *
+ * @param tc The builtin
+ * @param in The stream to read
+ * @param out The stream to write
+ *
+ * @return the exit status of the builtin
+ */
+int text_exec(const struct text_cmd *tc, struct text_end in, struct text_end out);
+
+/**
+ * Run a text builtin in a thread of the shell
+ *
+ * The thread owns "tc", "in" and "out" : it closes the streams once done, so the next
+ * command of the pipeline sees the end of its input
+ *
+ * @param tc The builtin, moved to the thread
+ * @param in The stream to read
+ * @param out The stream to write
+ *
+ * @return 0 on success, -1 if the thread couldn't be started
+ */
+int text_spawn(struct text_cmd *tc, struct text_end in, struct text_end out);
+
+/**
+ * Create a queue passing bytes from a text builtin to the next one without system calls
+ *
+ * Reading an empty queue waits for the writer, and returns the end once it is closed. Writing
+ * to a queue whose reader is closed fails, like a pipe without a reader
+ *
+ * @return The queue, to be closed with text_close_read() and text_close_write(), NULL on failure
+ */
+struct text_queue *text_queue_new(void);
+
+/**
+ * Close the side of a stream which is read
+ * @param end The stream, nothing is done if it has neither a descriptor nor a queue
+ */
+void text_close_read(struct text_end end);
+
+/**
+ * Close the side of a stream which is written
+ * @param end The stream, nothing is done if it has neither a descriptor nor a queue
+ */
+void text_close_write(struct text_end end);
+
+#endif
@@ -0,0 +1,353 @@
+// The functions tested are static : the sources are included rather than linked
+#include "sort.c"
+#include "textutil.c"
+
+#define RED     "\x1b[31m"
+#define GREEN   "\x1b[32m"
+#define NC   "\x1b[0m"
+
+#define N_SPILLED 3000 // lines of the sort spilled to runs
+
+/**
+ * Print the result of a test
+ *
+ * This function is static : it means that it is a local function, accessible only in this source file.
+ *
+ * @param ok true if the test succeeded
+ * @param what description of the test, printed if it failed
+ */
+static void report(bool ok, const char *what) {
+    if (!ok) {
+        printf("%sUNEXPECTED RESULT OF %s%s\n", RED, what, NC);
+    }
+    else {
+        printf("%sTEST OK!%s\n", GREEN, NC);
+    }
+}
+
+/**
+ * Parse the options of a sort builtin
+ *
+ * This function is static : it means that it is a local function, accessible only in this source file.
+ *
+ * @param args the arguments of sort, without its name
+ * @param opts retrieves the options
+ * @return 0 on success, -1 if they aren't valid
+ */
+static int parse_sort(const char *args, struct sort_opts *opts) {
+    char str[BUFSIZ];
+    snprintf(str, sizeof(str), "sort %s", args);
+
+    struct line li;
+    struct line_ctx ctx;
+    line_init(&li);
+    line_ctx_init(&ctx);
+    int err = line_parse_r(&li, str, &ctx) || li.n_cmds != 1 || sort_parse(&li.cmds[0], opts);
+    line_reset(&li);
+    return err ? -1 : 0;
+}
+
+/**
+ * Naive count of the newlines, the reference of count_newlines()
+ */
+static size_t naive_newlines(const char *buf, size_t len) {
+    size_t n = 0;
+    for (size_t i = 0; i < len; ++i) n += buf[i] == '\n';
+    return n;
+}
+
+/**
+ * Naive search of a string, the reference of find_fixed()
+ */
+static const char *naive_find(const char *hay, size_t len, const char *needle, size_t n) {
+    for (size_t i = 0; i + n <= len; ++i) {
+        if (memcmp(hay + i, needle, n) == 0) return hay + i;
+    }
+    return NULL;
+}
+
+/**
+ * Test the count of the newlines
+ *
+ * This function is static : it means that it is a local function, accessible only in this source file.
+ * This function prints "TEST OK!" if count_newlines() finds as many newlines as a naive count,
+ * at every length and alignment, and past 255 blocks of 16 bytes full of newlines
+ */
+static void try_newlines(void) {
+    printf("TEST NEWLINES\n");
+
+    static char buf[255 * 16 * 3 + 40];
+    srand(1);
+    for (size_t i = 0; i < sizeof(buf); ++i) buf[i] = rand() % 4 == 0 ? '\n' : 'a' + rand() % 26;
+
+    bool ok = count_newlines(buf, 0) == 0;
+    for (size_t off = 0; off < 16 && ok; ++off) {
+        for (size_t len = 0; len <= 100 && ok; ++len) ok = count_newlines(buf + off, len) == naive_newlines(buf + off, len);
+    }
+    ok = ok && count_newlines(buf + 3, sizeof(buf) - 3) == naive_newlines(buf + 3, sizeof(buf) - 3);
+
+    // The byte counters would overflow without being added up
+    memset(buf, '\n', sizeof(buf));
+    ok = ok && count_newlines(buf, sizeof(buf)) == sizeof(buf);
+    ok = ok && count_newlines(buf + 1, sizeof(buf) - 1) == sizeof(buf) - 1;
+    report(ok, "THE COUNT OF THE NEWLINES");
+}
+
+/**
+ * Test the search of a fixed string
+ *
+ * This function is static : it means that it is a local function, accessible only in this source file.
+ * This function prints "TEST OK!" if find_fixed() finds the same occurrences as a naive search,
+ * across the blocks of 16 bytes, and nothing when the string is longer than the buffer
+ */
+static void try_find(void) {
+    printf("TEST FIND\n");
+
+    const char *hay = "0123456789abcdeFGHIJ0123456789abcdefghij";
+    size_t len = strlen(hay);
+    bool ok = find_fixed(hay, len, "eFGH", 4) == hay + 14 // across the first boundary of 16 bytes
+              && find_fixed(hay, len, "fghij", 5) == hay + 35 // at the very end
+              && find_fixed(hay, len, "ghijk", 5) == NULL // cut by the end
+              && find_fixed(hay, len, "abcdef", 6) == hay + 30 // after an occurrence of "abcde"
+              && find_fixed(hay, len, "", 0) == hay
+              && find_fixed(hay, len, "F", 1) == hay + 15
+              && find_fixed(hay, 3, "0123", 4) == NULL // longer than the buffer
+              && find_fixed(hay, 0, "0", 1) == NULL
+              && find_fixed(hay, len, hay, len) == hay;
+
+    // The first and the last bytes match, not the middle
+    const char *decoy = "xaxbx---------------xaaax";
+    ok = ok && find_fixed(decoy, strlen(decoy), "xaaax", 5) == decoy + 20;
+
+    // A small alphabet gives many partial matches
+    static char buf[300];
+    char needle[40];
+    srand(2);
+    for (size_t i = 0; i < sizeof(buf); ++i) buf[i] = 'a' + rand() % 3;
+    for (int round = 0; round < 2000 && ok; ++round) {
+        size_t off = rand() % 16;
+        size_t blen = rand() % (sizeof(buf) - 16);
+        size_t n = 1 + rand() % sizeof(needle);
+        if (rand() % 2) {
+            // Taken from the buffer, so that it is found
+            size_t from = rand() % (sizeof(buf) - n);
+            memcpy(needle, buf + from, n);
+        }
+        else {
+            for (size_t i = 0; i < n; ++i) needle[i] = 'a' + rand() % 3;
+        }
+        ok = find_fixed(buf + off, blen, needle, n) == naive_find(buf + off, blen, needle, n);
+    }
+    report(ok, "THE SEARCH OF A FIXED STRING");
+}
+
+/**
+ * Test the bounds of a key "-k F.C,F.C"
+ *
+ * This function is static : it means that it is a local function, accessible only in this source file.
+ * This function prints "TEST OK!" if the first key of the options starts at "start" in the line
+ * and is "len" bytes long, as sort --debug shows it
+ *
+ * @param args the options of sort
+ * @param text the line
+ * @param start the offset of the key
+ * @param len the length of the key
+ */
+static void try_key(const char *args, const char *text, size_t start, size_t len) {
+    printf("TEST KEY %s\n", args);
+
+    struct sort_opts opts;
+    bool ok = parse_sort(args, &opts) == 0 && opts.n_keys == 1;
+    if (ok) {
+        struct sort_line l = { .text = text, .len = strlen(text) };
+        const char *s = key_start(&opts, &opts.keys[0], &l), *e = key_end(&opts, &opts.keys[0], &l);
+        // compare() takes a key ending before its start as empty
+        if (e < s) e = s;
+        ok = (size_t) (s - text) == start && (size_t) (e - s) == len;
+    }
+    if (!ok) printf("%sUNEXPECTED KEY OF %s IN: %s%s\n", RED, args, text, NC);
+    else printf("%sTEST OK!%s\n", GREEN, NC);
+}
+
+/**
+ * Compare two numbers like sort -n
+ */
+static int numbers(const char *a, const char *b) {
+    return compare_numbers(a, a + strlen(a), b, b + strlen(b));
+}
+
+/**
+ * Test the comparison of the numbers
+ *
+ * This function is static : it means that it is a local function, accessible only in this source file.
+ * This function prints "TEST OK!" if -0 equals 0, if the fractions are compared digit by digit,
+ * and if text which isn't a number is 0
+ */
+static void try_numbers(void) {
+    printf("TEST NUMBERS\n");
+
+    bool ok = numbers("-0", "0") == 0
+              && numbers("-0.0", "0") == 0
+              && numbers("-0", "-1") > 0
+              && numbers("1.5", "1.50") == 0
+              && numbers("0.1", "0.05") > 0
+              && numbers(".25", "0.5") < 0
+              && numbers("-1.5", "-1.25") < 0
+              && numbers("-2", "-10") > 0
+              && numbers("007", "7") == 0
+              && numbers(" 12", "9") > 0
+              && numbers("abc", "0") == 0
+              && numbers("abc", "") == 0
+              && numbers("abc", "-1") > 0
+              && numbers("abc", "0.001") < 0
+              && numbers("12abc", "12") == 0
+              && numbers("123456789012345678901", "123456789012345678900") > 0;
+    report(ok, "THE COMPARISON OF THE NUMBERS");
+}
+
+/**
+ * Input of a sort in memory
+ */
+struct mem_in {
+    const char *data;
+    size_t len;
+    size_t pos;
+};
+
+/**
+ * Output of a sort in memory
+ */
+struct mem_out {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+static ssize_t mem_read(void *ctx, char *buf, size_t len) {
+    struct mem_in *in = ctx;
+    // Short reads, like a pipe
+    size_t n = in->len - in->pos < len ? in->len - in->pos : len;
+    if (n > 100) n = 100;
+    memcpy(buf, in->data + in->pos, n);
+    in->pos += n;
+    return n;
+}
+
+static int mem_write(void *ctx, const char *buf, size_t len) {
+    struct mem_out *out = ctx;
+    if (out->len + len > out->cap) {
+        size_t cap = (out->len + len) * 2;
+        char *more = realloc(out->data, cap);
+        if (more == NULL) return -1;
+        out->data = more;
+        out->cap = cap;
+    }
+    memcpy(out->data + out->len, buf, len);
+    out->len += len;
+    return 0;
+}
+
+/**
+ * Test a sort of lines in memory
+ *
+ * This function is static : it means that it is a local function, accessible only in this source file.
+ * This function prints "TEST OK!" if the output of the sort is the expected one, which is the
+ * output of sort in the C locale
+ *
+ * @param args the options of sort
+ * @param input the lines to sort
+ * @param expected the sorted lines
+ */
+static void try_sort(const char *args, const char *input, const char *expected) {
+    printf("TEST SORT %s\n", args);
+
+    struct sort_opts opts;
+    struct mem_in in = { .data = input, .len = strlen(input) };
+    struct mem_out out = { .data = NULL };
+    bool ok = parse_sort(args, &opts) == 0
+              && sort_run(&opts, mem_read, &in, mem_write, &out) == 0
+              && out.len == strlen(expected)
+              && memcmp(out.data, expected, out.len) == 0;
+    free(out.data);
+    if (!ok) printf("%sUNEXPECTED OUTPUT OF SORT %s%s\n", RED, args, NC);
+    else printf("%sTEST OK!%s\n", GREEN, NC);
+}
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/**
+ * Test a sort of more lines than its buffer holds
+ *
+ * This function is static : it means that it is a local function, accessible only in this source file.
+ * This function prints "TEST OK!" if the lines sorted through more runs than are merged at once
+ * are the lines sorted with qsort(), with and without -u
+ *
+ * @param unique true to sort with -u
+ */
+static void try_spill(bool unique) {
+    printf("TEST SPILL%s\n", unique ? " -u" : "");
+
+    static char input[N_SPILLED * 8];
+    static char lines[N_SPILLED][8];
+    char *sorted[N_SPILLED];
+    size_t len = 0;
+    srand(3);
+    for (size_t i = 0; i < N_SPILLED; ++i) {
+        // Few different lines, so that -u has some to drop
+        snprintf(lines[i], sizeof(lines[i]), "%05d", rand() % 1000);
+        len += snprintf(input + len, sizeof(input) - len, "%s\n", lines[i]);
+        sorted[i] = lines[i];
+    }
+    qsort(sorted, N_SPILLED, sizeof(char *), compare_strings);
+
+    struct mem_out expected = { .data = NULL };
+    bool ok = true;
+    for (size_t i = 0; i < N_SPILLED && ok; ++i) {
+        if (unique && i > 0 && strcmp(sorted[i - 1], sorted[i]) == 0) continue;
+        ok = mem_write(&expected, sorted[i], strlen(sorted[i])) == 0 && mem_write(&expected, "\n", 1) == 0;
+    }
+
+    // 6 lines per run : far more runs than SORT_MERGE_WAYS
+    struct sort_opts opts;
+    struct mem_in in = { .data = input, .len = len };
+    struct mem_out out = { .data = NULL };
+    ok = ok && parse_sort(unique ? "-u -S 40b" : "-S 40b", &opts) == 0
+         && opts.buffer_size == 40
+         && sort_run(&opts, mem_read, &in, mem_write, &out) == 0
+         && out.len == expected.len
+         && memcmp(out.data, expected.data, out.len) == 0;
+    free(out.data);
+    free(expected.data);
+    report(ok, unique ? "THE SPILLED SORT WITH -u" : "THE SPILLED SORT");
+}
+
+int main() {
+    try_newlines();
+    try_find();
+
+    try_key("-t : -k 2.2,3.1", "ab:cde:fgh:i", 4, 4);
+    try_key("-k 2.2,3.1", "ab  cde fgh i", 3, 5);
+    try_key("-k 2,2", "a b c", 1, 2);
+    try_key("-t : -k 2,2", "a:b:c", 2, 1);
+    try_key("-t : -k 1,2.0", "a:bc:d", 0, 4);
+    try_key("-k 1.2,1.3", "abcd", 1, 2);
+    try_key("-k 3.5", "ab cd", 5, 0);
+    try_key("-k 2.3,2.2", "ab cdef g", 4, 0);
+    try_key("-t : -k 2.2", "x:", 2, 0);
+
+    try_numbers();
+
+    try_sort("-n", "-0\n0\n-1\n0.5\n.25\nabc\n1.50\n1.5\n-0.0\n", "-1\n-0\n-0.0\n0\nabc\n.25\n0.5\n1.5\n1.50\n");
+    try_sort("-n -u", "-0\n0\n-1\n0.5\n.25\nabc\n1.50\n1.5\n-0.0\n", "-1\n-0\n.25\n0.5\n1.50\n");
+    try_sort("-u -k 2,2", "b 1\na 1\nc 2\na 2\n", "b 1\nc 2\n");
+    try_sort("-t : -k 2.2,3.1", "x:b2:c\ny:a9:d\nz:b1:a\nw:b1:b\n", "z:b1:a\nw:b1:b\nx:b2:c\ny:a9:d\n");
+    try_sort("-k 2.2,3.1", "x  b2 c\ny a9 d\nz b1 a\nw  b1 b\n", "w  b1 b\nx  b2 c\ny a9 d\nz b1 a\n");
+    try_sort("-r", "b\na\nc", "c\nb\na\n");
+
+    try_spill(false);
+    try_spill(true);
+
+    return 0;
+}
@@ -0,0 +1,246 @@
+#include "watch.h"
+#include "exec.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+
+#define WATCH_KILL_MS 1000 // time given to a stopped run before SIGKILL
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/**
+ * A path given to the builtin
+ */
+struct watched {
+    const char *path;
+    int wd; // -1 once the file was removed or replaced
+};
+
+/**
+ * The processes of a run of the line
+ */
+struct run {
+    pid_t pids[MAX_PIDS];
+    size_t n_pids; // PIDs not reaped yet
+    pid_t last_pid;
+    int stat; // status of the last command, as returned by waitpid()
+};
+
+/**
+ * Read the monotonic clock
+ * @return The time in milliseconds
+ */
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Watch the paths which aren't watched
+ * @param fd The inotify instance
+ * @param paths The paths
+ * @param n_paths The number of paths
+ * @return 0 on success, -1 if a path couldn't be watched
+ */
+static int add_watches(int fd, struct watched *paths, size_t n_paths) {
+    int err = 0;
+    for (size_t i = 0; i < n_paths; ++i) {
+        if (paths[i].wd != -1) continue;
+        paths[i].wd = inotify_add_watch(fd, paths[i].path, WATCH_EVENTS);
+        if (paths[i].wd == -1) {
+            fprintf(stderr, "watch-run: can't watch %s: %s\n", paths[i].path, strerror(errno));
+            err = -1;
+        }
+    }
+    return err;
+}
+
+/**
+ * Reap the ended processes of a run
+ * @param run The run
+ */
+static void reap(struct run *run) {
+    for (size_t i = 0; i < run->n_pids;) {
+        int stat;
+        if (waitpid(run->pids[i], &stat, WNOHANG) != run->pids[i]) {
+            ++i;
+            continue;
+        }
+        if (run->pids[i] == run->last_pid) run->stat = stat;
+        run->pids[i] = run->pids[--run->n_pids];
+    }
+}
+
+/**
+ * Stop the processes of a run, and reap them
+ * @param run The run
+ */
+static void stop_run(struct run *run) {
+    for (size_t i = 0; i < run->n_pids; ++i) kill(run->pids[i], SIGTERM);
+
+    long deadline = now_ms() + WATCH_KILL_MS;
+    bool killed = false;
+    for (;;) {
+        reap(run);
+        if (run->n_pids == 0) return;
+        if (!killed && now_ms() >= deadline) {
+            for (size_t i = 0; i < run->n_pids; ++i) kill(run->pids[i], SIGKILL);
+            killed = true;
+        }
+        struct timespec pause = { .tv_sec = 0, .tv_nsec = 10 * 1000000 };
+        nanosleep(&pause, NULL);
+    }
+}
+
+/**
+ * Read the changes of the watched paths
+ * @param fd The inotify instance
+ * @param paths The paths
+ * @param n_paths The number of paths
+ * @return true if something changed
+ */
+static bool read_changes(int fd, struct watched *paths, size_t n_paths) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    ssize_t len;
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len;) {
+            const struct inotify_event *event = (const struct inotify_event *) p;
+            p += sizeof(struct inotify_event) + event->len;
+
+            // A path replaced by another file is watched again before the next run
+            if (event->mask & IN_MOVE_SELF) inotify_rm_watch(fd, event->wd);
+            if (event->mask & IN_IGNORED) {
+                for (size_t i = 0; i < n_paths; ++i) {
+                    if (paths[i].wd == event->wd) paths[i].wd = -1;
+                }
+                continue;
+            }
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+int watch_run(const struct line *line) {
+    if (line->background) {
+        fprintf(stderr, "watch-run can't be run in the background\n");
+        return 1;
+    }
+
+    // watch-run [-d MS] PATH... -- COMMAND
+    char *const *args = line->cmds[0].args;
+    size_t n_args = line->cmds[0].n_args;
+    long debounce = WATCH_DEBOUNCE_MS;
+    size_t first = 1;
+    if (n_args > 2 && strcmp(args[1], "-d") == 0) {
+        debounce = strtol(args[2], NULL, 10);
+        first = 3;
+    }
+    size_t sep = first;
+    while (sep < n_args && strcmp(args[sep], "--") != 0) ++sep;
+    if (sep == first || sep + 1 >= n_args || debounce < 0) {
+        fprintf(stderr, "Usage: watch-run [-d MS] PATH... -- COMMAND [ARG...]\n");
+        return 1;
+    }
+
+    // The copy of the line runs from the command
+    struct line li;
+    line_init(&li);
+    struct watched *paths = malloc((sep - first) * sizeof(struct watched));
+    if (paths == NULL || line_dup(&li, line) == -1) {
+        fprintf(stderr, "Memory allocation failure\n");
+        free(paths);
+        return 1;
+    }
+    li.cmds[0].args += sep + 1;
+    li.cmds[0].n_args -= sep + 1;
+
+    size_t n_paths = sep - first;
+    for (size_t i = 0; i < n_paths; ++i) paths[i] = (struct watched) { .path = args[first + i], .wd = -1 };
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd == -1 || add_watches(fd, paths, n_paths) == -1) {
+        if (fd == -1) perror("inotify_init1 failed");
+        else close(fd);
+        free(paths);
+        line_reset(&li);
+        return 1;
+    }
+
+    // The runs end and SIGINT arrive through poll
+    sigset_t mask, old;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, &old);
+    int sigfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+
+    struct run run = { .n_pids = 0 };
+    int status = 0;
+    bool changed = true;
+    long deadline = now_ms();
+    bool stop = sigfd == -1;
+    while (!stop) {
+        if (changed && now_ms() >= deadline) {
+            if (run.n_pids > 0) {
+                fprintf(stderr, "watch-run: stopping the previous run\n");
+                stop_run(&run);
+            }
+            add_watches(fd, paths, n_paths);
+            changed = false;
+
+            int n_pids = launch_line(&li, NULL, run.pids);
+            if (n_pids <= 0) status = n_pids == 0 ? 0 : 1;
+            run.n_pids = n_pids > 0 ? n_pids : 0;
+            run.last_pid = n_pids > 0 ? run.pids[n_pids - 1] : -1;
+        }
+
+        // Coalesce the changes until they stop for the debounce time
+        long timeout = -1;
+        if (changed) timeout = deadline > now_ms() ? deadline - now_ms() : 0;
+        struct pollfd pfds[2] = {
+                { .fd = sigfd, .events = POLLIN },
+                { .fd = fd, .events = POLLIN }
+        };
+        if (poll(pfds, 2, timeout) == -1) {
+            if (errno == EINTR) continue;
+            perror("poll failed");
+            break;
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            while (read(sigfd, &info, sizeof(info)) == sizeof(info)) {
+                if (info.ssi_signo == SIGINT) stop = true;
+            }
+            bool running = run.n_pids > 0;
+            reap(&run);
+            if (running && run.n_pids == 0) {
+                status = WIFEXITED(run.stat) ? WEXITSTATUS(run.stat) : 128 + WTERMSIG(run.stat);
+                fprintf(stderr, "watch-run: exit status %i, waiting for changes\n", status);
+            }
+        }
+        if ((pfds[1].revents & POLLIN) && read_changes(fd, paths, n_paths)) {
+            changed = true;
+            deadline = now_ms() + debounce;
+        }
+    }
+
+    if (run.n_pids > 0) stop_run(&run);
+    if (sigfd != -1) close(sigfd);
+    close(fd);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    free(paths);
+    line_reset(&li);
+    return status;
+}
@@ -0,0 +1,22 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "cmdline.h"
+
+#define WATCH_DEBOUNCE_MS 100 // quiet time after a change before running again
+
+/**
+ * The watch-run builtin : watch-run [-d MS] PATH... -- COMMAND LINE
+ *
+ * Runs the line, then runs it again each time a file or a directory of the paths changes.
+ * Directories are not watched recursively. The changes are coalesced until none happened for
+ * MS milliseconds, WATCH_DEBOUNCE_MS by default. A run still going on when the line has to run
+ * again is stopped with SIGTERM, then SIGKILL if it doesn't end. Returns on SIGINT
+ *
+ * @param line The line, in the foreground, starting with "watch-run"
+ *
+ * @return the exit status of the last complete run, 128 + N if it was killed by the signal N
+ */
+int watch_run(const struct line *line);
+
+#endif
@@ -0,0 +1,415 @@
+#define _GNU_SOURCE // CLONE_PARENT, MSG_CMSG_CLOEXEC
+
+#include "zygote.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#define MAX_ZYGOTES 64
+#define ZYGOTE_STD_FDS 4 // stdin, stdout, stderr and working directory
+#define ZYGOTE_USER_FD_MIN 3
+#define ZYGOTE_USER_FD_MAX 9 // descriptors of the user, sent with a command when they are open
+#define ZYGOTE_MAX_FDS (ZYGOTE_STD_FDS + ZYGOTE_USER_FD_MAX - ZYGOTE_USER_FD_MIN + 1)
+#define ZYGOTE_MIN_FD 10 // internal descriptors stay above the ones of the user
+
+#define ZYGOTE_IGNORE_SIGCHLD 1
+
+extern char **environ;
+
+/**
+ * Header of a request sent to a helper, followed by "argc" then "envc" strings
+ * each terminated by a '\0'
+ */
+struct zygote_request {
+    uint32_t flags;
+    uint32_t user_fds; // bit N set if the descriptor ZYGOTE_USER_FD_MIN + N is sent
+    uint32_t argc;
+    uint32_t envc;
+};
+
+struct zygote {
+    pid_t pid;
+    int sock; // -1 if this slot of the pool is empty
+};
+
+static struct zygote pool[MAX_ZYGOTES];
+static size_t pool_size = 0;
+
+static int zygote_sock = -1; // control socket of the process forking the helpers
+static size_t n_requested = 0; // helpers asked for and not received yet
+
+// Commands may be launched by other threads than the main one
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Move a descriptor above the ones of the user
+ * @param fd The descriptor, closed if it is moved
+ * @return The new descriptor, close-on-exec, or "fd" if it couldn't be moved
+ */
+static int move_fd(int fd) {
+    int moved = fcntl(fd, F_DUPFD_CLOEXEC, ZYGOTE_MIN_FD);
+    if (moved == -1) return fd;
+    close(fd);
+    return moved;
+}
+
+/**
+ * Main loop of a helper : wait for a request and execute it
+ * @param sock The socket to read the request from
+ */
+static void helper_main(int sock) {
+    // Get the size of the request
+    ssize_t size;
+    do {
+        size = recv(sock, NULL, 0, MSG_PEEK | MSG_TRUNC);
+    } while (size == -1 && errno == EINTR);
+    if (size < (ssize_t) sizeof(struct zygote_request)) _exit(0);
+
+    char *buf = malloc(size);
+    if (buf == NULL) _exit(1);
+
+    union {
+        char buf[CMSG_SPACE(ZYGOTE_MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+    struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control.buf,
+            .msg_controllen = sizeof(control.buf)
+    };
+    ssize_t received;
+    do {
+        received = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (received == -1 && errno == EINTR);
+    close(sock);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (received != size || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) _exit(1);
+    size_t n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    struct zygote_request req;
+    memcpy(&req, buf, sizeof(req));
+    if (n_fds != ZYGOTE_STD_FDS + (size_t) __builtin_popcount(req.user_fds)) _exit(1);
+    int fds[ZYGOTE_MAX_FDS];
+    memcpy(fds, CMSG_DATA(cmsg), n_fds * sizeof(int));
+
+    // Rebuild argv and envp
+    char **args = calloc(req.argc + 1, sizeof(char *));
+    char **envp = calloc(req.envc + 1, sizeof(char *));
+    if (args == NULL || envp == NULL) _exit(1);
+    char *str = buf + sizeof(req);
+    for (uint32_t i = 0; i < req.argc + req.envc; ++i) {
+        if (i < req.argc) args[i] = str;
+        else envp[i - req.argc] = str;
+        str += strlen(str) + 1;
+    }
+
+    // The shell may have blocked signals when it forked the helper
+    sigset_t empty;
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+
+    if (req.flags & ZYGOTE_IGNORE_SIGCHLD) {
+        struct sigaction action;
+        action.sa_flags = 0;
+        sigemptyset(&action.sa_mask);
+        action.sa_handler = SIG_IGN;
+        sigaction(SIGCHLD, &action, NULL);
+    }
+
+    // The received descriptors may have the numbers they are moved to
+    for (size_t i = 0; i < n_fds; ++i) fds[i] = move_fd(fds[i]);
+
+    // Take the place of the command : the descriptors of the user are the ones the shell has now
+    if (fchdir(fds[3]) == -1) perror("Failed to set working directory");
+    size_t next = ZYGOTE_STD_FDS;
+    for (int fd = ZYGOTE_USER_FD_MIN; fd <= ZYGOTE_USER_FD_MAX; ++fd) {
+        if (req.user_fds & (1u << (fd - ZYGOTE_USER_FD_MIN))) dup2(fds[next++], fd);
+        else close(fd);
+    }
+    for (int i = 0; i < 3; ++i) dup2(fds[i], i);
+
+    signal(SIGINT, SIG_DFL);
+    environ = envp;
+    execvp(args[0], args);
+    perror("execvp failed");
+    _exit(1);
+}
+
+/**
+ * Fork a helper for the shell, and send it to the shell
+ * @param ctl The control socket of the zygote process
+ * @return 0 on success, -1 on failure
+ */
+static int fork_helper(int ctl) {
+    int socks[2];
+    pid_t pid = -1;
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, socks) == -1) {
+        perror("socketpair failed");
+    }
+    else {
+        socks[0] = move_fd(socks[0]);
+        socks[1] = move_fd(socks[1]);
+
+        // The helper is a child of the shell, which waits for the command it becomes.
+        // Without a stack, clone() duplicates the process like fork()
+        pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL, NULL);
+        if (pid == 0) {
+            close(ctl);
+            close(socks[0]);
+            helper_main(socks[1]);
+        }
+        if (pid == -1) perror("clone failed");
+        close(socks[1]);
+    }
+
+    // The shell is told about failures too, so it can ask again
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = { .iov_base = &pid, .iov_len = sizeof(pid) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    if (pid != -1) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &socks[0], sizeof(int));
+    }
+    ssize_t sent = sendmsg(ctl, &msg, MSG_NOSIGNAL);
+    if (pid != -1) close(socks[0]);
+    return sent == sizeof(pid) && pid != -1 ? 0 : -1;
+}
+
+/**
+ * Main loop of the zygote process : fork the helpers the shell asks for
+ * @param ctl The control socket, the process ends when the shell closes it
+ */
+static void zygote_main(int ctl) {
+    // The helpers are children of the shell, which handles their end.
+    // Interrupting the shell must not reach the idle helpers
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGINT, SIG_IGN);
+
+    // The descriptors of the user are sent with each command
+    for (int fd = ZYGOTE_USER_FD_MIN; fd <= ZYGOTE_USER_FD_MAX; ++fd) close(fd);
+    for (;;) {
+        uint32_t n;
+        ssize_t len = recv(ctl, &n, sizeof(n), 0);
+        if (len == -1 && errno == EINTR) continue;
+        if (len != sizeof(n)) _exit(0);
+        while (n-- > 0) {
+            if (fork_helper(ctl) == -1) break;
+        }
+    }
+}
+
+/**
+ * Take the helpers sent by the zygote process, without waiting for them
+ *
+ * The pool must be locked by the caller
+ */
+static void receive_helpers(void) {
+    while (n_requested > 0) {
+        pid_t pid;
+        union {
+            char buf[CMSG_SPACE(sizeof(int))];
+            struct cmsghdr align;
+        } control;
+        struct iovec iov = { .iov_base = &pid, .iov_len = sizeof(pid) };
+        struct msghdr msg = {
+                .msg_iov = &iov,
+                .msg_iovlen = 1,
+                .msg_control = control.buf,
+                .msg_controllen = sizeof(control.buf)
+        };
+        ssize_t received = recvmsg(zygote_sock, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (received == -1 && errno == EINTR) continue;
+        if (received != sizeof(pid)) {
+            // Nothing more for now, or the zygote process is gone
+            if (received == 0) n_requested = 0;
+            return;
+        }
+        --n_requested;
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (pid == -1 || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        int sock;
+        memcpy(&sock, CMSG_DATA(cmsg), sizeof(int));
+
+        size_t i = 0;
+        while (i < pool_size && pool[i].sock != -1) ++i;
+        if (i == pool_size) {
+            // The helper exits once its socket is closed
+            close(sock);
+            continue;
+        }
+        pool[i].pid = pid;
+        pool[i].sock = move_fd(sock);
+    }
+}
+
+/**
+ * Ask the zygote process for the helpers missing from the pool, without waiting for them
+ *
+ * The pool must be locked by the caller
+ */
+static void request_helpers(void) {
+    if (zygote_sock == -1) return;
+    size_t ready = 0;
+    for (size_t i = 0; i < pool_size; ++i) ready += pool[i].sock != -1;
+    if (ready + n_requested >= pool_size) return;
+
+    uint32_t n = pool_size - ready - n_requested;
+    if (send(zygote_sock, &n, sizeof(n), MSG_DONTWAIT | MSG_NOSIGNAL) == sizeof(n)) n_requested += n;
+}
+
+int zygote_init(size_t n_helpers) {
+    if (n_helpers > MAX_ZYGOTES) {
+        fprintf(stderr, "Too much helpers. Max: %i\n", MAX_ZYGOTES);
+        return -1;
+    }
+
+    int ctl[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, ctl) == -1) {
+        perror("socketpair failed");
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork failed");
+        close(ctl[0]);
+        close(ctl[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(ctl[0]);
+        zygote_main(move_fd(ctl[1]));
+    }
+    close(ctl[1]);
+
+    pthread_mutex_lock(&pool_lock);
+    zygote_sock = move_fd(ctl[0]);
+    pool_size = n_helpers;
+    for (size_t i = 0; i < pool_size; ++i) pool[i].sock = -1;
+    request_helpers();
+    pthread_mutex_unlock(&pool_lock);
+    return 0;
+}
+
+void zygote_refill(void) {
+    pthread_mutex_lock(&pool_lock);
+    receive_helpers();
+    request_helpers();
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/**
+ * Serialize a request and send it to a helper
+ * @return 0 on success, -1 on failure
+ */
+static int zygote_send(int sock, char *const *argv, const int *fds, size_t n_fds, uint32_t user_fds, uint32_t flags) {
+    struct zygote_request req = { .flags = flags, .user_fds = user_fds, .argc = 0, .envc = 0 };
+    size_t size = sizeof(req);
+    for (char *const *arg = argv; *arg != NULL; ++arg, ++req.argc) size += strlen(*arg) + 1;
+    for (char **env = environ; *env != NULL; ++env, ++req.envc) size += strlen(*env) + 1;
+
+    char *buf = malloc(size);
+    if (buf == NULL) return -1;
+    memcpy(buf, &req, sizeof(req));
+    char *str = buf + sizeof(req);
+    for (char *const *arg = argv; *arg != NULL; ++arg) str = stpcpy(str, *arg) + 1;
+    for (char **env = environ; *env != NULL; ++env) str = stpcpy(str, *env) + 1;
+
+    union {
+        char buf[CMSG_SPACE(ZYGOTE_MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+    struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control.buf,
+            .msg_controllen = CMSG_SPACE(n_fds * sizeof(int))
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(n_fds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, n_fds * sizeof(int));
+
+    ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    free(buf);
+    return sent == (ssize_t) size ? 0 : -1;
+}
+
+pid_t zygote_spawn(char *const *argv, int in_fd, int out_fd, int err_fd, bool ignore_sigchld) {
+    assert(argv);
+    assert(argv[0]);
+
+    int cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cwd == -1) return -1;
+    int fds[ZYGOTE_MAX_FDS] = { in_fd, out_fd, err_fd, cwd };
+
+    // The command gets the descriptors of the user a forked child would keep after exec
+    size_t n_fds = ZYGOTE_STD_FDS;
+    uint32_t user_fds = 0;
+    for (int fd = ZYGOTE_USER_FD_MIN; fd <= ZYGOTE_USER_FD_MAX; ++fd) {
+        int flags = fcntl(fd, F_GETFD);
+        if (flags == -1 || (flags & FD_CLOEXEC)) continue;
+        user_fds |= 1u << (fd - ZYGOTE_USER_FD_MIN);
+        fds[n_fds++] = fd;
+    }
+
+    pid_t pid = -1;
+    pthread_mutex_lock(&pool_lock);
+    receive_helpers();
+    for (size_t i = 0; i < pool_size && pid == -1; ++i) {
+        if (pool[i].sock == -1) continue;
+
+        // The helper is consumed whether the request was sent or not
+        int err = zygote_send(
+                pool[i].sock, argv, fds, n_fds, user_fds, ignore_sigchld ? ZYGOTE_IGNORE_SIGCHLD : 0
+        );
+        close(pool[i].sock);
+        pool[i].sock = -1;
+        if (!err) pid = pool[i].pid;
+    }
+    // The replacement is forked by the zygote process while the command runs
+    request_helpers();
+    pthread_mutex_unlock(&pool_lock);
+
+    close(cwd);
+    return pid;
+}
+
+void zygote_shutdown(void) {
+    // Helpers exit when their socket is closed, and the zygote process when its control socket is
+    pthread_mutex_lock(&pool_lock);
+    for (size_t i = 0; i < pool_size; ++i) {
+        if (pool[i].sock != -1) close(pool[i].sock);
+        pool[i].sock = -1;
+    }
+    pool_size = 0;
+    if (zygote_sock != -1) close(zygote_sock);
+    zygote_sock = -1;
+    n_requested = 0;
+    pthread_mutex_unlock(&pool_lock);
+}
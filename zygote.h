@@ -0,0 +1,51 @@
+#ifndef ZYGOTE_H
+#define ZYGOTE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/**
+ * Start a pool of pre-forked helper processes
+ *
+ * Each helper waits on a Unix socket for a command to execute. The helpers are
+ * forked by a small zygote process started here, so this must be called as early
+ * as possible, while the memory of the shell is still small
+ *
+ * @param n_helpers number of helpers to keep in the pool
+ *
+ * @return 0 on success, -1 on failure
+ */
+int zygote_init(size_t n_helpers);
+
+/**
+ * Take the helpers forked by the zygote process, and ask for the missing ones
+ *
+ * It never forks nor waits : the zygote process forks the helpers in the background
+ */
+void zygote_refill(void);
+
+/**
+ * Hand a command to a helper of the pool
+ *
+ * The helper is consumed : it becomes the process of the command, so the
+ * returned PID can be waited for like the PID of a forked child.
+ * The file descriptors are sent to the helper with SCM_RIGHTS, along with the descriptors 3 to 9
+ * the shell has without close-on-exec. The caller keeps its own copies
+ *
+ * @param argv NULL terminated arguments of the command
+ * @param in_fd the file descriptor to use as standard input
+ * @param out_fd the file descriptor to use as standard output
+ * @param err_fd the file descriptor to use as standard error output
+ * @param ignore_sigchld true if the helper must ignore SIGCHLD before executing the command
+ *
+ * @return the PID of the helper running the command, -1 if no helper is available
+ */
+pid_t zygote_spawn(char *const *argv, int in_fd, int out_fd, int err_fd, bool ignore_sigchld);
+
+/**
+ * Stop all the idle helpers of the pool
+ */
+void zygote_shutdown(void);
+
+#endif